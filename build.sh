@@ -1,3 +1,4 @@
 #!/bin/sh
 
-mpicc -Ofast -march=native convert_graph.c lut.c sboxgates.c state.c  -Wall -Wpedantic -o sboxgates -lmsgpackc
+mpicc -Ofast convert_graph.c incumbent.c kernels.c lut.c sboxgates.c state.c subcircuits.c transposition.c  -Wall -Wpedantic -Wno-psabi -o sboxgates -lmsgpackc -pthread
+mpicc -Ofast gen_subcircuits.c state.c subcircuits.c -Wall -Wpedantic -Wno-psabi -o gen_subcircuits -lmsgpackc
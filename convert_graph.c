@@ -27,21 +27,11 @@
 
 /* Prints a truth table to the console. Used for debugging. */
 void print_ttable(ttable tbl) {
-  uint64_t vec[4];
-  _mm256_storeu_si256((ttable*)vec, tbl);
-  uint64_t *var = &vec[0];
-  for (uint16_t i = 0; i < 256; i++) {
-    if (i == 64) {
-      var = &vec[1];
-    } else if (i == 128) {
-      var = &vec[2];
-    } else if (i == 192) {
-      var = &vec[3];
-    }
+  for (int i = 0; i < TTABLE_BITS; i++) {
     if (i != 0 && i % 16 == 0) {
       printf("\n");
     }
-    printf("%" PRIu64, (*var >> (i % 64)) & 1);
+    printf("%" PRIu64, (tbl[i / 64] >> (i % 64)) & 1);
   }
   printf("\n");
 }
@@ -90,7 +80,7 @@ void print_digraph(const state st) {
       printf("  gt%" PRIgatenum " -> gt%d;\n", st.gates[gt].in3, gt);
     }
   }
-  for (uint8_t i = 0; i < 8; i++) {
+  for (uint8_t i = 0; i < MAX_OUTPUTS; i++) {
     if (st.outputs[i] != NO_GATE) {
       printf("  gt%" PRIgatenum " -> out%" PRIu8 ";\n", st.outputs[i], i);
     }
@@ -104,7 +94,7 @@ static bool get_c_variable_name(const state st, const gatenum gate, char *buf, b
     sprintf(buf, "in.b%" PRIgatenum, gate);
     return false;
   }
-  for (uint8_t i = 0; i < get_num_inputs(&st); i++) {
+  for (uint8_t i = 0; i < MAX_OUTPUTS; i++) {
     if (st.outputs[i] == gate) {
       sprintf(buf, "%sout%d", ptr_out ? "*" : "", i);
       return false;
@@ -126,7 +116,7 @@ bool print_c_function(const state st) {
 
   int num_outputs = 0;
   int outp_num = 0;
-  for (int outp = 0; outp < get_num_inputs(&st); outp++) {
+  for (int outp = 0; outp < MAX_OUTPUTS; outp++) {
     if (st.outputs[outp] != NO_GATE) {
       num_outputs += 1;
       outp_num = outp;
@@ -155,7 +145,7 @@ bool print_c_function(const state st) {
   if (cuda) {
     if (num_outputs > 1) {
       printf("__device__ __forceinline__ void s(bits in");
-      for (int outp = 0; outp < 8; outp++) {
+      for (int outp = 0; outp < MAX_OUTPUTS; outp++) {
         if (st.outputs[outp] != NO_GATE) {
           printf(", %s *out%d", TYPE, outp);
         }
@@ -167,7 +157,7 @@ bool print_c_function(const state st) {
   } else {
     if (num_outputs > 1) {
       printf("static inline void s(bits in");
-      for (int outp = 0; outp < get_num_inputs(&st); outp++) {
+      for (int outp = 0; outp < MAX_OUTPUTS; outp++) {
         if (st.outputs[outp] != NO_GATE) {
           printf(", %s *out%d", TYPE, outp);
         }
@@ -0,0 +1,193 @@
+/* gen_subcircuits.c
+
+   Generates the database of minimum circuits for four input functions that is loaded by sboxgates
+   with the -u option. All circuits with up to SUBCIRCUIT_MAX_GATES gates are enumerated, and the
+   cheapest one for each function is saved.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "subcircuits.h"
+
+#define NUM_SIGNALS (4 + SUBCIRCUIT_MAX_GATES)
+
+/* A circuit under construction. */
+typedef struct {
+  subcircuit circuit;
+  uint16_t tables[NUM_SIGNALS]; /* Truth tables of the inputs and gates. */
+  uint16_t unused;              /* Bit i is set if gate i is not used by any other gate. */
+  int desc[SUBCIRCUIT_MAX_GATES];
+} partial_circuit;
+
+static subcircuit_db g_db;
+static gate_type g_types[5];
+static int g_num_types;
+
+static inline int gate_cost(gate_type type) {
+  return g_db.cost_metric == SAT ? get_sat_metric(type) : 1;
+}
+
+/* Enumerates all circuits with exactly max_gates gates in which every gate but the last is used
+   by a later gate, and records the last gate of each in the database if it is cheaper than the
+   circuit already there. To avoid enumerating the same circuit in several gate orders, a gate that
+   does not use the gate before it must have a greater descriptor than that gate. */
+static void enumerate(partial_circuit *pc, int max_gates) {
+  const int n = pc->circuit.num_gates;
+  if (n == max_gates) {
+    const uint16_t func = pc->tables[4 + n - 1];
+    subcircuit *best = &g_db.circuits[func];
+    if (best->num_gates == 0 || pc->circuit.cost < best->cost) {
+      *best = pc->circuit;
+    }
+    return;
+  }
+
+  /* Each remaining gate can use up at most one more unused gate than it adds. */
+  const int remaining = max_gates - n;
+  if (__builtin_popcount(pc->unused) > remaining + 1) {
+    return;
+  }
+
+  const int num_signals = 4 + n;
+  for (int t = 0; t < g_num_types; t++) {
+    const gate_type type = g_types[t];
+    for (int in1 = 0; in1 < num_signals; in1++) {
+      for (int in2 = type == NOT ? in1 : 0; in2 < num_signals; in2++) {
+        if (type != NOT && (in1 == in2 || (type != ANDNOT && in2 < in1))) {
+          continue;
+        }
+        if (type == NOT && in2 != in1) {
+          break;
+        }
+        const bool uses_prev = n > 0 && (in1 == num_signals - 1 || in2 == num_signals - 1);
+        const int desc = (t * NUM_SIGNALS + in1) * NUM_SIGNALS + in2;
+        if (n > 0 && !uses_prev && desc <= pc->desc[n - 1]) {
+          continue;
+        }
+        uint16_t unused = pc->unused;
+        if (in1 >= 4) {
+          unused &= ~(1 << (in1 - 4));
+        }
+        if (in2 >= 4) {
+          unused &= ~(1 << (in2 - 4));
+        }
+        if (n == max_gates - 1 && unused != 0) {
+          continue;
+        }
+
+        const uint16_t a = pc->tables[in1];
+        const uint16_t b = pc->tables[in2];
+        uint16_t out;
+        switch (type) {
+          case NOT:
+            out = ~a;
+            break;
+          case AND:
+            out = a & b;
+            break;
+          case OR:
+            out = a | b;
+            break;
+          case XOR:
+            out = a ^ b;
+            break;
+          case ANDNOT:
+            out = ~a & b;
+            break;
+          default:
+            assert(0);
+        }
+        /* Gates that duplicate another signal or are constant are never in a minimum circuit. */
+        bool redundant = out == 0 || out == 0xffff;
+        for (int i = 0; !redundant && i < num_signals; i++) {
+          redundant = out == pc->tables[i];
+        }
+        if (redundant) {
+          continue;
+        }
+
+        partial_circuit next = *pc;
+        next.circuit.type[n] = type;
+        next.circuit.in1[n] = in1;
+        next.circuit.in2[n] = in2;
+        next.circuit.num_gates = n + 1;
+        next.circuit.cost += gate_cost(type);
+        next.tables[num_signals] = out;
+        next.unused = unused | (1 << n);
+        next.desc[n] = desc;
+        enumerate(&next, max_gates);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  bool andnot = false;
+  metric cost_metric = GATES;
+  int c;
+  while ((c = getopt(argc, argv, "hns")) != -1) {
+    switch (c) {
+      case 'h':
+        printf(
+            "gen_subcircuits (c) 2019 Marcus Dansarie <marcus@dansarie.se>\n\n"
+            "Usage: gen_subcircuits [-n] [-s] file\n\n"
+            "-h        Display this help.\n"
+            "-n        Use ANDNOT gates.\n"
+            "-s        Use SAT metric.\n");
+        return 0;
+      case 'n':
+        andnot = true;
+        break;
+      case 's':
+        cost_metric = SAT;
+        break;
+      default:
+        return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "No output file name argument.\n");
+    return 1;
+  }
+
+  memset(&g_db, 0, sizeof(g_db));
+  g_db.andnot = andnot;
+  g_db.cost_metric = cost_metric;
+  g_types[0] = NOT;
+  g_types[1] = AND;
+  g_types[2] = OR;
+  g_types[3] = XOR;
+  g_types[4] = ANDNOT;
+  g_num_types = andnot ? 5 : 4;
+
+  for (int max_gates = 1; max_gates <= SUBCIRCUIT_MAX_GATES; max_gates++) {
+    partial_circuit pc;
+    memset(&pc, 0, sizeof(pc));
+    memcpy(pc.tables, SUBCIRCUIT_INPUTS, sizeof(SUBCIRCUIT_INPUTS));
+    enumerate(&pc, max_gates);
+    int count = 0;
+    for (int f = 0; f < SUBCIRCUIT_FUNCS; f++) {
+      count += g_db.circuits[f].num_gates == max_gates;
+    }
+    printf("%d gates: %d functions.\n", max_gates, count);
+  }
+
+  return save_subcircuits(argv[optind], &g_db) ? 0 : 1;
+}
@@ -0,0 +1,199 @@
+/* incumbent.c
+
+   The incumbent bound: limits on the size of the circuits worth building, given by the best
+   circuit that any thread or rank has found in the current search. add_gate and add_lut check
+   them next to the limits of the state, so that every search stops building circuits that can not
+   beat a circuit found elsewhere. Within a rank, the limits are atomics that any thread may lower.
+   Between ranks, they are sent asynchronously by the thread that makes the MPI calls. A deadline
+   sets the limits to zero, which makes all searches give up.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <limits.h>
+#include <mpi.h>
+#include <stdlib.h>
+#include <time.h>
+#include "incumbent.h"
+
+#define INCUMBENT_TAG 3 /* Tags 1 and 2 are used by the LUT searches. */
+
+gatenum g_incumbent_gates = MAX_GATES;
+int g_incumbent_sat_metric = INT_MAX;
+bool g_incumbent_expired = false;
+
+/* A message with new limits. Messages from another group or an earlier search are ignored. */
+typedef struct {
+  int group;
+  int search;
+  int max_gates;
+  int max_sat_metric;
+} incumbent_msg;
+
+static __thread bool g_mpi_thread = false;  /* Set for the thread that called init_incumbent. */
+static int g_rank = 0;
+static int g_size = 1;
+static int g_group = 0;
+static int g_search = 0;                    /* Number of the current search. */
+static double g_deadline = 0;               /* Monotonic clock time in seconds, 0 if none. */
+static MPI_Request *g_send_requests = NULL; /* Indexed by rank. */
+static incumbent_msg *g_send_msgs = NULL;   /* Send buffers, indexed by rank. */
+static incumbent_msg *g_known = NULL;       /* The limits that each rank is known to have. */
+
+bool init_incumbent() {
+  MPI_Comm_rank(MPI_COMM_WORLD, &g_rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &g_size);
+  g_send_requests = malloc(sizeof(MPI_Request) * g_size);
+  g_send_msgs = malloc(sizeof(incumbent_msg) * g_size);
+  g_known = malloc(sizeof(incumbent_msg) * g_size);
+  if (g_send_requests == NULL || g_send_msgs == NULL || g_known == NULL) {
+    free(g_send_requests);
+    free(g_send_msgs);
+    free(g_known);
+    g_send_requests = NULL;
+    g_send_msgs = NULL;
+    g_known = NULL;
+    return false;
+  }
+  for (int i = 0; i < g_size; i++) {
+    g_send_requests[i] = MPI_REQUEST_NULL;
+  }
+  g_mpi_thread = true;
+  reset_incumbent();
+  return true;
+}
+
+/* Applies all messages received from other ranks. */
+static void receive_incumbent() {
+  int flag;
+  MPI_Status status;
+  MPI_Iprobe(MPI_ANY_SOURCE, INCUMBENT_TAG, MPI_COMM_WORLD, &flag, &status);
+  while (flag) {
+    incumbent_msg msg;
+    MPI_Recv(&msg, sizeof(msg), MPI_BYTE, status.MPI_SOURCE, INCUMBENT_TAG, MPI_COMM_WORLD,
+        MPI_STATUS_IGNORE);
+    if (msg.group == g_group && msg.search == g_search) {
+      lower_incumbent(msg.max_gates, msg.max_sat_metric);
+      /* The sender already has these limits. */
+      incumbent_msg *known = &g_known[status.MPI_SOURCE];
+      if (msg.max_gates < known->max_gates) {
+        known->max_gates = msg.max_gates;
+      }
+      if (msg.max_sat_metric < known->max_sat_metric) {
+        known->max_sat_metric = msg.max_sat_metric;
+      }
+    }
+    MPI_Iprobe(MPI_ANY_SOURCE, INCUMBENT_TAG, MPI_COMM_WORLD, &flag, &status);
+  }
+}
+
+void free_incumbent() {
+  if (g_send_requests == NULL) {
+    return;
+  }
+  MPI_Waitall(g_size, g_send_requests, MPI_STATUSES_IGNORE);
+  receive_incumbent();
+  free(g_send_requests);
+  free(g_send_msgs);
+  free(g_known);
+  g_send_requests = NULL;
+  g_send_msgs = NULL;
+  g_known = NULL;
+}
+
+void set_incumbent_group(int group) {
+  g_group = group;
+}
+
+/* Returns the time of the monotonic clock in seconds. */
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void set_incumbent_deadline(double seconds) {
+  g_deadline = get_time() + seconds;
+}
+
+int reset_incumbent() {
+  join_incumbent_search(g_search + 1);
+  return g_search;
+}
+
+void join_incumbent_search(int search) {
+  assert(g_mpi_thread);
+  if (search == g_search) {
+    return;
+  }
+  g_search = search;
+  if (!incumbent_expired()) {
+    __atomic_store_n(&g_incumbent_gates, MAX_GATES, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_incumbent_sat_metric, INT_MAX, __ATOMIC_RELAXED);
+  }
+  for (int i = 0; i < g_size; i++) {
+    g_known[i].max_gates = MAX_GATES;
+    g_known[i].max_sat_metric = INT_MAX;
+  }
+}
+
+void lower_incumbent(gatenum max_gates, int max_sat_metric) {
+  gatenum gates = get_incumbent_gates();
+  while (max_gates < gates && !__atomic_compare_exchange_n(&g_incumbent_gates, &gates, max_gates,
+      true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  int sat_metric = get_incumbent_sat_metric();
+  while (max_sat_metric < sat_metric && !__atomic_compare_exchange_n(&g_incumbent_sat_metric,
+      &sat_metric, max_sat_metric, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+void poll_incumbent() {
+  if (g_deadline != 0 && !incumbent_expired() && get_time() > g_deadline) {
+    __atomic_store_n(&g_incumbent_expired, true, __ATOMIC_RELAXED);
+    lower_incumbent(0, 0);
+  }
+  if (!g_mpi_thread || g_size == 1) {
+    return;
+  }
+  receive_incumbent();
+  if (incumbent_expired()) {
+    return; /* The zero limits do not come from a circuit. */
+  }
+  const gatenum gates = get_incumbent_gates();
+  const int sat_metric = get_incumbent_sat_metric();
+  for (int i = 0; i < g_size; i++) {
+    incumbent_msg *known = &g_known[i];
+    if (i == g_rank || (gates >= known->max_gates && sat_metric >= known->max_sat_metric)) {
+      continue;
+    }
+    /* The previous message must have been sent before the buffer can be reused. If not, the new
+       limits are sent by a later call. */
+    int flag;
+    MPI_Test(&g_send_requests[i], &flag, MPI_STATUS_IGNORE);
+    if (!flag) {
+      continue;
+    }
+    g_send_msgs[i].group = g_group;
+    g_send_msgs[i].search = g_search;
+    g_send_msgs[i].max_gates = gates;
+    g_send_msgs[i].max_sat_metric = sat_metric;
+    known->max_gates = gates;
+    known->max_sat_metric = sat_metric;
+    MPI_Isend(&g_send_msgs[i], sizeof(incumbent_msg), MPI_BYTE, i, INCUMBENT_TAG, MPI_COMM_WORLD,
+        &g_send_requests[i]);
+  }
+}
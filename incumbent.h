@@ -0,0 +1,80 @@
+/* incumbent.h
+
+   Header file for the incumbent bound shared by all threads and MPI ranks.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __INCUMBENT_H__
+#define __INCUMBENT_H__
+
+#include "state.h"
+
+/* The incumbent limits. They have the same meaning as the max_gates and max_sat_metric fields of
+   a state and apply to every state that gates are added to. Only accessed through the functions
+   below. */
+extern gatenum g_incumbent_gates;
+extern int g_incumbent_sat_metric;
+extern bool g_incumbent_expired;
+
+/* Returns the incumbent gate limit. */
+static inline gatenum get_incumbent_gates() {
+  return __atomic_load_n(&g_incumbent_gates, __ATOMIC_RELAXED);
+}
+
+/* Returns the incumbent SAT metric limit. */
+static inline int get_incumbent_sat_metric() {
+  return __atomic_load_n(&g_incumbent_sat_metric, __ATOMIC_RELAXED);
+}
+
+/* Returns true if the deadline has passed. The limits are then zero, so that all searches stop. */
+static inline bool incumbent_expired() {
+  return __atomic_load_n(&g_incumbent_expired, __ATOMIC_RELAXED);
+}
+
+/* Sets up the incumbent for the calling rank. Must be called by the thread that makes the MPI
+   calls, after MPI has been initialized. Returns false if out of memory. */
+bool init_incumbent();
+
+/* Frees the resources of the incumbent. Waits for all updates sent to other ranks. */
+void free_incumbent();
+
+/* Only limits from ranks in the same group are applied. Ranks that search with different gate
+   sets or metrics are put in different groups, since their circuits do not bound each other. Must
+   be called before the first search. */
+void set_incumbent_group(int group);
+
+/* Sets a deadline seconds from now. When it has passed, the limits are set to zero and kept there,
+   which stops all searches. */
+void set_incumbent_deadline(double seconds);
+
+/* Removes the limits at the start of a new search. Returns the number of the search, which the
+   other ranks that take part in it pass to join_incumbent_search. Updates from other ranks are
+   only accepted if they were sent during the same search. */
+int reset_incumbent();
+
+/* Removes the limits if search is not the current search, and makes it the current search. */
+void join_incumbent_search(int search);
+
+/* Lowers the incumbent limits to max_gates and max_sat_metric, if those are lower. May be called
+   by any thread. The new limits are sent to the other ranks by the next call to poll_incumbent. */
+void lower_incumbent(gatenum max_gates, int max_sat_metric);
+
+/* Checks the deadline. Then, if called by the thread that called init_incumbent, sends the
+   incumbent limits to the other ranks if they have been lowered, and applies the limits received
+   from other ranks. May be called by any thread from anywhere in the search. */
+void poll_incumbent();
+
+#endif /* __INCUMBENT_H__ */
@@ -0,0 +1,964 @@
+/* kernels.c
+
+   Truth table kernels compiled for several instruction sets. The fastest set supported by the CPU
+   is selected at runtime, so that the same binary can be used on all nodes in a cluster with mixed
+   CPU generations.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <x86intrin.h>
+#include "kernels.h"
+#include "sboxgates.h"
+
+#define TTABLE_CHUNKS (sizeof(ttable) / sizeof(__m256i)) /* Number of 256 bit chunks in a ttable. */
+
+#define BMI2_TARGET __attribute__((target("bmi2")))
+#define AVX2_TARGET __attribute__((target("avx2,bmi2")))
+#define AVX512_TARGET __attribute__((target("avx2,bmi2,avx512f,avx512vl,avx512bw")))
+
+/* Scalar kernels. These work on any x86-64 CPU and are the reference that the other kernels are
+   tested against. */
+
+static bool equals_mask_scalar(const ttable *in1, const ttable *in2, const ttable *mask) {
+  uint64_t res = 0;
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    res |= ((*in1)[w] ^ (*in2)[w]) & (*mask)[w];
+  }
+  return res == 0;
+}
+
+/* The lut_possible kernels walk through all 2^n combinations of the n inputs. prod[d] holds the
+   masked positions where the first d inputs have the values given by the d most significant bits of
+   the combination p. A LUT is possible if the target is constant in the positions selected by each
+   full combination. Prefixes that select no positions are skipped along with all combinations that
+   start with them. */
+static bool lut_possible_scalar(const ttable *target, const ttable *mask, const ttable *in,
+    int n) {
+  assert(n > 0 && n <= 7);
+  uint64_t prod[8][TTABLE_WORDS];
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    prod[0][w] = (*mask)[w];
+  }
+  for (uint32_t p = 0; p < (1U << n); p++) {
+    bool empty = false;
+    for (int d = p == 0 ? 0 : n - 1 - __builtin_ctz(p); d < n; d++) {
+      const uint64_t inv = (p >> (n - 1 - d)) & 1 ? 0 : ~0UL;
+      uint64_t any = 0;
+      for (int w = 0; w < TTABLE_WORDS; w++) {
+        prod[d + 1][w] = prod[d][w] & (in[d][w] ^ inv);
+        any |= prod[d + 1][w];
+      }
+      if (any == 0) {
+        p |= (1U << (n - 1 - d)) - 1;
+        empty = true;
+        break;
+      }
+    }
+    if (empty) {
+      continue;
+    }
+    uint64_t ones = 0;
+    uint64_t zeros = 0;
+    for (int w = 0; w < TTABLE_WORDS; w++) {
+      ones |= prod[n][w] & (*target)[w];
+      zeros |= prod[n][w] & ~(*target)[w];
+    }
+    if (ones != 0 && zeros != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void generate_lut_ttable_scalar(uint8_t function, const ttable *in1, const ttable *in2,
+    const ttable *in3, ttable *out) {
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    const uint64_t a = (*in1)[w];
+    const uint64_t b = (*in2)[w];
+    const uint64_t c = (*in3)[w];
+    uint64_t ret = 0;
+    if (function & 1) {
+      ret |= ~a & ~b & ~c;
+    }
+    if (function & 2) {
+      ret |= ~a & ~b & c;
+    }
+    if (function & 4) {
+      ret |= ~a & b & ~c;
+    }
+    if (function & 8) {
+      ret |= ~a & b & c;
+    }
+    if (function & 16) {
+      ret |= a & ~b & ~c;
+    }
+    if (function & 32) {
+      ret |= a & ~b & c;
+    }
+    if (function & 64) {
+      ret |= a & b & ~c;
+    }
+    if (function & 128) {
+      ret |= a & b & c;
+    }
+    (*out)[w] = ret;
+  }
+}
+
+static void generate_lut_ttables_scalar(const ttable *in1, const ttable *in2, const ttable *in3,
+    ttable *out) {
+  for (int func = 0; func < 256; func++) {
+    generate_lut_ttable_scalar(func, in1, in2, in3, &out[func]);
+  }
+}
+
+static void classify_gates_scalar(const ttable *tables, const gatenum *order, int num,
+    const ttable *target, const ttable *mask, gate_classes *ret) {
+  ret->num_subsets = ret->num_supersets = ret->num_disjoint = 0;
+  for (int i = 0; i < num; i++) {
+    uint64_t outside = 0; /* Set where the gate is one and the target zero. */
+    uint64_t missing = 0; /* Set where the gate is zero and the target one. */
+    uint64_t overlap = 0; /* Set where both are one. */
+    for (int w = 0; w < TTABLE_WORDS; w++) {
+      const uint64_t t = tables[order[i]][w] & (*mask)[w];
+      const uint64_t mt = (*target)[w] & (*mask)[w];
+      outside |= t & ~mt;
+      missing |= mt & ~t;
+      overlap |= t & mt;
+    }
+    if (outside == 0) {
+      ret->subsets[ret->num_subsets++] = order[i];
+    }
+    if (missing == 0) {
+      ret->supersets[ret->num_supersets++] = order[i];
+    }
+    if (overlap == 0) {
+      ret->disjoint[ret->num_disjoint++] = order[i];
+    }
+  }
+}
+
+static int next_3lut_candidate_scalar(const ttable *tables, const gatenum *order, int start,
+    int num, gatenum gi, gatenum gk, const ttable *target, const ttable *mask) {
+  ttable in[3] = {tables[gi], tables[gk]};
+  for (int m = start; m < num; m++) {
+    in[2] = tables[order[m]];
+    if (lut_possible_scalar(target, mask, in, 3)) {
+      return m;
+    }
+  }
+  return num;
+}
+
+/* Software version of the BMI2 pext instruction. */
+static inline uint64_t pext_scalar(uint64_t x, uint64_t mask) {
+  uint64_t ret = 0;
+  for (int i = 0; mask != 0; mask &= mask - 1, i++) {
+    if (x & mask & -mask) {
+      ret |= 1UL << i;
+    }
+  }
+  return ret;
+}
+
+/* Calculates the position of each word of a mask in the compacted form. */
+static inline void compact_shifts(const ttable *mask, int *shifts) {
+  assert(ttable_popcount(*mask) <= 64);
+  int shift = 0;
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    shifts[w] = shift;
+    shift += __builtin_popcountll((*mask)[w]);
+  }
+}
+
+static void compact_ttables_scalar(const ttable *tables, const gatenum *order, int num,
+    const ttable *mask, uint64_t *out) {
+  int shifts[TTABLE_WORDS];
+  compact_shifts(mask, shifts);
+  for (int i = 0; i < num; i++) {
+    uint64_t res = 0;
+    for (int w = 0; w < TTABLE_WORDS; w++) {
+      if ((*mask)[w] != 0) {
+        res |= pext_scalar(tables[order[i]][w], (*mask)[w]) << shifts[w];
+      }
+    }
+    out[i] = res;
+  }
+}
+
+/* Used by both the AVX2 and AVX-512 kernels. All CPUs with AVX2 support BMI2 as well. */
+static BMI2_TARGET void compact_ttables_bmi2(const ttable *tables, const gatenum *order, int num,
+    const ttable *mask, uint64_t *out) {
+  int shifts[TTABLE_WORDS];
+  compact_shifts(mask, shifts);
+  for (int i = 0; i < num; i++) {
+    uint64_t res = 0;
+    for (int w = 0; w < TTABLE_WORDS; w++) {
+      if ((*mask)[w] != 0) {
+        res |= _pext_u64(tables[order[i]][w], (*mask)[w]) << shifts[w];
+      }
+    }
+    out[i] = res;
+  }
+}
+
+/* AVX2 kernels. Truth tables are processed in chunks of 256 bits. */
+
+static inline AVX2_TARGET __m256i load_avx2(const ttable *tbl, int chunk) {
+  return _mm256_load_si256((const __m256i*)tbl + chunk);
+}
+
+static AVX2_TARGET bool equals_mask_avx2(const ttable *in1, const ttable *in2,
+    const ttable *mask) {
+  bool ret = true;
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    ret &= _mm256_testz_si256(_mm256_xor_si256(load_avx2(in1, c), load_avx2(in2, c)),
+        load_avx2(mask, c));
+  }
+  return ret;
+}
+
+static AVX2_TARGET bool lut_possible_avx2(const ttable *target, const ttable *mask,
+    const ttable *in, int n) {
+  assert(n > 0 && n <= 7);
+  __m256i tg[TTABLE_CHUNKS];
+  __m256i prod[8][TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    tg[c] = load_avx2(target, c);
+    prod[0][c] = load_avx2(mask, c);
+  }
+  for (uint32_t p = 0; p < (1U << n); p++) {
+    bool empty = false;
+    for (int d = p == 0 ? 0 : n - 1 - __builtin_ctz(p); d < n; d++) {
+      empty = true;
+      for (int c = 0; c < TTABLE_CHUNKS; c++) {
+        if ((p >> (n - 1 - d)) & 1) {
+          prod[d + 1][c] = _mm256_and_si256(prod[d][c], load_avx2(&in[d], c));
+        } else {
+          prod[d + 1][c] = _mm256_andnot_si256(load_avx2(&in[d], c), prod[d][c]);
+        }
+        empty &= _mm256_testz_si256(prod[d + 1][c], prod[d + 1][c]);
+      }
+      if (empty) {
+        p |= (1U << (n - 1 - d)) - 1;
+        break;
+      }
+    }
+    if (empty) {
+      continue;
+    }
+    bool ones = false;
+    bool zeros = false;
+    for (int c = 0; c < TTABLE_CHUNKS; c++) {
+      ones |= !_mm256_testz_si256(prod[n][c], tg[c]);
+      zeros |= !_mm256_testc_si256(tg[c], prod[n][c]);
+    }
+    if (ones && zeros) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Calculates the eight minterms of one chunk of three truth tables, in LUT function bit order. */
+static inline AVX2_TARGET void minterms_avx2(const ttable *in1, const ttable *in2,
+    const ttable *in3, int chunk, __m256i *ret) {
+  const __m256i a = load_avx2(in1, chunk);
+  const __m256i b = load_avx2(in2, chunk);
+  const __m256i c = load_avx2(in3, chunk);
+  const __m256i ones = _mm256_set1_epi64x(-1);
+  const __m256i nab = _mm256_andnot_si256(_mm256_or_si256(a, b), ones);
+  const __m256i nanb = _mm256_andnot_si256(a, b);
+  const __m256i anb = _mm256_andnot_si256(b, a);
+  const __m256i ab = _mm256_and_si256(a, b);
+  ret[0] = _mm256_andnot_si256(c, nab);
+  ret[1] = _mm256_and_si256(c, nab);
+  ret[2] = _mm256_andnot_si256(c, nanb);
+  ret[3] = _mm256_and_si256(c, nanb);
+  ret[4] = _mm256_andnot_si256(c, anb);
+  ret[5] = _mm256_and_si256(c, anb);
+  ret[6] = _mm256_andnot_si256(c, ab);
+  ret[7] = _mm256_and_si256(c, ab);
+}
+
+static AVX2_TARGET void generate_lut_ttable_avx2(uint8_t function, const ttable *in1,
+    const ttable *in2, const ttable *in3, ttable *out) {
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    __m256i mt[8];
+    minterms_avx2(in1, in2, in3, c, mt);
+    __m256i ret = _mm256_setzero_si256();
+    for (int k = 0; k < 8; k++) {
+      if (function & (1 << k)) {
+        ret = _mm256_or_si256(ret, mt[k]);
+      }
+    }
+    _mm256_store_si256((__m256i*)out + c, ret);
+  }
+}
+
+/* The LUT with function f is the LUT with the highest bit of f cleared, ORed with the minterm of
+   that bit. This builds the whole table with one OR per entry. */
+static AVX2_TARGET void generate_lut_ttables_avx2(const ttable *in1, const ttable *in2,
+    const ttable *in3, ttable *out) {
+  __m256i *vout = (__m256i*)out;
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    __m256i mt[8];
+    minterms_avx2(in1, in2, in3, c, mt);
+    _mm256_store_si256(vout + c, _mm256_setzero_si256());
+    for (int k = 0; k < 8; k++) {
+      for (int f = 0; f < (1 << k); f++) {
+        _mm256_store_si256(vout + ((1 << k) + f) * TTABLE_CHUNKS + c,
+            _mm256_or_si256(_mm256_load_si256(vout + f * TTABLE_CHUNKS + c), mt[k]));
+      }
+    }
+  }
+}
+
+static AVX2_TARGET void classify_gates_avx2(const ttable *tables, const gatenum *order, int num,
+    const ttable *target, const ttable *mask, gate_classes *ret) {
+  __m256i m[TTABLE_CHUNKS];
+  __m256i mt[TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    m[c] = load_avx2(mask, c);
+    mt[c] = _mm256_and_si256(load_avx2(target, c), m[c]);
+  }
+  ret->num_subsets = ret->num_supersets = ret->num_disjoint = 0;
+  for (int i = 0; i < num; i++) {
+    bool subset = true;
+    bool superset = true;
+    bool disjoint = true;
+    for (int c = 0; c < TTABLE_CHUNKS; c++) {
+      const __m256i t = _mm256_and_si256(load_avx2(&tables[order[i]], c), m[c]);
+      subset &= _mm256_testc_si256(mt[c], t);
+      superset &= _mm256_testc_si256(t, mt[c]);
+      disjoint &= _mm256_testz_si256(t, mt[c]);
+    }
+    if (subset) {
+      ret->subsets[ret->num_subsets++] = order[i];
+    }
+    if (superset) {
+      ret->supersets[ret->num_supersets++] = order[i];
+    }
+    if (disjoint) {
+      ret->disjoint[ret->num_disjoint++] = order[i];
+    }
+  }
+}
+
+static AVX2_TARGET int next_3lut_candidate_avx2(const ttable *tables, const gatenum *order,
+    int start, int num, gatenum gi, gatenum gk, const ttable *target, const ttable *mask) {
+  __m256i t1[TTABLE_CHUNKS];
+  __m256i t0[TTABLE_CHUNKS];
+  __m256i ik[4][TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    const __m256i m = load_avx2(mask, c);
+    const __m256i ti = load_avx2(&tables[gi], c);
+    const __m256i tk = load_avx2(&tables[gk], c);
+    t1[c] = _mm256_and_si256(load_avx2(target, c), m);
+    t0[c] = _mm256_andnot_si256(load_avx2(target, c), m);
+    ik[0][c] = _mm256_andnot_si256(_mm256_or_si256(ti, tk), m);
+    ik[1][c] = _mm256_and_si256(_mm256_andnot_si256(ti, tk), m);
+    ik[2][c] = _mm256_and_si256(_mm256_andnot_si256(tk, ti), m);
+    ik[3][c] = _mm256_and_si256(_mm256_and_si256(ti, tk), m);
+  }
+  for (int p = start; p < num; p++) {
+    bool possible = true;
+    for (int k = 0; possible && k < 4; k++) {
+      bool ones0 = false;
+      bool zeros0 = false;
+      bool ones1 = false;
+      bool zeros1 = false;
+      for (int c = 0; c < TTABLE_CHUNKS; c++) {
+        const __m256i tm = load_avx2(&tables[order[p]], c);
+        const __m256i r0 = _mm256_andnot_si256(tm, ik[k][c]);
+        const __m256i r1 = _mm256_and_si256(tm, ik[k][c]);
+        ones0 |= !_mm256_testz_si256(r0, t1[c]);
+        zeros0 |= !_mm256_testz_si256(r0, t0[c]);
+        ones1 |= !_mm256_testz_si256(r1, t1[c]);
+        zeros1 |= !_mm256_testz_si256(r1, t0[c]);
+      }
+      possible = !(ones0 && zeros0) && !(ones1 && zeros1);
+    }
+    if (possible) {
+      return p;
+    }
+  }
+  return num;
+}
+
+/* AVX-512 kernels. These process two truth table chunks per register where possible and use
+   vpternlog to combine three truth tables in one instruction. */
+
+/* Returns a register holding the chunk lo in the low half and the chunk hi in the high half. */
+static inline AVX512_TARGET __m512i combine_avx512(const __m256i lo, const __m256i hi) {
+  return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+}
+
+static inline AVX512_TARGET __m512i broadcast_avx512(const __m256i tbl) {
+  return combine_avx512(tbl, tbl);
+}
+
+/* Returns a two bit value where bit 0 is set if any of the low four lanes in k are set and bit 1
+   is set if any of the high four are. */
+static inline int halves_avx512(const __mmask8 k) {
+  return ((k & 0x0f) != 0) | (((k & 0xf0) != 0) << 1);
+}
+
+static AVX512_TARGET bool equals_mask_avx512(const ttable *in1, const ttable *in2,
+    const ttable *mask) {
+  __mmask8 ret = 0;
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    /* 0x28 = (A ^ B) & C */
+    const __m256i res = _mm256_ternarylogic_epi64(load_avx2(in1, c), load_avx2(in2, c),
+        load_avx2(mask, c), 0x28);
+    ret |= _mm256_test_epi64_mask(res, res);
+  }
+  return ret == 0;
+}
+
+/* Same as lut_possible_avx2, but the two values of the last input are tested at the same time in
+   the two halves of a register. */
+static AVX512_TARGET bool lut_possible_avx512(const ttable *target, const ttable *mask,
+    const ttable *in, int n) {
+  assert(n > 0 && n <= 7);
+  __m512i tg[TTABLE_CHUNKS];
+  __m512i ntg[TTABLE_CHUNKS];
+  __m512i last[TTABLE_CHUNKS];
+  const int np = n - 1;
+  __m256i prod[8][TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    tg[c] = broadcast_avx512(load_avx2(target, c));
+    ntg[c] = _mm512_ternarylogic_epi64(tg[c], tg[c], tg[c], 0x0f); /* ~A */
+    const __m256i l = load_avx2(&in[np], c);
+    last[c] = combine_avx512(_mm256_ternarylogic_epi64(l, l, l, 0x0f), l);
+    prod[0][c] = load_avx2(mask, c);
+  }
+  for (uint32_t p = 0; p < (1U << np); p++) {
+    bool empty = false;
+    for (int d = p == 0 ? 0 : np - 1 - __builtin_ctz(p); d < np; d++) {
+      __mmask8 nonzero = 0;
+      for (int c = 0; c < TTABLE_CHUNKS; c++) {
+        if ((p >> (np - 1 - d)) & 1) {
+          prod[d + 1][c] = _mm256_and_si256(prod[d][c], load_avx2(&in[d], c));
+        } else {
+          prod[d + 1][c] = _mm256_andnot_si256(load_avx2(&in[d], c), prod[d][c]);
+        }
+        nonzero |= _mm256_test_epi64_mask(prod[d + 1][c], prod[d + 1][c]);
+      }
+      if (nonzero == 0) {
+        p |= (1U << (np - 1 - d)) - 1;
+        empty = true;
+        break;
+      }
+    }
+    if (empty) {
+      continue;
+    }
+    __mmask8 ones = 0;
+    __mmask8 zeros = 0;
+    for (int c = 0; c < TTABLE_CHUNKS; c++) {
+      const __m512i r = _mm512_and_si512(broadcast_avx512(prod[np][c]), last[c]);
+      ones |= _mm512_test_epi64_mask(r, tg[c]);
+      zeros |= _mm512_test_epi64_mask(r, ntg[c]);
+    }
+    if (halves_avx512(ones) & halves_avx512(zeros)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Calculates the eight minterms of one chunk of three truth tables, in LUT function bit order. */
+static inline AVX512_TARGET void minterms_avx512(const ttable *in1, const ttable *in2,
+    const ttable *in3, int chunk, __m256i *ret) {
+  const __m256i a = load_avx2(in1, chunk);
+  const __m256i b = load_avx2(in2, chunk);
+  const __m256i c = load_avx2(in3, chunk);
+  ret[0] = _mm256_ternarylogic_epi64(a, b, c, 0x01);
+  ret[1] = _mm256_ternarylogic_epi64(a, b, c, 0x02);
+  ret[2] = _mm256_ternarylogic_epi64(a, b, c, 0x04);
+  ret[3] = _mm256_ternarylogic_epi64(a, b, c, 0x08);
+  ret[4] = _mm256_ternarylogic_epi64(a, b, c, 0x10);
+  ret[5] = _mm256_ternarylogic_epi64(a, b, c, 0x20);
+  ret[6] = _mm256_ternarylogic_epi64(a, b, c, 0x40);
+  ret[7] = _mm256_ternarylogic_epi64(a, b, c, 0x80);
+}
+
+static AVX512_TARGET void generate_lut_ttable_avx512(uint8_t function, const ttable *in1,
+    const ttable *in2, const ttable *in3, ttable *out) {
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    __m256i mt[8];
+    minterms_avx512(in1, in2, in3, c, mt);
+    __m256i ret = _mm256_setzero_si256();
+    for (int k = 0; k < 8; k++) {
+      /* 0xf8 = A | (B & C) */
+      ret = _mm256_ternarylogic_epi64(ret, mt[k], _mm256_set1_epi64x(-((function >> k) & 1)),
+          0xf8);
+    }
+    _mm256_store_si256((__m256i*)out + c, ret);
+  }
+}
+
+/* Same as generate_lut_ttables_avx2, but two chunks are processed per register. For each k, the
+   entries 2^k to 2^(k+1) - 1 of out form one contiguous run of chunks, which is the run of the
+   entries 0 to 2^k - 1 ORed with the minterm of bit k repeated. */
+static AVX512_TARGET void generate_lut_ttables_avx512(const ttable *in1, const ttable *in2,
+    const ttable *in3, ttable *out) {
+  __m256i mt[8][TTABLE_CHUNKS];
+  __m256i *vout = (__m256i*)out;
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    __m256i chunk_mt[8];
+    minterms_avx512(in1, in2, in3, c, chunk_mt);
+    for (int k = 0; k < 8; k++) {
+      mt[k][c] = chunk_mt[k];
+    }
+    _mm256_store_si256(vout + c, _mm256_setzero_si256());
+    _mm256_store_si256(vout + TTABLE_CHUNKS + c, mt[0][c]);
+  }
+  for (int k = 1; k < 8; k++) {
+    __m512i m2[(TTABLE_CHUNKS + 1) / 2];
+    for (int i = 0; i < (TTABLE_CHUNKS + 1) / 2; i++) {
+      m2[i] = combine_avx512(mt[k][2 * i % TTABLE_CHUNKS], mt[k][(2 * i + 1) % TTABLE_CHUNKS]);
+    }
+    for (int j = 0; j < (1 << k) * TTABLE_CHUNKS; j += 2) {
+      _mm512_storeu_si512(vout + (1 << k) * TTABLE_CHUNKS + j,
+          _mm512_or_si512(_mm512_loadu_si512(vout + j), m2[j % TTABLE_CHUNKS / 2]));
+    }
+  }
+}
+
+static AVX512_TARGET void classify_gates_avx512(const ttable *tables, const gatenum *order,
+    int num, const ttable *target, const ttable *mask, gate_classes *ret) {
+  __m512i m[TTABLE_CHUNKS];
+  __m512i mt[TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    m[c] = broadcast_avx512(load_avx2(mask, c));
+    mt[c] = _mm512_and_si512(broadcast_avx512(load_avx2(target, c)), m[c]);
+  }
+  ret->num_subsets = ret->num_supersets = ret->num_disjoint = 0;
+  for (int i = 0; i < num; i += 2) {
+    const gatenum g[2] = {order[i], i + 1 < num ? order[i + 1] : order[i]};
+    __mmask8 outside = 0;
+    __mmask8 missing = 0;
+    __mmask8 overlap = 0;
+    for (int c = 0; c < TTABLE_CHUNKS; c++) {
+      const __m512i t = combine_avx512(load_avx2(&tables[g[0]], c), load_avx2(&tables[g[1]], c));
+      /* 0x40 = A & B & ~C, 0x2a = C & ~(A & B), 0x80 = A & B & C */
+      const __m512i r_outside = _mm512_ternarylogic_epi64(t, m[c], mt[c], 0x40);
+      const __m512i r_missing = _mm512_ternarylogic_epi64(t, m[c], mt[c], 0x2a);
+      const __m512i r_overlap = _mm512_ternarylogic_epi64(t, m[c], mt[c], 0x80);
+      outside |= _mm512_test_epi64_mask(r_outside, r_outside);
+      missing |= _mm512_test_epi64_mask(r_missing, r_missing);
+      overlap |= _mm512_test_epi64_mask(r_overlap, r_overlap);
+    }
+    const int outside_h = halves_avx512(outside);
+    const int missing_h = halves_avx512(missing);
+    const int overlap_h = halves_avx512(overlap);
+    for (int h = 0; h < 2 && i + h < num; h++) {
+      if (!(outside_h & (1 << h))) {
+        ret->subsets[ret->num_subsets++] = g[h];
+      }
+      if (!(missing_h & (1 << h))) {
+        ret->supersets[ret->num_supersets++] = g[h];
+      }
+      if (!(overlap_h & (1 << h))) {
+        ret->disjoint[ret->num_disjoint++] = g[h];
+      }
+    }
+  }
+}
+
+/* Tests two candidates at a time, one in each half of the registers. */
+static AVX512_TARGET int next_3lut_candidate_avx512(const ttable *tables, const gatenum *order,
+    int start, int num, gatenum gi, gatenum gk, const ttable *target, const ttable *mask) {
+  __m512i t1[TTABLE_CHUNKS];
+  __m512i t0[TTABLE_CHUNKS];
+  __m512i ti[TTABLE_CHUNKS];
+  __m512i tk[TTABLE_CHUNKS];
+  for (int c = 0; c < TTABLE_CHUNKS; c++) {
+    const __m512i m = broadcast_avx512(load_avx2(mask, c));
+    const __m512i tg = broadcast_avx512(load_avx2(target, c));
+    t1[c] = _mm512_and_si512(tg, m);
+    t0[c] = _mm512_andnot_si512(tg, m);
+    ti[c] = broadcast_avx512(load_avx2(&tables[gi], c));
+    tk[c] = broadcast_avx512(load_avx2(&tables[gk], c));
+  }
+  for (int p = start; p < num; p += 2) {
+    const gatenum gm0 = order[p];
+    const gatenum gm1 = p + 1 < num ? order[p + 1] : order[p];
+    __m512i tm[TTABLE_CHUNKS];
+    for (int c = 0; c < TTABLE_CHUNKS; c++) {
+      tm[c] = combine_avx512(load_avx2(&tables[gm0], c), load_avx2(&tables[gm1], c));
+    }
+    int bad = 0;
+#define TEST_MINTERM(imm) { \
+      __mmask8 ones = 0; \
+      __mmask8 zeros = 0; \
+      for (int c = 0; c < TTABLE_CHUNKS; c++) { \
+        const __m512i r = _mm512_ternarylogic_epi64(ti[c], tk[c], tm[c], imm); \
+        ones |= _mm512_test_epi64_mask(r, t1[c]); \
+        zeros |= _mm512_test_epi64_mask(r, t0[c]); \
+      } \
+      bad |= halves_avx512(ones) & halves_avx512(zeros); \
+    }
+    TEST_MINTERM(0x01);
+    TEST_MINTERM(0x02);
+    TEST_MINTERM(0x04);
+    TEST_MINTERM(0x08);
+    TEST_MINTERM(0x10);
+    TEST_MINTERM(0x20);
+    TEST_MINTERM(0x40);
+    TEST_MINTERM(0x80);
+#undef TEST_MINTERM
+    if (!(bad & 1)) {
+      return p;
+    }
+    if (!(bad & 2) && p + 1 < num) {
+      return p + 1;
+    }
+  }
+  return num;
+}
+
+/* Scan kernels. These are written with generic vector types and instantiated for each instruction
+   set and truth table width, so that each vector holds 4 to 32 compacted truth tables. MOVEMASK
+   returns a bit mask of the most significant bits of the bytes in a vector. */
+
+/* Returns the most significant bits of the eight bytes in v. */
+static inline uint64_t movemask_scalar(const void *v) {
+  uint64_t x;
+  memcpy(&x, v, sizeof(uint64_t));
+  return ((x & 0x8080808080808080UL) * 0x0002040810204081UL) >> 56;
+}
+
+#define MOVEMASK_SCALAR(v) movemask_scalar(&(v))
+#define MOVEMASK_AVX2(v) ((uint32_t)_mm256_movemask_epi8((__m256i)(v)))
+#define MOVEMASK_AVX512(v) ((uint64_t)_mm512_movepi8_mask((__m512i)(v)))
+
+/* Body of a scan kernel. MATCH is a vector expression of the vector v of tables that is true in the
+   lanes that match. */
+#define SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, MATCH) \
+  const TYPE *tbl = tables; \
+  for (int k = start; k < num; k += VBYTES / sizeof(TYPE)) { \
+    NAME##_vec v; \
+    memcpy(&v, tbl + k, VBYTES); \
+    const NAME##_vec match = (NAME##_vec)(MATCH); \
+    const uint64_t bits = MOVEMASK(match); \
+    if (bits != 0) { \
+      const int p = k + __builtin_ctzll(bits) / sizeof(TYPE); \
+      return p < num ? p : num; \
+    } \
+  } \
+  return num;
+
+#define DEFINE_SCAN_KERNELS(NAME, TARGET, TYPE, VBYTES, MOVEMASK) \
+typedef TYPE NAME##_vec __attribute__((vector_size(VBYTES))); \
+\
+static TARGET int NAME##_find_or(const void *tables, int start, int num, uint64_t t1, \
+    uint64_t target) { \
+  SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, (v | (TYPE)t1) == (TYPE)target) \
+} \
+\
+static TARGET int NAME##_find_and(const void *tables, int start, int num, uint64_t t1, \
+    uint64_t target) { \
+  SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, (v & (TYPE)t1) == (TYPE)target) \
+} \
+\
+static TARGET int NAME##_find_andnot(const void *tables, int start, int num, uint64_t t1, \
+    uint64_t target) { \
+  SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, (v & (TYPE)~t1) == (TYPE)target) \
+} \
+\
+static TARGET int NAME##_find_pair(const void *tables, int start, int num, uint64_t t1, \
+    uint64_t target, uint64_t mask) { \
+  const TYPE a = t1; \
+  const TYPE na = ~t1; \
+  const TYPE t = target & mask; \
+  const TYPE m = mask; \
+  SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, \
+      ((~(a | v) & m) == t) | ((~(a & v) & m) == t) | (((na | v) & m) == t) \
+      | (((~v | a) & m) == t) | ((na & v & m) == t) | ((a & ~v & m) == t) \
+      | ((na & ~v & m) == t) | ((~(a ^ v) & m) == t)) \
+} \
+\
+static TARGET int NAME##_find_3lut(const void *tables, int start, int num, uint64_t t1, \
+    uint64_t t2, uint64_t target, uint64_t mask) { \
+  const TYPE t = target & mask; \
+  const TYPE nt = ~target & mask; \
+  const TYPE ab[4] = {~t1 & ~t2 & mask, ~t1 & t2 & mask, t1 & ~t2 & mask, t1 & t2 & mask}; \
+  SCAN_BODY(NAME, TYPE, VBYTES, MOVEMASK, \
+      ~((((ab[0] & ~v & t) != 0) & ((ab[0] & ~v & nt) != 0)) \
+      | (((ab[0] & v & t) != 0) & ((ab[0] & v & nt) != 0)) \
+      | (((ab[1] & ~v & t) != 0) & ((ab[1] & ~v & nt) != 0)) \
+      | (((ab[1] & v & t) != 0) & ((ab[1] & v & nt) != 0)) \
+      | (((ab[2] & ~v & t) != 0) & ((ab[2] & ~v & nt) != 0)) \
+      | (((ab[2] & v & t) != 0) & ((ab[2] & v & nt) != 0)) \
+      | (((ab[3] & ~v & t) != 0) & ((ab[3] & ~v & nt) != 0)) \
+      | (((ab[3] & v & t) != 0) & ((ab[3] & v & nt) != 0)))) \
+}
+
+DEFINE_SCAN_KERNELS(scan16_scalar, , uint16_t, 8, MOVEMASK_SCALAR)
+DEFINE_SCAN_KERNELS(scan32_scalar, , uint32_t, 8, MOVEMASK_SCALAR)
+DEFINE_SCAN_KERNELS(scan64_scalar, , uint64_t, 8, MOVEMASK_SCALAR)
+DEFINE_SCAN_KERNELS(scan16_avx2, AVX2_TARGET, uint16_t, 32, MOVEMASK_AVX2)
+DEFINE_SCAN_KERNELS(scan32_avx2, AVX2_TARGET, uint32_t, 32, MOVEMASK_AVX2)
+DEFINE_SCAN_KERNELS(scan64_avx2, AVX2_TARGET, uint64_t, 32, MOVEMASK_AVX2)
+DEFINE_SCAN_KERNELS(scan16_avx512, AVX512_TARGET, uint16_t, 64, MOVEMASK_AVX512)
+DEFINE_SCAN_KERNELS(scan32_avx512, AVX512_TARGET, uint32_t, 64, MOVEMASK_AVX512)
+DEFINE_SCAN_KERNELS(scan64_avx512, AVX512_TARGET, uint64_t, 64, MOVEMASK_AVX512)
+
+#define SCAN_KERNELS(NAME) {NAME##_find_or, NAME##_find_and, NAME##_find_andnot, \
+    NAME##_find_pair, NAME##_find_3lut}
+
+static const kernel_set kernels_scalar = {"scalar", equals_mask_scalar, lut_possible_scalar,
+    generate_lut_ttable_scalar, generate_lut_ttables_scalar, classify_gates_scalar,
+    next_3lut_candidate_scalar, compact_ttables_scalar,
+    {SCAN_KERNELS(scan16_scalar), SCAN_KERNELS(scan32_scalar), SCAN_KERNELS(scan64_scalar)}};
+
+static const kernel_set kernels_avx2 = {"AVX2", equals_mask_avx2, lut_possible_avx2,
+    generate_lut_ttable_avx2, generate_lut_ttables_avx2, classify_gates_avx2,
+    next_3lut_candidate_avx2, compact_ttables_bmi2,
+    {SCAN_KERNELS(scan16_avx2), SCAN_KERNELS(scan32_avx2), SCAN_KERNELS(scan64_avx2)}};
+
+static const kernel_set kernels_avx512 = {"AVX-512", equals_mask_avx512, lut_possible_avx512,
+    generate_lut_ttable_avx512, generate_lut_ttables_avx512, classify_gates_avx512,
+    next_3lut_candidate_avx512, compact_ttables_bmi2,
+    {SCAN_KERNELS(scan16_avx512), SCAN_KERNELS(scan32_avx512), SCAN_KERNELS(scan64_avx512)}};
+
+kernel_set g_kernels;
+
+/* Returns the kernel sets supported by the CPU, from slowest to fastest. */
+static int get_supported_kernels(const kernel_set **ret) {
+  __builtin_cpu_init();
+  int num = 0;
+  ret[num++] = &kernels_scalar;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")) {
+    ret[num++] = &kernels_avx2;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi2")
+      && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+      && __builtin_cpu_supports("avx512bw")) {
+    ret[num++] = &kernels_avx512;
+  }
+  return num;
+}
+
+void init_kernels() {
+  const kernel_set *supported[3];
+  int num = get_supported_kernels(supported);
+  g_kernels = *supported[num - 1];
+}
+
+static ttable random_ttable() {
+  ttable ret;
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    ret[w] = xorshift1024();
+  }
+  return ret;
+}
+
+/* Returns a random mask, which is sparse about half of the time, like the masks in the deeper
+   levels of create_circuit. */
+static ttable random_mask() {
+  ttable ret = random_ttable();
+  int sparseness = xorshift1024() % 8;
+  for (int i = 0; i < sparseness; i++) {
+    ret &= random_ttable();
+  }
+  return ret;
+}
+
+/* Tests the scan kernels in ks against the ones in ref, for compacted truth tables of the given
+   width. */
+static bool test_scan_kernels(const scan_kernels *ks, const scan_kernels *ref, int width) {
+  const uint64_t wmask = width == 64 ? ~0UL : (1UL << width) - 1;
+  const int num = 1 + xorshift1024() % 100;
+  uint64_t words[100];
+  uint64_t tables[100 + SCAN_PADDING / sizeof(uint64_t)];
+  const uint64_t mask = wmask & (xorshift1024() | xorshift1024());
+  const uint64_t t1 = xorshift1024() & mask;
+  const uint64_t t2 = xorshift1024() & mask;
+  uint64_t target = xorshift1024() & mask;
+  for (int i = 0; i < num; i++) {
+    /* Some tables are made to match the conditions. */
+    switch (xorshift1024() % 8) {
+      case 0:
+        words[i] = target & ~t1;
+        break;
+      case 1:
+        words[i] = target | (~t1 & xorshift1024());
+        break;
+      case 2:
+        words[i] = ~(t1 ^ target);
+        break;
+      case 3:
+        words[i] = (t1 & ~target) | (t2 & target);
+        break;
+      default:
+        words[i] = xorshift1024();
+    }
+    words[i] &= mask;
+    memcpy((uint8_t*)tables + i * width / 8, &words[i], width / 8);
+  }
+  const int start = xorshift1024() % num;
+  return ks->find_or(tables, start, num, t1, target) == ref->find_or(tables, start, num, t1, target)
+      && ks->find_and(tables, start, num, t1, target)
+        == ref->find_and(tables, start, num, t1, target)
+      && ks->find_andnot(tables, start, num, t1, target)
+        == ref->find_andnot(tables, start, num, t1, target)
+      && ks->find_pair(tables, start, num, t1, target, mask)
+        == ref->find_pair(tables, start, num, t1, target, mask)
+      && ks->find_3lut(tables, start, num, t1, t2, target, mask)
+        == ref->find_3lut(tables, start, num, t1, t2, target, mask);
+}
+
+/* Tests the kernels in ks against the scalar kernels. */
+static bool test_kernel_set(const kernel_set *ks) {
+  const kernel_set *ref = &kernels_scalar;
+  ttable tables[37];
+  gatenum order[37];
+  for (int trial = 0; trial < 1000; trial++) {
+    const ttable mask = random_mask();
+    for (int i = 0; i < 37; i++) {
+      tables[i] = random_ttable();
+      order[i] = i;
+    }
+    for (int i = 36; i > 0; i--) {
+      int j = xorshift1024() % (i + 1);
+      gatenum t = order[i];
+      order[i] = order[j];
+      order[j] = t;
+    }
+
+    /* Targets that are functions of the inputs, possibly with a few bits flipped. */
+    ttable target3;
+    ttable target5;
+    ttable target7;
+    ref->generate_lut_ttable(xorshift1024(), &tables[0], &tables[1], &tables[2], &target3);
+    ref->generate_lut_ttable(xorshift1024(), &target3, &tables[3], &tables[4], &target5);
+    ref->generate_lut_ttable(xorshift1024(), &tables[4], &tables[5], &tables[6], &target7);
+    ref->generate_lut_ttable(xorshift1024(), &target5, &target7, &tables[6], &target7);
+    if (xorshift1024() & 1) {
+      const ttable noise = random_mask() & random_mask() & random_mask();
+      target3 ^= noise;
+      target5 ^= noise;
+      target7 ^= noise;
+    }
+
+    const ttable other = target3 ^ (random_mask() & random_mask());
+    if (ks->equals_mask(&target3, &other, &mask) != ref->equals_mask(&target3, &other, &mask)) {
+      fprintf(stderr, "%s equals_mask failed.\n", ks->name);
+      return false;
+    }
+
+    if (ks->lut_possible(&target3, &mask, tables, 3)
+          != ref->lut_possible(&target3, &mask, tables, 3)
+        || ks->lut_possible(&target5, &mask, tables, 5)
+          != ref->lut_possible(&target5, &mask, tables, 5)
+        || ks->lut_possible(&target7, &mask, tables, 7)
+          != ref->lut_possible(&target7, &mask, tables, 7)) {
+      fprintf(stderr, "%s lut_possible failed.\n", ks->name);
+      return false;
+    }
+
+    uint8_t func = xorshift1024();
+    ttable res;
+    ttable ref_res;
+    ks->generate_lut_ttable(func, &tables[0], &tables[1], &tables[2], &res);
+    ref->generate_lut_ttable(func, &tables[0], &tables[1], &tables[2], &ref_res);
+    if (!ttable_equals(res, ref_res)) {
+      fprintf(stderr, "%s generate_lut_ttable failed.\n", ks->name);
+      return false;
+    }
+
+    if (trial % 50 == 0) {
+      ttable luts[256];
+      ttable ref_luts[256];
+      ks->generate_lut_ttables(&tables[0], &tables[1], &tables[2], luts);
+      ref->generate_lut_ttables(&tables[0], &tables[1], &tables[2], ref_luts);
+      if (memcmp(luts, ref_luts, sizeof(ttable) * 256) != 0) {
+        fprintf(stderr, "%s generate_lut_ttables failed.\n", ks->name);
+        return false;
+      }
+    }
+
+    /* Make some of the gates subsets, supersets or disjoint with the target. */
+    for (int i = 7; i < 37; i += 3) {
+      tables[i] &= target3;
+      tables[i + 1] |= target3;
+      tables[i + 2] &= ~target3;
+    }
+    const int num = 1 + xorshift1024() % 36;
+    static gate_classes classes;
+    static gate_classes ref_classes;
+    ks->classify_gates(tables, order, num, &target3, &mask, &classes);
+    ref->classify_gates(tables, order, num, &target3, &mask, &ref_classes);
+    if (classes.num_subsets != ref_classes.num_subsets
+        || classes.num_supersets != ref_classes.num_supersets
+        || classes.num_disjoint != ref_classes.num_disjoint
+        || memcmp(classes.subsets, ref_classes.subsets, sizeof(gatenum) * classes.num_subsets)
+        || memcmp(classes.supersets, ref_classes.supersets,
+            sizeof(gatenum) * classes.num_supersets)
+        || memcmp(classes.disjoint, ref_classes.disjoint, sizeof(gatenum) * classes.num_disjoint)) {
+      fprintf(stderr, "%s classify_gates failed.\n", ks->name);
+      return false;
+    }
+
+    ttable cmask = random_mask();
+    while (ttable_popcount(cmask) > 64) {
+      cmask &= random_ttable();
+    }
+    uint64_t compact[37];
+    uint64_t ref_compact[37];
+    ks->compact_ttables(tables, order, num, &cmask, compact);
+    ref->compact_ttables(tables, order, num, &cmask, ref_compact);
+    if (memcmp(compact, ref_compact, sizeof(uint64_t) * num) != 0) {
+      fprintf(stderr, "%s compact_ttables failed.\n", ks->name);
+      return false;
+    }
+
+    for (int w = 0; w < 3; w++) {
+      if (!test_scan_kernels(&ks->scan[w], &ref->scan[w], 16 << w)) {
+        fprintf(stderr, "%s %d bit scan kernels failed.\n", ks->name, 16 << w);
+        return false;
+      }
+    }
+
+    const int start = xorshift1024() % num;
+    ref->generate_lut_ttable(xorshift1024(), &tables[0], &tables[1], &tables[order[num - 1]],
+        &target3);
+    if (ks->next_3lut_candidate(tables, order, start, num, 0, 1, &target3, &mask)
+        != ref->next_3lut_candidate(tables, order, start, num, 0, 1, &target3, &mask)) {
+      fprintf(stderr, "%s next_3lut_candidate failed.\n", ks->name);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_kernels() {
+  const kernel_set *supported[3];
+  int num = get_supported_kernels(supported);
+  for (int i = 1; i < num; i++) {
+    if (!test_kernel_set(supported[i])) {
+      return false;
+    }
+  }
+  return true;
+}
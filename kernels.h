@@ -0,0 +1,138 @@
+/* kernels.h
+
+   Header file for the runtime dispatched truth table kernels.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include "state.h"
+
+#define TTABLE_WORDS (sizeof(ttable) / sizeof(uint64_t)) /* Number of 64 bit words in a ttable. */
+
+/* Gates sorted by their relation to a target truth table in the positions where a mask is set. Used
+   in step 3 of create_circuit. */
+typedef struct {
+  int num_subsets;
+  int num_supersets;
+  int num_disjoint;
+  gatenum subsets[MAX_GATES];   /* Gates that are zero wherever the target is zero. */
+  gatenum supersets[MAX_GATES]; /* Gates that are one wherever the target is one. */
+  gatenum disjoint[MAX_GATES];  /* Gates that are zero wherever the target is one. */
+} gate_classes;
+
+/* Number of bytes that must be readable after the end of the arrays passed to the scan kernels. */
+#define SCAN_PADDING 64
+
+/* Kernels that scan arrays of compacted truth tables, see compact_ttables. There is one set of
+   these for each of the widths 16, 32 and 64 bits, and the arrays hold words of that width. The
+   other arguments are compacted truth tables zero extended to 64 bits. All return the lowest
+   position k >= start for which the described condition is true, or num if there is none. */
+typedef struct {
+  /* (t1 | tables[k]) == target */
+  int (*find_or)(const void *tables, int start, int num, uint64_t t1, uint64_t target);
+
+  /* (t1 & tables[k]) == target */
+  int (*find_and)(const void *tables, int start, int num, uint64_t t1, uint64_t target);
+
+  /* (~t1 & tables[k]) == target */
+  int (*find_andnot)(const void *tables, int start, int num, uint64_t t1, uint64_t target);
+
+  /* Any of the two gate combinations of t1 and tables[k] tested for pairs in step 4 of
+     create_circuit matches target in the positions where mask is set. */
+  int (*find_pair)(const void *tables, int start, int num, uint64_t t1, uint64_t target,
+      uint64_t mask);
+
+  /* A LUT with the inputs t1, t2 and tables[k] can produce target in the positions where mask is
+     set. */
+  int (*find_3lut)(const void *tables, int start, int num, uint64_t t1, uint64_t t2,
+      uint64_t target, uint64_t mask);
+} scan_kernels;
+
+/* A set of kernels compiled for one instruction set. The truth tables are passed by pointer, since
+   the kernels are compiled for different instruction sets and vector arguments are passed
+   differently depending on which instruction sets are enabled. */
+typedef struct {
+  const char *name;
+
+  /* Performs a masked test for equality. Only bits set to 1 in the mask will be tested. */
+  bool (*equals_mask)(const ttable *in1, const ttable *in2, const ttable *mask);
+
+  /* Returns true if it is possible to generate a LUT with the n input truth tables in and an output
+     truth table matching target in the positions where mask is set. */
+  bool (*lut_possible)(const ttable *target, const ttable *mask, const ttable *in, int n);
+
+  /* Calculates the truth table of a LUT given its function and three input truth tables. */
+  void (*generate_lut_ttable)(uint8_t function, const ttable *in1, const ttable *in2,
+      const ttable *in3, ttable *out);
+
+  /* Generates all 256 possible truth tables for a LUT with the given three input truth tables. */
+  void (*generate_lut_ttables)(const ttable *in1, const ttable *in2, const ttable *in3,
+      ttable *out);
+
+  /* Sorts the num gates in order into the classes in ret. */
+  void (*classify_gates)(const ttable *tables, const gatenum *order, int num, const ttable *target,
+      const ttable *mask, gate_classes *ret);
+
+  /* Returns the lowest position m >= start in order for which a LUT with the inputs gi, gk and
+     order[m] can produce target in the positions where mask is set, or num if there is none. */
+  int (*next_3lut_candidate)(const ttable *tables, const gatenum *order, int start, int num,
+      gatenum gi, gatenum gk, const ttable *target, const ttable *mask);
+
+  /* Compacts the truth tables of the num gates in order: the bits in the positions where mask is
+     set are packed into the low bits of out[i]. The mask must have at most 64 bits set. */
+  void (*compact_ttables)(const ttable *tables, const gatenum *order, int num, const ttable *mask,
+      uint64_t *out);
+
+  /* Scan kernels for 16, 32 and 64 bit compacted truth tables. */
+  scan_kernels scan[3];
+} kernel_set;
+
+extern kernel_set g_kernels; /* Kernels selected by init_kernels. */
+
+/* Selects the fastest kernels supported by the CPU. Must be called before any of the kernels in
+   g_kernels or the functions that depend on them are used. */
+void init_kernels();
+
+/* Tests all kernel variants supported by the CPU against the scalar ones on random input. Returns
+   true if they all agree. */
+bool test_kernels();
+
+/* Test if all bits in a truth table are zero. */
+static inline bool ttable_zero(const ttable tbl) {
+  uint64_t res = 0;
+  for (int i = 0; i < TTABLE_WORDS; i++) {
+    res |= tbl[i];
+  }
+  return res == 0;
+}
+
+/* Returns the number of bits set in a truth table. */
+static inline int ttable_popcount(const ttable tbl) {
+  int ret = 0;
+  for (int i = 0; i < TTABLE_WORDS; i++) {
+    ret += __builtin_popcountll(tbl[i]);
+  }
+  return ret;
+}
+
+/* Test two truth tables for equality. */
+static inline bool ttable_equals(const ttable in1, const ttable in2) {
+  return ttable_zero(in1 ^ in2);
+}
+
+#endif /* __KERNELS_H__ */
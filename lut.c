@@ -18,9 +18,15 @@
    along with this program. If not, see <http://www.gnu.org/licenses/>. */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "incumbent.h"
+#include "kernels.h"
 #include "lut.h"
 #include "sboxgates.h"
 
@@ -34,141 +40,63 @@ static inline void next_combination(gatenum *combination, int t, int max);
    truth table matching target in the positions where mask is set. */
 bool check_3lut_possible(const ttable target, const ttable mask, const ttable t1, const ttable t2,
     const ttable t3) {
-  ttable match = _mm256_setzero_si256();
-  ttable tt1 = ~t1;
-  for (uint8_t i = 0; i < 2; i++) {
-    ttable tt2 = ~t2;
-    for (uint8_t k = 0; k < 2; k++) {
-      ttable tt3 = ~t3;
-      for (uint8_t m = 0; m < 2; m++) {
-        ttable r = tt1 & tt2 & tt3;
-        if (ttable_equals_mask(target & r, r, mask)) {
-          match |= r;
-        } else if (!_mm256_testz_si256(target & r & mask, target & r & mask)) {
-          return false;
-        }
-        tt3 = ~tt3;
-      }
-      tt2 = ~tt2;
-    }
-    tt1 = ~tt1;
-  }
-  return ttable_equals_mask(target, match, mask);
+  const ttable in[] = {t1, t2, t3};
+  return g_kernels.lut_possible(&target, &mask, in, 3);
 }
 
 /* Returns true if it is possible to generate a LUT with the five input truth tables and an output
    truth table matching target in the positions where mask is set. */
 bool check_5lut_possible(const ttable target, const ttable mask, const ttable t1, const ttable t2,
     const ttable t3, const ttable t4, const ttable t5) {
-  ttable match = _mm256_setzero_si256();
-  ttable tt1 = ~t1;
-  for (uint8_t i = 0; i < 2; i++) {
-    ttable tt2 = ~t2;
-    for (uint8_t k = 0; k < 2; k++) {
-      ttable tt3 = ~t3;
-      for (uint8_t m = 0; m < 2; m++) {
-        ttable tt4 = ~t4;
-        for (uint8_t o = 0; o < 2; o++) {
-          ttable tt5 = ~t5;
-          for (uint8_t q = 0; q < 2; q++) {
-            ttable r = tt1 & tt2 & tt3 & tt4 & tt5;
-            if (ttable_equals_mask(target & r, r, mask)) {
-              match |= r;
-            } else if (!_mm256_testz_si256(target & r & mask, target & r & mask)) {
-              return false;
-            }
-            tt5 = ~tt5;
-          }
-          tt4 = ~tt4;
-        }
-        tt3 = ~tt3;
-      }
-      tt2 = ~tt2;
-    }
-    tt1 = ~tt1;
-  }
-  return ttable_equals_mask(target, match, mask);
+  const ttable in[] = {t1, t2, t3, t4, t5};
+  return g_kernels.lut_possible(&target, &mask, in, 5);
 }
 
 /* Returns true if it is possible to generate a LUT with the seven input truth tables and an output
    truth table matching target in the positions where mask is set. */
 bool check_7lut_possible(const ttable target, const ttable mask, const ttable t1, const ttable t2,
     const ttable t3, const ttable t4, const ttable t5, const ttable t6, const ttable t7) {
-  ttable match = _mm256_setzero_si256();
-  ttable tt1 = ~t1;
-  for (uint8_t i = 0; i < 2; i++) {
-    ttable tt2 = ~t2;
-    for (uint8_t k = 0; k < 2; k++) {
-      ttable tt3 = ~t3;
-      for (uint8_t m = 0; m < 2; m++) {
-        ttable tt4 = ~t4;
-        for (uint8_t o = 0; o < 2; o++) {
-          ttable tt5 = ~t5;
-          for (uint8_t q = 0; q < 2; q++) {
-            ttable tt6 = ~t6;
-            for (uint8_t s = 0; s < 2; s++) {
-              ttable tt7 = ~t7;
-              for (uint8_t u = 0; u < 2; u++) {
-                ttable x = tt1 & tt2 & tt3 & tt4 & tt5 & tt6 & tt7;
-                if (ttable_equals_mask(target & x, x, mask)) {
-                  match |= x;
-                } else if (!_mm256_testz_si256(target & x & mask, target & x & mask)) {
-                  return false;
-                }
-                tt7 = ~tt7;
-              }
-              tt6 = ~tt6;
-            }
-            tt5 = ~tt5;
-          }
-          tt4 = ~tt4;
-        }
-        tt3 = ~tt3;
-      }
-      tt2 = ~tt2;
-    }
-    tt1 = ~tt1;
-  }
-  return ttable_equals_mask(target, match, mask);
+  const ttable in[] = {t1, t2, t3, t4, t5, t6, t7};
+  return g_kernels.lut_possible(&target, &mask, in, 7);
 }
 
 /* Calculates the truth table of a LUT given its function and three input truth tables. */
 ttable generate_lut_ttable(const uint8_t function, const ttable in1, const ttable in2,
     const ttable in3) {
-  ttable ret = _mm256_setzero_si256();
-  if (function & 1) {
-    ret |= ~in1 & ~in2 & ~in3;
-  }
-  if (function & 2) {
-    ret |= ~in1 & ~in2 & in3;
-  }
-  if (function & 4) {
-    ret |= ~in1 & in2 & ~in3;
-  }
-  if (function & 8) {
-    ret |= ~in1 & in2 & in3;
-  }
-  if (function & 16) {
-    ret |= in1 & ~in2 & ~in3;
-  }
-  if (function & 32) {
-    ret |= in1 & ~in2 & in3;
-  }
-  if (function & 64) {
-    ret |= in1 & in2 & ~in3;
-  }
-  if (function & 128) {
-    ret |= in1 & in2 & in3;
-  }
+  ttable ret;
+  g_kernels.generate_lut_ttable(function, &in1, &in2, &in3, &ret);
   return ret;
 }
 
 /* Generates all possible truth tables for a LUT with the given three input truth tables. Used for
    caching in the search functions. */
 void generate_lut_ttables(const ttable in1, const ttable in2, const ttable in3, ttable *out) {
-  for (int func = 0; func < 256; func++) {
-    out[func] = generate_lut_ttable(func, in1, in2, in3);
+  g_kernels.generate_lut_ttables(&in1, &in2, &in3, out);
+}
+
+/* Returns the partially specified LUT function with the three input truth tables and an output
+   truth table matching target in the positions where mask is set. Bit i of care is set if the
+   input combination i occurs in a position where mask is set, and bit i of func is then the target
+   value in those positions. The other bits of func are zero. Returns false if no such function
+   exists. */
+bool get_partial_lut_function(const ttable in1, const ttable in2, const ttable in3,
+    const ttable target, const ttable mask, uint8_t *func, uint8_t *care) {
+  const ttable one = target & mask;
+  const ttable zero = ~target & mask;
+  const ttable ab[4] = {~in1 & ~in2, ~in1 & in2, in1 & ~in2, in1 & in2};
+  *func = 0;
+  *care = 0;
+  for (int i = 0; i < 8; i++) {
+    const ttable sel = ab[i >> 1] & ((i & 1) ? in3 : ~in3);
+    const bool has_one = !ttable_zero(sel & one);
+    const bool has_zero = !ttable_zero(sel & zero);
+    if (has_one && has_zero) {
+      return false;
+    }
+    *func |= has_one << i;
+    *care |= (has_one || has_zero) << i;
   }
+  return true;
 }
 
 /* Returns a LUT function func with the three input truth tables with an output truth table matching
@@ -176,346 +104,597 @@ void generate_lut_ttables(const ttable in1, const ttable in2, const ttable in3,
    can satisfy the target truth table exists. */
 bool get_lut_function(const ttable in1, const ttable in2, const ttable in3, const ttable target,
     const ttable mask, const bool randomize, uint8_t *func) {
-  *func = 0;
-  uint8_t tableset = 0;
-
-  uint64_t in1_v[4];
-  uint64_t in2_v[4];
-  uint64_t in3_v[4];
-  uint64_t target_v[4];
-  uint64_t mask_v[4];
-
-  _mm256_storeu_si256((ttable*)in1_v, in1);
-  _mm256_storeu_si256((ttable*)in2_v, in2);
-  _mm256_storeu_si256((ttable*)in3_v, in3);
-  _mm256_storeu_si256((ttable*)target_v, target);
-  _mm256_storeu_si256((ttable*)mask_v, mask);
-
-  for (int v = 0; v < 4; v++) {
-    for (int i = 0; i < 64; i++) {
-      if (mask_v[v] & 1) {
-        uint8_t temp = ((in1_v[v] & 1) << 2) | ((in2_v[v] & 1) << 1) | (in3_v[v] & 1);
-        if ((tableset & (1 << temp)) == 0) {
-          *func |= (target_v[v] & 1) << temp;
-          tableset |= 1 << temp;
-        } else if ((*func & (1 << temp)) != ((target_v[v] & 1) << temp)) {
-          return false;
-        }
-      }
-      target_v[v] >>= 1;
-      mask_v[v] >>= 1;
-      in1_v[v] >>= 1;
-      in2_v[v] >>= 1;
-      in3_v[v] >>= 1;
-    }
+  uint8_t care;
+  if (!get_partial_lut_function(in1, in2, in3, target, mask, func, &care)) {
+    return false;
   }
 
   /* Randomize don't-cares in table. */
-  if (randomize && tableset != 0xff) {
-    *func |= ~tableset & (uint8_t)xorshift1024();
+  if (randomize && care != 0xff) {
+    *func |= ~care & (uint8_t)xorshift1024();
   }
 
   return true;
 }
 
-/* Search for a combination of five outputs in the graph that can be connected with a 5-input LUT
-   to create an output truth table that matches target in the positions where mask is set. Returns
-   true on success. In that case the result is returned in the 7 position array ret: ret[0]
-   contains the outer LUT function, ret[1] the inner LUT function, and ret[2] - ret[6] the five
-   input gate numbers. */
-bool search_5lut(const state st, const ttable target, const ttable mask, uint16_t *ret) {
-  assert(ret != NULL);
-  assert(st.num_gates >= 5);
+/* Number of combinations in each block of the LUT searches. The main thread of a rank checks for
+   messages from the other ranks between its blocks. */
+#define COMBINATION_BLOCK_SIZE 256
+
+/* The numbers that are left when a rank fetches a chunk are split into this many chunks per rank.
+   The chunks get smaller towards the end of the search, so that all ranks run out of work at about
+   the same time. */
+#define CHUNKS_PER_RANK 4
+#define MIN_CHUNK_SIZE 16
+
+/* How often the main thread checks for messages while it waits for the other threads. */
+#define LUT_POLL_INTERVAL_NS 1000000
+
+/* Maximum number of combinations waiting in the queue of a rank. When the queue is full, the
+   thread that found a combination searches it itself. */
+#define LUT_QUEUE_SIZE 64
+
+/* A search of the numbers 0 ... size - 1 by the g_num_threads threads of all ranks. The main
+   thread of each rank fetches chunks of numbers from a counter on rank 0, one chunk ahead of what
+   the threads of the rank are working on, and the threads take blocks of block_size numbers from
+   the chunks. The threads make no MPI calls except for the main thread, which also tests recv_req
+   between its blocks.
+
+   A search_block function may put combinations that need a longer search in the queue of the
+   rank, where they are taken by search_item in the threads that have nothing else to do. A thread
+   always takes combinations from the queue before it takes a new block, and only stops when no
+   thread is searching, so no combination is left in the queue. */
+typedef struct lut_search lut_search;
+struct lut_search {
+  const state *st;
+  ttable target;
+  ttable mask;
+  /* Searches the block [start, stop). Returns true if a LUT was found, with the result in ret. */
+  bool (*search_block)(lut_search *ls, uint64_t start, uint64_t stop, uint16_t *ret);
+  /* Searches a combination from the queue, in the same way. May be NULL if the queue is unused. */
+  bool (*search_item)(lut_search *ls, const gatenum *nums, uint16_t *ret);
+  uint64_t size;
+  uint64_t block_size;
+  int num_ranks;
+  uint64_t counter;            /* Start of the next chunk with a single rank. */
+  uint64_t fetched;            /* Start of the last chunk fetched by this rank. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;         /* Signalled when there is more to do or the search ends. */
+  uint64_t next;               /* The chunk that blocks are taken from. Guarded by lock. */
+  uint64_t stop;
+  uint64_t pending_start;      /* The chunk fetched ahead. Guarded by lock. */
+  uint64_t pending_stop;
+  bool exhausted;              /* Set when there are no chunks left. Guarded by lock. */
+  int running;                 /* Number of threads that are searching. Guarded by lock. */
+  gatenum queue[LUT_QUEUE_SIZE][7]; /* Ring buffer of combinations. Guarded by lock. */
+  int queue_start;
+  int queue_size;
+  MPI_Request *recv_req;       /* Completes when another rank has found a LUT. May be NULL. */
+  bool received;               /* Set by the main thread when recv_req has completed. */
+  bool cancel;                 /* Set atomically to make all threads stop. */
+  bool found;                  /* Set atomically by the first thread that finds a LUT. */
+  uint16_t ret[10];            /* The result of that thread. */
+  uint64_t busy_ns;            /* Time spent searching by all threads. Updated atomically. */
+  uint8_t outer_func_order[256];
+  uint8_t middle_func_order[256];
+};
+
+/* With more than one rank, the chunks are taken from g_chunk_counter on rank 0 through
+   g_chunk_window. Creating and freeing a window are collective operations, so the window is
+   created by the first LUT search and kept until free_lut_searches. Rank 0 sets the counter back
+   to zero in get_search_result, when all ranks are done with the chunks of a search. */
+static MPI_Win g_chunk_window = MPI_WIN_NULL;
+static uint64_t g_chunk_counter = 0;
+
+/* Time spent in the LUT searches by the threads of this rank, for print_lut_search_stats. */
+static uint64_t g_lut_searches = 0;
+static double g_lut_busy_time = 0;  /* Thread seconds spent searching blocks. */
+static double g_lut_total_time = 0; /* Thread seconds from the start to the end of the searches. */
+
+/* Returns the time of the monotonic clock in seconds. */
+static double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  int rank, size;
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &size);
+/* Sets up ls for a search of the numbers 0 ... size - 1. Must be called by all ranks. The first
+   call creates the chunk window. */
+static void start_lut_search(lut_search *ls, const state *st, const ttable target,
+    const ttable mask, bool (*search_block)(lut_search*, uint64_t, uint64_t, uint16_t*),
+    uint64_t size, uint64_t block_size) {
+  ls->st = st;
+  ls->target = target;
+  ls->mask = mask;
+  ls->search_block = search_block;
+  ls->search_item = NULL;
+  ls->size = size;
+  ls->block_size = block_size;
+  MPI_Comm_size(MPI_COMM_WORLD, &ls->num_ranks);
+  ls->counter = 0;
+  ls->fetched = 0;
+  /* The counter is zero before any rank can access it. */
+  if (ls->num_ranks > 1 && g_chunk_window == MPI_WIN_NULL) {
+    MPI_Win_create(&g_chunk_counter, sizeof(uint64_t), sizeof(uint64_t), MPI_INFO_NULL,
+        MPI_COMM_WORLD, &g_chunk_window);
+    MPI_Win_lock_all(0, g_chunk_window);
+  }
+  pthread_mutex_init(&ls->lock, NULL);
+  pthread_cond_init(&ls->cond, NULL);
+  ls->next = ls->stop = 0;
+  ls->pending_start = ls->pending_stop = 0;
+  ls->exhausted = false;
+  ls->running = 0;
+  ls->queue_start = 0;
+  ls->queue_size = 0;
+  ls->recv_req = NULL;
+  ls->received = false;
+  ls->cancel = false;
+  ls->found = false;
+  ls->busy_ns = 0;
+}
+
+/* Frees the resources of ls and adds its time to the statistics. start_time is the time when the
+   search started. */
+static void finish_lut_search(lut_search *ls, double start_time) {
+  pthread_mutex_destroy(&ls->lock);
+  pthread_cond_destroy(&ls->cond);
+  g_lut_busy_time += ls->busy_ns * 1e-9;
+  g_lut_total_time += (get_time() - start_time) * g_num_threads;
+}
+
+/* Returns true if the threads of the search should stop. */
+static inline bool lut_search_cancelled(lut_search *ls) {
+  return __atomic_load_n(&ls->cancel, __ATOMIC_RELAXED);
+}
+
+/* Makes all threads of the search stop. */
+static void cancel_lut_search(lut_search *ls) {
+  pthread_mutex_lock(&ls->lock);
+  __atomic_store_n(&ls->cancel, true, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&ls->cond);
+  pthread_mutex_unlock(&ls->lock);
+}
 
-  uint8_t func_order[256];
+/* Fisher-Yates shuffles the 256 LUT functions into order. */
+static void shuffle_lut_functions(uint8_t *order) {
   for (int i = 0; i < 256; i++) {
-    func_order[i] = i;
+    order[i] = i;
   }
-  /* Fisher-Yates shuffle. */
   for (int i = 0; i < 256; i++) {
     uint64_t j = xorshift1024() % (i + 1);
-    uint8_t t = func_order[i];
-    func_order[i] = func_order[j];
-    func_order[j] = t;
-  }
-
-  /* Determine this rank's work. */
-  uint64_t search_space_size = n_choose_k(st.num_gates, 5);
-  uint64_t worker_space_size = search_space_size / size;
-  uint64_t remainder = search_space_size - worker_space_size * size;
-  uint64_t start_n;
-  uint64_t stop_n;
-  if (rank < remainder) {
-    start_n = (worker_space_size + 1) * rank;
-    stop_n = start_n + worker_space_size + 1;
+    uint8_t t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+}
+
+/* Fetches the next chunk [start, stop) from the counter. The chunk is empty if there are no
+   numbers left. Only called by the main thread. */
+static void fetch_chunk(lut_search *ls, uint64_t *start, uint64_t *stop) {
+  /* The start of the last chunk tells how far the other ranks have come. */
+  uint64_t chunk_size = (ls->size - ls->fetched) / (CHUNKS_PER_RANK * ls->num_ranks);
+  if (chunk_size < MIN_CHUNK_SIZE) {
+    chunk_size = MIN_CHUNK_SIZE;
+  }
+  if (ls->num_ranks == 1) {
+    *start = ls->counter;
+    ls->counter += chunk_size;
   } else {
-    start_n = (worker_space_size + 1) * remainder + worker_space_size * (rank - remainder);
-    stop_n = start_n + worker_space_size;
+    MPI_Fetch_and_op(&chunk_size, start, MPI_UINT64_T, 0, 0, MPI_SUM, g_chunk_window);
+    MPI_Win_flush(0, g_chunk_window);
   }
-  gatenum nums[5] = {NO_GATE, NO_GATE, NO_GATE, NO_GATE, NO_GATE};
-  get_nth_combination(start_n, st.num_gates, 5, 0, nums);
+  if (*start >= ls->size) {
+    *start = *stop = ls->fetched = ls->size;
+    return;
+  }
+  ls->fetched = *start;
+  *stop = ls->size - *start < chunk_size ? ls->size : *start + chunk_size;
+}
 
-  ttable tt[5] = {st.gates[nums[0]].table, st.gates[nums[1]].table, st.gates[nums[2]].table,
-      st.gates[nums[3]].table, st.gates[nums[4]].table};
-  gatenum cache_set[3] = {NO_GATE, NO_GATE, NO_GATE};
-  ttable cache[256];
+/* Fetches a chunk if there is none waiting. Only called by the main thread. */
+static void refill_lut_search(lut_search *ls) {
+  /* The other threads only take the waiting chunk, they never add one. */
+  pthread_mutex_lock(&ls->lock);
+  const bool refill = !ls->exhausted && ls->pending_start == ls->pending_stop;
+  pthread_mutex_unlock(&ls->lock);
+  if (!refill) {
+    return;
+  }
+  uint64_t start, stop;
+  fetch_chunk(ls, &start, &stop);
+  pthread_mutex_lock(&ls->lock);
+  ls->pending_start = start;
+  ls->pending_stop = stop;
+  ls->exhausted = start == stop;
+  pthread_cond_broadcast(&ls->cond);
+  pthread_mutex_unlock(&ls->lock);
+}
 
-  memset(ret, 0, sizeof(uint16_t) * 10);
+/* Takes the next block [start, stop), moving on to the waiting chunk when the current one is used
+   up. A small chunk is shared between the threads of the rank. Returns false if there is no block.
+   Called with the lock held. */
+static bool take_lut_block(lut_search *ls, uint64_t *start, uint64_t *stop) {
+  if (ls->next == ls->stop) {
+    ls->next = ls->pending_start;
+    ls->stop = ls->pending_stop;
+    ls->pending_start = ls->pending_stop;
+  }
+  if (ls->next == ls->stop) {
+    return false;
+  }
+  uint64_t block_size = (ls->stop - ls->next + g_num_threads - 1) / g_num_threads;
+  if (block_size > ls->block_size) {
+    block_size = ls->block_size;
+  }
+  *start = ls->next;
+  *stop = ls->next + block_size;
+  ls->next = *stop;
+  return true;
+}
 
-  MPI_Request recv_req = MPI_REQUEST_NULL;
-  MPI_Request send_req = MPI_REQUEST_NULL;
-  int quit_msg = -1;
+/* Puts the combination nums in the queue of the rank. Returns false if the queue is full. */
+static bool push_lut_item(lut_search *ls, const gatenum *nums) {
+  pthread_mutex_lock(&ls->lock);
+  const bool pushed = ls->queue_size < LUT_QUEUE_SIZE;
+  if (pushed) {
+    memcpy(ls->queue[(ls->queue_start + ls->queue_size) % LUT_QUEUE_SIZE], nums,
+        sizeof(ls->queue[0]));
+    ls->queue_size += 1;
+    pthread_cond_signal(&ls->cond);
+  }
+  pthread_mutex_unlock(&ls->lock);
+  return pushed;
+}
 
-  if (rank == 0) {
-    MPI_Irecv(&quit_msg, 1, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &recv_req);
-  } else {
-    MPI_Irecv(&quit_msg, 1, MPI_INT, 0, 2, MPI_COMM_WORLD, &recv_req);
+/* Takes the first combination in the queue into nums. Returns false if the queue is empty. Called
+   with the lock held. */
+static bool pop_lut_item(lut_search *ls, gatenum *nums) {
+  if (ls->queue_size == 0) {
+    return false;
   }
+  memcpy(nums, ls->queue[ls->queue_start], sizeof(ls->queue[0]));
+  ls->queue_start = (ls->queue_start + 1) % LUT_QUEUE_SIZE;
+  ls->queue_size -= 1;
+  return true;
+}
 
-  bool quit = false;
-  for (uint64_t i = start_n; !quit && i < stop_n; i++) {
-    if (check_5lut_possible(target, mask, tt[0], tt[1], tt[2], tt[3], tt[4])) {
-      if (cache_set[0] != nums[0] || cache_set[1] != nums[1] || cache_set[2] != nums[2]) {
-        generate_lut_ttables(tt[0], tt[1], tt[2], cache);
-        cache_set[0] = nums[0];
-        cache_set[1] = nums[1];
-        cache_set[2] = nums[2];
+/* Searches combinations from the queue and blocks of ls until there is nothing left or the search
+   has been cancelled. The other threads wait for the main thread when there is no chunk, and all
+   threads wait for the threads that are still searching when the chunks are used up. The main
+   thread only leaves when no thread is searching, so that it can cancel the search if another rank
+   finds a LUT or the deadline passes. */
+static void run_lut_blocks(lut_search *ls, bool main_thread) {
+  while (!lut_search_cancelled(ls)) {
+    if (main_thread && ls->recv_req != NULL) {
+      int flag;
+      MPI_Test(ls->recv_req, &flag, MPI_STATUS_IGNORE);
+      if (flag) {
+        ls->received = true;
+        cancel_lut_search(ls);
+        break;
       }
-
-      for (uint16_t fo = 0; !quit && fo < 256; fo++) {
-        uint8_t func_outer = func_order[fo];
-        ttable t_outer = cache[func_outer];
-        uint8_t func_inner;
-        if (!get_lut_function(t_outer, tt[3], tt[4], target, mask, true, &func_inner)) {
-          continue;
-        }
-        ttable t_inner = generate_lut_ttable(func_inner, t_outer, tt[3], tt[4]);
-        assert(ttable_equals_mask(target, t_inner, mask));
-        ret[0] = func_outer;
-        ret[1] = func_inner;
-        ret[2] = nums[0];
-        ret[3] = nums[1];
-        ret[4] = nums[2];
-        ret[5] = nums[3];
-        ret[6] = nums[4];
-        ret[7] = 0;
-        ret[8] = 0;
-        ret[9] = 0;
-        assert(send_req == MPI_REQUEST_NULL);
-        if (rank == 0) {
-          quit_msg = 0;
-        } else {
-          MPI_Isend(&rank, 1, MPI_INT, 0, 1, MPI_COMM_WORLD, &send_req);
-        }
-        quit = true;
-        printf("[% 4d] Found 5LUT: %02x %02x    %3d %3d %3d %3d %3d\n", rank, func_outer,
-            func_inner, nums[0], nums[1], nums[2], nums[3], nums[4]);
+    }
+    if (main_thread) {
+      /* Like the other searches, a LUT search gives up at the deadline. */
+      poll_incumbent();
+      if (incumbent_expired()) {
+        cancel_lut_search(ls);
+        break;
       }
+      refill_lut_search(ls);
     }
-    if (!quit) {
-      int flag;
-      MPI_Test(&recv_req, &flag, MPI_STATUS_IGNORE);
-      if (flag) {
+    uint64_t start, stop;
+    gatenum nums[7];
+    pthread_mutex_lock(&ls->lock);
+    bool have_item = pop_lut_item(ls, nums);
+    bool have_block = !have_item && take_lut_block(ls, &start, &stop);
+    while (!have_item && !have_block && !main_thread && !lut_search_cancelled(ls)
+        && (!ls->exhausted || ls->running > 0)) {
+      pthread_cond_wait(&ls->cond, &ls->lock);
+      have_item = pop_lut_item(ls, nums);
+      have_block = !have_item && take_lut_block(ls, &start, &stop);
+    }
+    if (!have_item && !have_block && main_thread && ls->exhausted && ls->running > 0) {
+      /* The other threads are still searching, and their blocks may put more combinations in the
+         queue. Wait for them, but keep checking for messages from the other ranks. */
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += LUT_POLL_INTERVAL_NS;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec += 1;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&ls->cond, &ls->lock, &ts);
+      pthread_mutex_unlock(&ls->lock);
+      continue;
+    }
+    if (have_item || have_block) {
+      ls->running += 1;
+    }
+    const bool exhausted = ls->exhausted;
+    pthread_mutex_unlock(&ls->lock);
+    if (!have_item && !have_block) {
+      if (exhausted || !main_thread) {
         break;
       }
-      next_combination(nums, 5, st.num_gates);
+      continue; /* The main thread fetches another chunk. */
+    }
+
+    const double search_start = get_time();
+    uint16_t ret[10];
+    const bool found = have_item ? ls->search_item(ls, nums, ret)
+        : ls->search_block(ls, start, stop, ret);
+    __atomic_fetch_add(&ls->busy_ns, (uint64_t)((get_time() - search_start) * 1e9),
+        __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ls->lock);
+    ls->running -= 1;
+    if (ls->running == 0) {
+      pthread_cond_broadcast(&ls->cond);
+    }
+    pthread_mutex_unlock(&ls->lock);
+    if (found) {
+      bool expected = false;
+      if (__atomic_compare_exchange_n(&ls->found, &expected, true, false, __ATOMIC_RELAXED,
+          __ATOMIC_RELAXED)) {
+        memcpy(ls->ret, ret, sizeof(ret));
+      }
+      cancel_lut_search(ls);
     }
   }
+}
 
-  return get_search_result(ret, &quit_msg, &recv_req, &send_req);
+/* Start function of the threads of a LUT search. */
+static void *lut_search_thread(void *arg) {
+  run_lut_blocks((lut_search*)arg, false);
+  return NULL;
 }
 
-/* Search for a combination of seven outputs in the graph that can be connected with a 7-input LUT
-   to create an output truth table that matches target in the positions where mask is set. Returns
-   true on success. In that case the result is returned in the 10 position array ret: ret[0]
-   contains the outer LUT function, ret[1] the middle LUT function, ret[2] the inner LUT function,
-   and ret[3] - ret[9] the seven input gate numbers. */
-bool search_7lut(const state st, const ttable target, const ttable mask, uint16_t *ret) {
-  assert(ret != NULL);
-  assert(st.num_gates >= 7);
+/* Runs the search ls with g_num_threads threads, the calling thread being one of them. Returns
+   when all threads are done. The result, if any, is then in ls->ret. */
+static void run_lut_search(lut_search *ls) {
+  pthread_t threads[g_num_threads];
+  int num_started = 0;
+  while (num_started < g_num_threads - 1
+      && pthread_create(&threads[num_started], NULL, lut_search_thread, ls) == 0) {
+    num_started += 1;
+  }
+  run_lut_blocks(ls, true);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
 
-  int rank, size;
+void free_lut_searches() {
+  if (g_chunk_window != MPI_WIN_NULL) {
+    MPI_Win_unlock_all(g_chunk_window);
+    MPI_Win_free(&g_chunk_window);
+  }
+}
+
+void print_lut_search_stats() {
+  if (g_lut_searches == 0) {
+    return;
+  }
+  int rank;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  const double idle_time = g_lut_total_time - g_lut_busy_time;
+  printf("[% 4d] %" PRIu64 " LUT searches: %.1f s busy, %.1f s idle (%.1f%%) in %d thread%s.\n",
+      rank, g_lut_searches, g_lut_busy_time, idle_time,
+      g_lut_total_time == 0 ? 0.0 : 100.0 * idle_time / g_lut_total_time, g_num_threads,
+      g_num_threads == 1 ? "" : "s");
+}
 
-  /* Determine this rank's work. */
-  uint64_t search_space_size = n_choose_k(st.num_gates, 7);
-  uint64_t worker_space_size = search_space_size / size;
-  uint64_t remainder = search_space_size - worker_space_size * size;
-  uint64_t start;
-  uint64_t stop;
-  if (rank < remainder) {
-    start = (worker_space_size + 1) * rank;
-    stop = start + worker_space_size + 1;
+/* Sets up the receive request that completes when the search is over on another rank. Rank 0
+   receives the rank of a worker that has found a LUT, and the workers receive the quit message
+   from rank 0. */
+static void start_search_request(int rank, int *quit_msg, MPI_Request *recv_req) {
+  if (rank == 0) {
+    MPI_Irecv(quit_msg, 1, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, recv_req);
   } else {
-    start = (worker_space_size + 1) * remainder + worker_space_size * (rank - remainder);
-    stop = start + worker_space_size;
+    MPI_Irecv(quit_msg, 1, MPI_INT, 0, 2, MPI_COMM_WORLD, recv_req);
   }
-  gatenum nums[7];
-  get_nth_combination(start, st.num_gates, 7, 0, nums);
-
-  ttable tt[7] = {st.gates[nums[0]].table, st.gates[nums[1]].table, st.gates[nums[2]].table,
-      st.gates[nums[3]].table, st.gates[nums[4]].table, st.gates[nums[5]].table,
-      st.gates[nums[6]].table};
-
-  /* Filter out the gate combinations where a 7LUT is possible. */
-  gatenum *result = malloc(sizeof(gatenum) * 7 * 100000);
-  assert(result != NULL);
-  int p = 0;
-  for (uint64_t i = start; i < stop; i++) {
-    if (check_7lut_possible(target, mask, tt[0], tt[1], tt[2], tt[3], tt[4], tt[5], tt[6])) {
-      result[p++] = nums[0];
-      result[p++] = nums[1];
-      result[p++] = nums[2];
-      result[p++] = nums[3];
-      result[p++] = nums[4];
-      result[p++] = nums[5];
-      result[p++] = nums[6];
+}
+
+/* Tells rank 0 that this rank has found a LUT, unless this is rank 0 and another rank has already
+   done so. rank is the send buffer and must be kept until get_search_result. */
+static void send_search_found(const lut_search *ls, int *rank, int *quit_msg,
+    MPI_Request *send_req) {
+  assert(*send_req == MPI_REQUEST_NULL);
+  if (*rank != 0) {
+    MPI_Isend(rank, 1, MPI_INT, 0, 1, MPI_COMM_WORLD, send_req);
+  } else if (!ls->received) {
+    *quit_msg = 0;
+  }
+}
+
+/* Searches the 5LUT combinations start ... stop - 1. */
+static bool search_5lut_block(lut_search *ls, uint64_t start, uint64_t stop, uint16_t *ret) {
+  const state *st = ls->st;
+  gatenum nums[5];
+  get_nth_combination(start, st->num_gates, 5, 0, nums);
+  gatenum cache_set[3] = {NO_GATE, NO_GATE, NO_GATE};
+  ttable cache[256];
+
+  for (uint64_t i = start; i < stop && !lut_search_cancelled(ls); i++) {
+    if (i != start) {
+      next_combination(nums, 5, st->num_gates);
     }
-    if (p >= 7 * 100000) {
-      break;
+    const ttable tt[5] = {st->tables[nums[0]], st->tables[nums[1]], st->tables[nums[2]],
+        st->tables[nums[3]], st->tables[nums[4]]};
+    if (!check_5lut_possible(ls->target, ls->mask, tt[0], tt[1], tt[2], tt[3], tt[4])) {
+      continue;
+    }
+    if (cache_set[0] != nums[0] || cache_set[1] != nums[1] || cache_set[2] != nums[2]) {
+      generate_lut_ttables(tt[0], tt[1], tt[2], cache);
+      cache_set[0] = nums[0];
+      cache_set[1] = nums[1];
+      cache_set[2] = nums[2];
+    }
+
+    for (uint16_t fo = 0; fo < 256; fo++) {
+      uint8_t func_outer = ls->outer_func_order[fo];
+      ttable t_outer = cache[func_outer];
+      uint8_t func_inner;
+      if (!get_lut_function(t_outer, tt[3], tt[4], ls->target, ls->mask, true, &func_inner)) {
+        continue;
+      }
+      ttable t_inner = generate_lut_ttable(func_inner, t_outer, tt[3], tt[4]);
+      assert(ttable_equals_mask(ls->target, t_inner, ls->mask));
+      ret[0] = func_outer;
+      ret[1] = func_inner;
+      ret[2] = nums[0];
+      ret[3] = nums[1];
+      ret[4] = nums[2];
+      ret[5] = nums[3];
+      ret[6] = nums[4];
+      ret[7] = 0;
+      ret[8] = 0;
+      ret[9] = 0;
+      return true;
     }
-    next_combination(nums, 7, st.num_gates);
-  }
-
-  /* Gather the number of hits for each rank.*/
-  int rank_nums[size];
-  MPI_Allgather(&p, 1, MPI_INT, rank_nums, 1, MPI_INT, MPI_COMM_WORLD);
-  assert(rank_nums[0] % 7 == 0);
-  int tsize = rank_nums[0];
-  int offsets[size];
-  offsets[0] = 0;
-  for (int i = 1; i < size; i++) {
-    assert(rank_nums[i] % 7 == 0);
-    tsize += rank_nums[i];
-    offsets[i] = offsets[i - 1] + rank_nums[i - 1];
-  }
-
-  gatenum *lut_list = malloc(sizeof(gatenum) * tsize);
-  assert(lut_list != NULL);
-
-  /* Get all hits. */
-  MPI_Allgatherv(result, p, MPI_UINT16_T, lut_list, rank_nums, offsets, MPI_UINT16_T,
-      MPI_COMM_WORLD);
-  free(result);
-  result = NULL;
-
-  /* Calculate rank's work chunk. */
-  worker_space_size = (tsize / 7) / size;
-  remainder = (tsize / 7) - worker_space_size * size;
-  if (rank < remainder) {
-    start = (worker_space_size + 1) * rank;
-    stop  = start + worker_space_size + 1;
-  } else {
-    start = (worker_space_size + 1) * remainder + worker_space_size * (rank - remainder);
-    stop = start + worker_space_size;
   }
+  return false;
+}
 
-  uint8_t outer_func_order[256];
-  uint8_t middle_func_order[256];
-  for (int i = 0; i < 256; i++) {
-    outer_func_order[i] = middle_func_order[i] = i;
+/* Search for a combination of five outputs in the graph that can be connected with a 5-input LUT
+   to create an output truth table that matches target in the positions where mask is set. Returns
+   true on success. In that case the result is returned in the 7 position array ret: ret[0]
+   contains the outer LUT function, ret[1] the inner LUT function, and ret[2] - ret[6] the five
+   input gate numbers. */
+bool search_5lut(const state *st, const ttable target, const ttable mask, uint16_t *ret) {
+  assert(ret != NULL);
+  assert(st->num_gates >= 5);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  const double start_time = get_time();
+  lut_search ls;
+  start_lut_search(&ls, st, target, mask, search_5lut_block, n_choose_k(st->num_gates, 5),
+      COMBINATION_BLOCK_SIZE);
+  shuffle_lut_functions(ls.outer_func_order);
+
+  memset(ret, 0, sizeof(uint16_t) * 10);
+
+  MPI_Request recv_req = MPI_REQUEST_NULL;
+  MPI_Request send_req = MPI_REQUEST_NULL;
+  int quit_msg = -1;
+  start_search_request(rank, &quit_msg, &recv_req);
+  ls.recv_req = &recv_req;
+
+  run_lut_search(&ls);
+
+  if (ls.found) {
+    memcpy(ret, ls.ret, sizeof(uint16_t) * 10);
+    send_search_found(&ls, &rank, &quit_msg, &send_req);
+    printf("[% 4d] Found 5LUT: %02x %02x    %3d %3d %3d %3d %3d\n", rank, ret[0], ret[1], ret[2],
+        ret[3], ret[4], ret[5], ret[6]);
   }
 
-  /* Fisher-Yates shuffle the function search orders. */
-  for (int i = 0; i < 256; i++) {
-    uint64_t oj = xorshift1024() % (i + 1);
-    uint64_t mj = xorshift1024() % (i + 1);
-    uint8_t ot = outer_func_order[i];
-    uint8_t mt = middle_func_order[i];
-    outer_func_order[i] = outer_func_order[oj];
-    middle_func_order[i] = middle_func_order[mj];
-    outer_func_order[oj] = ot;
-    middle_func_order[mj] = mt;
-  }
-  int outer_cache_set = 0;
-  int middle_cache_set = 0;
+  const bool found = get_search_result(ret, &quit_msg, &recv_req, &send_req);
+  finish_lut_search(&ls, start_time);
+  g_lut_searches += 1;
+  return found;
+}
+
+/* Searches for the LUT functions that connect the seven gates in nums. */
+static bool search_7lut_item(lut_search *ls, const gatenum *nums, uint16_t *ret) {
+  const state *st = ls->st;
   ttable outer_cache[256];
   ttable middle_cache[256];
+  generate_lut_ttables(st->tables[nums[0]], st->tables[nums[1]], st->tables[nums[2]], outer_cache);
+  generate_lut_ttables(st->tables[nums[3]], st->tables[nums[4]], st->tables[nums[5]],
+      middle_cache);
+  const ttable tg = st->tables[nums[6]];
+
+  for (uint16_t fo = 0; fo < 256 && !lut_search_cancelled(ls); fo++) {
+    uint8_t func_outer = ls->outer_func_order[fo];
+    ttable t_outer = outer_cache[func_outer];
+    for (uint16_t fm = 0; fm < 256; fm++) {
+      uint8_t func_middle = ls->middle_func_order[fm];
+      ttable t_middle = middle_cache[func_middle];
+      uint8_t func_inner;
+      if (!get_lut_function(t_outer, t_middle, tg, ls->target, ls->mask, true, &func_inner)) {
+        continue;
+      }
+      ttable t_inner = generate_lut_ttable(func_inner, t_outer, t_middle, tg);
+      assert(ttable_equals_mask(ls->target, t_inner, ls->mask));
+      ret[0] = func_outer;
+      ret[1] = func_middle;
+      ret[2] = func_inner;
+      for (int i = 0; i < 7; i++) {
+        ret[3 + i] = nums[i];
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Searches the 7LUT combinations start ... stop - 1. The combinations for which a 7LUT is
+   possible are put in the queue, so that the threads of the rank search them while this thread
+   goes on. When the queue is full, this thread searches them itself. */
+static bool search_7lut_block(lut_search *ls, uint64_t start, uint64_t stop, uint16_t *ret) {
+  const state *st = ls->st;
+  gatenum nums[7];
+  get_nth_combination(start, st->num_gates, 7, 0, nums);
+
+  for (uint64_t i = start; i < stop && !lut_search_cancelled(ls); i++) {
+    if (i != start) {
+      next_combination(nums, 7, st->num_gates);
+    }
+    if (!check_7lut_possible(ls->target, ls->mask, st->tables[nums[0]], st->tables[nums[1]],
+        st->tables[nums[2]], st->tables[nums[3]], st->tables[nums[4]], st->tables[nums[5]],
+        st->tables[nums[6]])) {
+      continue;
+    }
+    if (!push_lut_item(ls, nums) && search_7lut_item(ls, nums, ret)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Search for a combination of seven outputs in the graph that can be connected with a 7-input LUT
+   to create an output truth table that matches target in the positions where mask is set. Returns
+   true on success. In that case the result is returned in the 10 position array ret: ret[0]
+   contains the outer LUT function, ret[1] the middle LUT function, ret[2] the inner LUT function,
+   and ret[3] - ret[9] the seven input gate numbers. */
+bool search_7lut(const state *st, const ttable target, const ttable mask, uint16_t *ret) {
+  assert(ret != NULL);
+  assert(st->num_gates >= 7);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  const double start_time = get_time();
+  lut_search ls;
+  start_lut_search(&ls, st, target, mask, search_7lut_block, n_choose_k(st->num_gates, 7),
+      COMBINATION_BLOCK_SIZE);
+  ls.search_item = search_7lut_item;
+  shuffle_lut_functions(ls.outer_func_order);
+  shuffle_lut_functions(ls.middle_func_order);
   memset(ret, 0, 10 * sizeof(uint16_t));
 
   MPI_Request recv_req = MPI_REQUEST_NULL;
   MPI_Request send_req = MPI_REQUEST_NULL;
   int quit_msg = -1;
+  start_search_request(rank, &quit_msg, &recv_req);
+  ls.recv_req = &recv_req;
 
-  if (rank == 0) {
-    MPI_Irecv(&quit_msg, 1, MPI_INT, MPI_ANY_SOURCE, 1, MPI_COMM_WORLD, &recv_req);
-  } else {
-    MPI_Irecv(&quit_msg, 1, MPI_INT, 0, 2, MPI_COMM_WORLD, &recv_req);
-  }
-
-  bool quit = false;
-  for (int i = start; !quit && i < stop; i++) {
-    const gatenum a = lut_list[7 * i];
-    const gatenum b = lut_list[7 * i + 1];
-    const gatenum c = lut_list[7 * i + 2];
-    const gatenum d = lut_list[7 * i + 3];
-    const gatenum e = lut_list[7 * i + 4];
-    const gatenum f = lut_list[7 * i + 5];
-    const gatenum g = lut_list[7 * i + 6];
-    const ttable ta = st.gates[a].table;
-    const ttable tb = st.gates[b].table;
-    const ttable tc = st.gates[c].table;
-    const ttable td = st.gates[d].table;
-    const ttable te = st.gates[e].table;
-    const ttable tf = st.gates[f].table;
-    const ttable tg = st.gates[g].table;
-    if (((uint64_t)a << 32 | (uint64_t)b << 16 | c) != outer_cache_set) {
-      generate_lut_ttables(ta, tb, tc, outer_cache);
-      outer_cache_set = (uint64_t)a << 32 | (uint64_t)b << 16 | c;
-    }
-    if (((uint64_t)d << 32 | (uint64_t)e << 16 | f) != middle_cache_set) {
-      generate_lut_ttables(td, te, tf, middle_cache);
-      middle_cache_set = (uint64_t)d << 32 | (uint64_t)e << 16 | f;
-    }
+  run_lut_search(&ls);
 
-    for (uint16_t fo = 0; !quit && fo < 256; fo++) {
-      uint8_t func_outer = outer_func_order[fo];
-      ttable t_outer = outer_cache[func_outer];
-      for (uint16_t fm = 0; !quit && fm < 256; fm++) {
-        uint8_t func_middle = middle_func_order[fm];
-        ttable t_middle = middle_cache[func_middle];
-        uint8_t func_inner;
-        if (!get_lut_function(t_outer, t_middle, tg, target, mask, true, &func_inner)) {
-          continue;
-        }
-        ttable t_inner = generate_lut_ttable(func_inner, t_outer, t_middle, tg);
-        assert(ttable_equals_mask(target, t_inner, mask));
-        ret[0] = func_outer;
-        ret[1] = func_middle;
-        ret[2] = func_inner;
-        ret[3] = a;
-        ret[4] = b;
-        ret[5] = c;
-        ret[6] = d;
-        ret[7] = e;
-        ret[8] = f;
-        ret[9] = g;
-        assert(send_req == MPI_REQUEST_NULL);
-        if (rank == 0) {
-          quit_msg = 0;
-        } else {
-          MPI_Isend(&rank, 1, MPI_INT, 0, 1, MPI_COMM_WORLD, &send_req);
-        }
-        quit = true;
-        printf("[% 4d] Found 7LUT: %02x %02x %02x %3d %3d %3d %3d %3d %3d %3d\n", rank, func_outer,
-            func_middle, func_inner, a, b, c, d, e, f, g);
-      }
-    }
-    if (!quit) {
-      int flag;
-      MPI_Test(&recv_req, &flag, MPI_STATUS_IGNORE);
-      if (flag) {
-        quit = true;
-      }
-    }
+  if (ls.found) {
+    memcpy(ret, ls.ret, sizeof(uint16_t) * 10);
+    send_search_found(&ls, &rank, &quit_msg, &send_req);
+    printf("[% 4d] Found 7LUT: %02x %02x %02x %3d %3d %3d %3d %3d %3d %3d\n", rank, ret[0],
+        ret[1], ret[2], ret[3], ret[4], ret[5], ret[6], ret[7], ret[8], ret[9]);
   }
-  free(lut_list);
-  return get_search_result(ret, &quit_msg, &recv_req, &send_req);
+  const bool found = get_search_result(ret, &quit_msg, &recv_req, &send_req);
+  finish_lut_search(&ls, start_time);
+  g_lut_searches += 1;
+  return found;
 }
 
 /* Generates the nth combination of num_gates choose t gates numbered first, first + 1, ...
@@ -573,6 +752,14 @@ static bool get_search_result(uint16_t *ret, int *quit_msg, MPI_Request *recv_re
   /* Wait for all workers before continuing. */
   MPI_Barrier(MPI_COMM_WORLD);
 
+  /* No rank takes any more chunks in this search. The second barrier below keeps the ranks from
+     starting the next search before the counter has been reset. */
+  if (rank == 0 && g_chunk_window != MPI_WIN_NULL) {
+    const uint64_t zero = 0;
+    MPI_Accumulate(&zero, 1, MPI_UINT64_T, 0, 0, 1, MPI_UINT64_T, MPI_REPLACE, g_chunk_window);
+    MPI_Win_flush(0, g_chunk_window);
+  }
+
   /* Cancel any non-completed requests. */
   if (*recv_req != MPI_REQUEST_NULL) {
     MPI_Test(recv_req, &flag, MPI_STATUS_IGNORE);
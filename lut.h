@@ -43,6 +43,14 @@ ttable generate_lut_ttable(const uint8_t function, const ttable in1, const ttabl
    caching in the search functions. */
 void generate_lut_ttables(const ttable in1, const ttable in2, const ttable in3, ttable *out);
 
+/* Returns the partially specified LUT function with the three input truth tables and an output
+   truth table matching target in the positions where mask is set. Bit i of care is set if the
+   input combination i occurs in a position where mask is set, and bit i of func is then the target
+   value in those positions. The other bits of func are zero. Returns false if no such function
+   exists. */
+bool get_partial_lut_function(const ttable in1, const ttable in2, const ttable in3,
+    const ttable target, const ttable mask, uint8_t *func, uint8_t *care);
+
 /* Returns a LUT function func with the three input truth tables with an output truth table matching
    target in the positions where mask is set. Returns true on success and false if no function that
    can satisfy the target truth table exists. */
@@ -54,13 +62,22 @@ bool get_lut_function(const ttable in1, const ttable in2, const ttable in3, cons
    true on success. In that case the result is returned in the 7 position array ret: ret[0]
    contains the outer LUT function, ret[1] the inner LUT function, and ret[2] - ret[6] the five
    input gate numbers. */
-bool search_5lut(const state st, const ttable target, const ttable mask, uint16_t *ret);
+bool search_5lut(const state *st, const ttable target, const ttable mask, uint16_t *ret);
 
 /* Search for a combination of seven outputs in the graph that can be connected with a 7-input LUT
    to create an output truth table that matches target in the positions where mask is set. Returns
    true on success. In that case the result is returned in the 10 position array ret: ret[0]
    contains the outer LUT function, ret[1] the middle LUT function, ret[2] the inner LUT function,
    and ret[3] - ret[9] the seven input gate numbers. */
-bool search_7lut(const state st, const ttable target, const ttable mask, uint16_t *ret);
+bool search_7lut(const state *st, const ttable target, const ttable mask, uint16_t *ret);
+
+/* Frees the resources kept between the LUT searches. Must be called by all ranks that have taken
+   part in LUT searches, after the last one. */
+void free_lut_searches();
+
+/* Prints the time that the threads of the calling rank have spent searching in the LUT searches,
+   and the time they have spent waiting for work or for the other ranks. Prints nothing if the rank
+   has not taken part in any LUT search. */
+void print_lut_search_stats();
 
 #endif /* __LUT_H__ */
@@ -24,48 +24,163 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <mpi.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <x86intrin.h>
 #include "convert_graph.h"
+#include "incumbent.h"
+#include "kernels.h"
 #include "lut.h"
 #include "sboxgates.h"
 #include "state.h"
+#include "subcircuits.h"
+#include "transposition.h"
 
+/* The work of a LUT search, broadcast by rank 0 to the LUT workers. The searches only use the
+   truth tables of the gates of the state. The workers keep the truth tables of the previous
+   search, and the first num_kept of them are the same in this search. The num_new truth tables
+   that follow them are sent in a second broadcast. */
 typedef struct {
-  state st;
   ttable target;
   ttable mask;
+  gatenum num_kept;
+  gatenum num_new;
   bool quit;
 } mpi_work;
 
-uint8_t g_sbox_enc[256];    /* Target S-box. */
+/* The truth tables that the LUT workers have. Only used on rank 0. */
+static ttable g_lut_worker_tables[MAX_GATES];
+static gatenum g_num_lut_worker_tables = 0;
 
-ttable g_target[8];       /* Truth tables for the output bits of the sbox. */
-metric g_metric = GATES;  /* Metric that should be used when selecting between two solutions. */
+/* The work of adding a circuit for an output to a state, sent to a circuit worker rank by
+   generate_graph and generate_graph_one_output. */
+typedef struct {
+  state st;
+  ttable target;
+  int output;
+  int search;     /* Incumbent search number. */
+  bool randomize;
+  bool quit;
+} circuit_work;
 
-/* Test two truth tables for equality. */
-static inline bool ttable_equals(const ttable in1, const ttable in2) {
-  ttable res = in1 ^ in2;
-  return _mm256_testz_si256(res, res);
-}
+/* MPI tags of the circuit workers. Tags 1 and 2 are used by the LUT searches and 3 by the
+   incumbent. */
+#define CIRCUIT_WORK_TAG 4
+#define CIRCUIT_RESULT_TAG 5
+
+/* An affine variant of the target S-box S: S'(x) = S(x ^ input_xor) ^ output_xor. A circuit C for
+   S' gives S(x) = C(x ^ input_xor) ^ output_xor. Sent to the variant worker ranks in variant
+   search. */
+typedef struct {
+  int input_xor;
+  int output_xor;
+  int max_gates;      /* Limits of the search, as in state. */
+  int max_sat_metric;
+  bool screen;        /* Quick screening search. */
+  bool quit;
+} variant_work;
+
+/* MPI tags of the variant workers. The result is the number of gates and the SAT metric of the
+   best circuit, or INT_MAX if none was found. */
+#define VARIANT_WORK_TAG 6
+#define VARIANT_RESULT_TAG 7
+
+#define SCREEN_BEAM_WIDTH 2 /* Beam width of the screening searches. */
+
+uint16_t g_sbox_enc[TTABLE_BITS]; /* Target S-box. */
+
+ttable g_target[MAX_OUTPUTS]; /* Truth tables for the output bits of the sbox. */
+metric g_metric = GATES;  /* Metric that should be used when selecting between two solutions. */
+subcircuit_db *g_subcircuits = NULL; /* Database of four input circuits, if loaded with -u. */
+int g_beam_width = MAX_INPUTS;    /* Number of selection bits tried in each step 5 frame. */
+int g_discrepancies = MAX_INPUTS; /* Discrepancy limit of the step 5 selection bit order. */
+bool g_score_order = false;       /* Order gates by correlation with the target. */
+int g_num_threads = 1;            /* Number of threads of each rank. */
+
+#define MAX_THREADS 256
+
+/* Outside LUT mode, the circuits of generate_graph and generate_graph_one_output are built by the
+   other ranks, the circuit workers, and rank 0 only hands out the work. In LUT mode, all ranks
+   take part in the LUT searches instead. */
+static int g_num_workers = 0;          /* Number of circuit workers. Only set on rank 0. */
+static int *g_worker_outputs = NULL;   /* Output that each rank is building, or -1 if idle. */
+static int g_num_busy_workers = 0;
+
+/* A configuration of the search, run by one rank in portfolio mode. */
+typedef struct {
+  bool andnot;
+  metric cost_metric;
+  bool score_order;
+  int beam_width;
+  int discrepancies;
+} search_config;
+
+/* The configurations of portfolio mode. Rank i runs configuration i modulo the number of
+   configurations, so with more ranks, each configuration is run with several random seeds. */
+static const search_config g_portfolio_configs[] = {
+  {false, GATES, false, MAX_INPUTS, MAX_INPUTS},
+  {false, SAT,   false, MAX_INPUTS, MAX_INPUTS},
+  {true,  GATES, false, MAX_INPUTS, MAX_INPUTS},
+  {true,  SAT,   false, MAX_INPUTS, MAX_INPUTS},
+  {false, GATES, true,  MAX_INPUTS, MAX_INPUTS},
+  {true,  GATES, true,  MAX_INPUTS, MAX_INPUTS},
+  {false, GATES, false, 3,          MAX_INPUTS},
+  {false, SAT,   false, MAX_INPUTS, 2}
+};
+#define NUM_PORTFOLIO_CONFIGS (sizeof(g_portfolio_configs) / sizeof(search_config))
+
+/* Set in portfolio mode, where every rank runs its own search. */
+static bool g_portfolio = false;
+
+/* Set in variant search, where rank 0 hands out S-box variants to the other ranks. */
+static bool g_variants = false;
+
+/* Cleared in variant search, where only the state of the best variant is saved. */
+static bool g_save_states = true;
+
+/* The size of the best complete circuit found by this rank, by g_metric, and its state. */
+static int g_best_gates = INT_MAX;
+static int g_best_sat_metric = INT_MAX;
+static state g_best_state;
 
 /* Performs a masked test for equality. Only bits set to 1 in the mask will be tested. */
 bool ttable_equals_mask(const ttable in1, const ttable in2, const ttable mask) {
-  ttable res = (in1 ^ in2) & mask;
-  return _mm256_testz_si256(res, res);
+  return g_kernels.equals_mask(&in1, &in2, &mask);
+}
+
+/* Returns the gate limit of st: its max_gates field or the incumbent limit, whichever is lower. */
+static inline gatenum get_max_gates(const state *st) {
+  const gatenum incumbent = get_incumbent_gates();
+  return incumbent < st->max_gates ? incumbent : st->max_gates;
+}
+
+/* Returns the SAT metric limit of st: its max_sat_metric field or the incumbent limit, whichever
+   is lower. */
+static inline int get_max_sat_metric(const state *st) {
+  const int incumbent = get_incumbent_sat_metric();
+  return incumbent < st->max_sat_metric ? incumbent : st->max_sat_metric;
 }
 
 /* Adds a gate to the state st. Returns the gate id of the added gate. If an input gate is
-   equal to NO_GATE (only gid1 in case of a NOT gate), NO_GATE will be returned. */
+   equal to NO_GATE (only gid1 in case of a NOT gate), NO_GATE will be returned. If there already
+   is a gate with the same truth table, that gate is returned instead of adding a new one. */
 static inline gatenum add_gate(state *st, gate_type type, ttable table, gatenum gid1,
     gatenum gid2) {
-  if (gid1 == NO_GATE || (gid2 == NO_GATE && type != NOT) || st->num_gates > st->max_gates) {
+  if (gid1 == NO_GATE || (gid2 == NO_GATE && type != NOT)) {
     return NO_GATE;
   }
-  if (g_metric == SAT && st->sat_metric > st->max_sat_metric) {
+  gatenum existing = find_gate(st, table);
+  if (existing != NO_GATE) {
+    return existing;
+  }
+  if (st->num_gates > get_max_gates(st)) {
+    return NO_GATE;
+  }
+  /* max_sat_metric is only lowered from INT_MAX when the SAT metric is used. */
+  if (st->sat_metric > get_max_sat_metric(st)) {
     return NO_GATE;
   }
   assert(type != IN && type != LUT);
@@ -73,21 +188,29 @@ static inline gatenum add_gate(state *st, gate_type type, ttable table, gatenum
   assert(gid2 < st->num_gates || type == NOT);
   assert(gid1 != gid2);
   st->sat_metric += get_sat_metric(type);
-  st->gates[st->num_gates].table = table;
+  st->tables[st->num_gates] = table;
   st->gates[st->num_gates].type = type;
   st->gates[st->num_gates].in1 = gid1;
   st->gates[st->num_gates].in2 = gid2;
   st->gates[st->num_gates].in3 = NO_GATE;
   st->gates[st->num_gates].function = 0;
   st->num_gates += 1;
+  hash_gate(st, st->num_gates - 1);
   return st->num_gates - 1;
 }
 
 /* Adds a three input LUT with function func to the state st. Returns the gate number of the
-   added LUT. */
+   added LUT, or of an existing gate with the same truth table. */
 static inline gatenum add_lut(state *st, uint8_t func, ttable table, gatenum gid1, gatenum gid2,
     gatenum gid3) {
-  if (gid1 == NO_GATE || gid2 == NO_GATE || gid3 == NO_GATE || st->num_gates > st->max_gates) {
+  if (gid1 == NO_GATE || gid2 == NO_GATE || gid3 == NO_GATE) {
+    return NO_GATE;
+  }
+  gatenum existing = find_gate(st, table);
+  if (existing != NO_GATE) {
+    return existing;
+  }
+  if (st->num_gates > get_max_gates(st)) {
     return NO_GATE;
   }
   assert(gid1 < st->num_gates);
@@ -97,13 +220,14 @@ static inline gatenum add_lut(state *st, uint8_t func, ttable table, gatenum gid
     printf("%d %d %d\n", gid1, gid2, gid3);
   }
   assert(gid1 != gid2 && gid2 != gid3 && gid3 != gid1);
-  st->gates[st->num_gates].table = table;
+  st->tables[st->num_gates] = table;
   st->gates[st->num_gates].type = LUT;
   st->gates[st->num_gates].in1 = gid1;
   st->gates[st->num_gates].in2 = gid2;
   st->gates[st->num_gates].in3 = gid3;
   st->gates[st->num_gates].function = func;
   st->num_gates += 1;
+  hash_gate(st, st->num_gates - 1);
   return st->num_gates - 1;
 }
 
@@ -113,7 +237,7 @@ static inline gatenum add_not_gate(state *st, gatenum gid) {
   if (gid == NO_GATE) {
     return NO_GATE;
   }
-  return add_gate(st, NOT, ~st->gates[gid].table, gid, NO_GATE);
+  return add_gate(st, NOT, ~st->tables[gid], gid, NO_GATE);
 }
 
 static inline gatenum add_and_gate(state *st, gatenum gid1, gatenum gid2) {
@@ -123,7 +247,7 @@ static inline gatenum add_and_gate(state *st, gatenum gid1, gatenum gid2) {
   if (gid1 == gid2) {
     return gid1;
   }
-  return add_gate(st, AND, st->gates[gid1].table & st->gates[gid2].table, gid1, gid2);
+  return add_gate(st, AND, st->tables[gid1] & st->tables[gid2], gid1, gid2);
 }
 
 static inline gatenum add_or_gate(state *st, gatenum gid1, gatenum gid2) {
@@ -133,114 +257,40 @@ static inline gatenum add_or_gate(state *st, gatenum gid1, gatenum gid2) {
   if (gid1 == gid2) {
     return gid1;
   }
-  return add_gate(st, OR, st->gates[gid1].table | st->gates[gid2].table, gid1, gid2);
+  return add_gate(st, OR, st->tables[gid1] | st->tables[gid2], gid1, gid2);
 }
 
 static inline gatenum add_xor_gate(state *st, gatenum gid1, gatenum gid2) {
   if (gid1 == NO_GATE || gid2 == NO_GATE) {
     return NO_GATE;
   }
-  return add_gate(st, XOR, st->gates[gid1].table ^ st->gates[gid2].table, gid1, gid2);
+  return add_gate(st, XOR, st->tables[gid1] ^ st->tables[gid2], gid1, gid2);
 }
 
 static inline gatenum add_andnot_gate(state *st, gatenum gid1, gatenum gid2) {
   if (gid1 == NO_GATE || gid2 == NO_GATE) {
     return NO_GATE;
   }
-  return add_gate(st, ANDNOT, ~st->gates[gid1].table & st->gates[gid2].table, gid1, gid2);
-}
-
-static inline gatenum add_nand_gate(state *st, gatenum gid1, gatenum gid2) {
-  return add_not_gate(st, add_and_gate(st, gid1, gid2));
-}
-
-static inline gatenum add_nor_gate(state *st, gatenum gid1, gatenum gid2) {
-  return add_not_gate(st, add_or_gate(st, gid1, gid2));
-}
-
-static inline gatenum add_xnor_gate(state *st, gatenum gid1, gatenum gid2) {
-  return add_not_gate(st, add_xor_gate(st, gid1, gid2));
-}
-
-static inline gatenum add_or_not_gate(state *st, gatenum gid1, gatenum gid2) {
-  return add_or_gate(st, add_not_gate(st, gid1), gid2);
-}
-
-static inline gatenum add_and_not_gate(state *st, gatenum gid1, gatenum gid2) {
-  return add_and_gate(st, add_not_gate(st, gid1), gid2);
-}
-
-static inline gatenum add_or_3_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_or_gate(st, add_or_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_and_3_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_and_gate(st, add_and_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_xor_3_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_xor_gate(st, add_xor_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_and_or_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_or_gate(st, add_and_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_and_xor_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_xor_gate(st, add_and_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_xor_or_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_or_gate(st, add_xor_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_xor_and_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_and_gate(st, add_xor_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_or_and_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_and_gate(st, add_or_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_or_xor_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_xor_gate(st, add_or_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_andnot_or_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_or_gate(st, add_andnot_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_xor_andnot_a_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_andnot_gate(st, gid3, add_xor_gate(st, gid1, gid2));
-}
-
-static inline gatenum add_xor_andnot_b_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_andnot_gate(st, add_xor_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_and_andnot_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_and_gate(st, add_andnot_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_andnot_3_a_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_andnot_gate(st, gid1, add_andnot_gate(st, gid2, gid3));
+  return add_gate(st, ANDNOT, ~st->tables[gid1] & st->tables[gid2], gid1, gid2);
 }
 
-static inline gatenum add_andnot_3_b_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_andnot_gate(st, add_andnot_gate(st, gid1, gid2), gid3);
-}
-
-static inline gatenum add_andnot_xor_gate(state *st, gatenum gid1, gatenum gid2, gatenum gid3) {
-  return add_xor_gate(st, add_andnot_gate(st, gid1, gid2), gid3);
-}
-
-/* Returns the number of input gates in the state. */
-int get_num_inputs(const state *st) {
-  int inputs = 0;
-  for (int i = 0; st->gates[i].type == IN && i < st->num_gates; i++) {
-    inputs += 1;
+/* Adds a gate of the specified type. gid2 is ignored for NOT gates. */
+static inline gatenum add_typed_gate(state *st, gate_type type, gatenum gid1, gatenum gid2) {
+  switch (type) {
+    case NOT:
+      return add_not_gate(st, gid1);
+    case AND:
+      return add_and_gate(st, gid1, gid2);
+    case OR:
+      return add_or_gate(st, gid1, gid2);
+    case XOR:
+      return add_xor_gate(st, gid1, gid2);
+    case ANDNOT:
+      return add_andnot_gate(st, gid1, gid2);
+    default:
+      assert(0);
   }
-  return inputs;
+  return NO_GATE;
 }
 
 /* Returns the number of outputs in the current target S-box. */
@@ -249,8 +299,8 @@ static int get_num_outputs() {
   if (outputs != -1) {
     return outputs;
   }
-  for (int i = 7; i >= 0; i--) {
-    if (!_mm256_testz_si256(g_target[i], g_target[i])) {
+  for (int i = MAX_OUTPUTS - 1; i >= 0; i--) {
+    if (!ttable_zero(g_target[i])) {
       outputs = i + 1;
       return outputs;
     }
@@ -258,11 +308,12 @@ static int get_num_outputs() {
   assert(0);
 }
 
-/* Generates pseudorandom 64 bit strings. Used for randomizing the search process. */
+/* Generates pseudorandom 64 bit strings. Used for randomizing the search process. Each thread has
+   its own generator state. */
 uint64_t xorshift1024() {
-  static bool init = false;
-  static uint64_t rand[16];
-  static int p = 0;
+  static __thread bool init = false;
+  static __thread uint64_t rand[16];
+  static __thread int p = 0;
   if (!init) {
     FILE *rand_fp = fopen("/dev/urandom", "r");
     if (rand_fp == NULL) {
@@ -283,71 +334,357 @@ uint64_t xorshift1024() {
   return rand[p] * 1181783497276652981U;
 }
 
-/* Recursively builds the gate network. The numbered comments are references to Matthew Kwan's
-   paper. */
-static gatenum create_circuit(state *st, const ttable target, const ttable mask,
-    const int8_t *inbits, const bool andnot, const bool lut, const bool randomize) {
+/* Number of slots in a gate index. Must be a power of two and at least twice MAX_GATES. */
+#define GATE_INDEX_SIZE 1024
 
-  gatenum gate_order[MAX_GATES];
+/* Open addressing hash index of the gates in a state, keyed on the gate truth tables in the
+   positions where mask is set. Lets create_circuit find gates matching a target with a single
+   probe instead of scanning the whole state. */
+typedef struct {
+  ttable mask;
+  gatenum slots[GATE_INDEX_SIZE];
+} gate_index;
+
+/* Calculates a hash of a truth table. */
+static inline uint32_t ttable_hash(const ttable tbl) {
+  uint64_t h = 0;
+  for (int i = 0; i < TTABLE_WORDS; i++) {
+    h = (h ^ (uint64_t)tbl[i]) * 0x9e3779b97f4a7c15UL;
+  }
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Builds an index of the gates in st, keyed on their truth tables masked with mask. Gates are
+   inserted in the order given by gate_order. If several gates have the same masked truth table,
+   only the first one is kept. */
+static void build_gate_index(gate_index *idx, const state *st, const gatenum *gate_order,
+    const ttable mask) {
+  assert(st->num_gates <= GATE_INDEX_SIZE / 2);
+  idx->mask = mask;
+  memset(idx->slots, 0xff, sizeof(gatenum) * GATE_INDEX_SIZE);
   for (int i = 0; i < st->num_gates; i++) {
-    gate_order[i] = st->num_gates - 1 - i;
+    const gatenum gid = gate_order[i];
+    const ttable key = st->tables[gid] & mask;
+    uint32_t p = ttable_hash(key) & (GATE_INDEX_SIZE - 1);
+    while (idx->slots[p] != NO_GATE
+        && !ttable_equals_mask(key, st->tables[idx->slots[p]], mask)) {
+      p = (p + 1) & (GATE_INDEX_SIZE - 1);
+    }
+    if (idx->slots[p] == NO_GATE) {
+      idx->slots[p] = gid;
+    }
   }
+}
 
-  if (randomize) {
-    /* Fisher-Yates shuffle. */
-    for (uint32_t i = st->num_gates - 1; i > 0; i--) {
-      uint64_t j = xorshift1024() % (i + 1);
-      gatenum t = gate_order[i];
-      gate_order[i] = gate_order[j];
-      gate_order[j] = t;
+/* Returns a gate in st with a truth table equal to target in the positions where the index mask
+   is set, or NO_GATE if there is no such gate. */
+static gatenum gate_index_lookup(const gate_index *idx, const state *st, const ttable target) {
+  const ttable key = target & idx->mask;
+  uint32_t p = ttable_hash(key) & (GATE_INDEX_SIZE - 1);
+  while (idx->slots[p] != NO_GATE) {
+    if (ttable_equals_mask(key, st->tables[idx->slots[p]], idx->mask)) {
+      return idx->slots[p];
+    }
+    p = (p + 1) & (GATE_INDEX_SIZE - 1);
+  }
+  return NO_GATE;
+}
+
+/* Open addressing hash index of compacted truth tables, see find_small_circuit_compact. The slots
+   hold positions in the array of compacted truth tables. */
+typedef struct {
+  gatenum slots[GATE_INDEX_SIZE];
+} compact_index;
+
+/* Calculates a hash of a compacted truth table. */
+static inline uint32_t compact_hash(const uint64_t tbl) {
+  uint64_t h = tbl * 0x9e3779b97f4a7c15UL;
+  return (uint32_t)(h ^ (h >> 32));
+}
+
+/* Builds an index of the num compacted truth tables in tables. If several tables are equal, only
+   the first one is kept. */
+static void build_compact_index(compact_index *idx, const uint64_t *tables, int num) {
+  assert(num <= GATE_INDEX_SIZE / 2);
+  memset(idx->slots, 0xff, sizeof(gatenum) * GATE_INDEX_SIZE);
+  for (int i = 0; i < num; i++) {
+    uint32_t p = compact_hash(tables[i]) & (GATE_INDEX_SIZE - 1);
+    while (idx->slots[p] != NO_GATE && tables[idx->slots[p]] != tables[i]) {
+      p = (p + 1) & (GATE_INDEX_SIZE - 1);
+    }
+    if (idx->slots[p] == NO_GATE) {
+      idx->slots[p] = i;
     }
   }
+}
+
+/* Returns the position of a compacted truth table equal to target, or -1 if there is none. */
+static int compact_index_lookup(const compact_index *idx, const uint64_t *tables,
+    const uint64_t target) {
+  uint32_t p = compact_hash(target) & (GATE_INDEX_SIZE - 1);
+  while (idx->slots[p] != NO_GATE) {
+    if (tables[idx->slots[p]] == target) {
+      return idx->slots[p];
+    }
+    p = (p + 1) & (GATE_INDEX_SIZE - 1);
+  }
+  return -1;
+}
+
+/* Returned by the functions for steps 1-4 of create_circuit when no circuit was found. NO_GATE
+   is returned when a circuit was found but could not be added without exceeding the gate limit. */
+#define NOT_FOUND ((gatenum)-2)
+
+/* A circuit of two gates used in step 4 of create_circuit. Inputs 0-2 of the gates are the inputs
+   of the circuit and input STEP4_FIRST_GATE is the output of the first gate. The second gate is the
+   output of the circuit. Both inputs of NOT gates are equal. */
+typedef struct {
+  gate_type type[2];
+  uint8_t in1[2];
+  uint8_t in2[2];
+} step4_circuit;
+
+#define STEP4_FIRST_GATE 3
+#define STEP4_MAX_CIRCUITS 512
+
+/* Number of partially specified functions of two and three inputs. Each position in the function
+   table is either zero, one or unspecified. */
+#define STEP4_PAIR_FUNCS 81
+#define STEP4_TRIPLE_FUNCS 6561
+
+/* The cheapest circuits of two gates for all partially specified functions of two and three inputs
+   under one gate set and metric. The function tables hold an index in circuits or -1 if the
+   function can not be built with two gates. The two input functions use bits 0-3 of the LUT
+   function encoding. */
+typedef struct {
+  int num_circuits;
+  step4_circuit circuits[STEP4_MAX_CIRCUITS];
+  int16_t pair[STEP4_PAIR_FUNCS];
+  int16_t triple[STEP4_TRIPLE_FUNCS];
+} step4_table;
+
+static step4_table g_step4_tables[2]; /* Indexed by the andnot flag. */
+static uint16_t g_partial_index[256]; /* Sum of 3^i for all bits i set. */
+
+/* Returns the index of a partially specified function in the step 4 function tables. */
+static inline int partial_function_index(const uint8_t func, const uint8_t care) {
+  return g_partial_index[care] + g_partial_index[func & care];
+}
+
+/* Fills the function table ret for functions of num_inputs inputs. All two gate circuits with
+   gates in the current gate set that use all inputs are enumerated, and the cheapest one under the
+   current metric is kept for each fully specified function. Each partially specified function then
+   gets the cheapest circuit of the fully specified functions that agree with it. */
+static void build_step4_functions(step4_table *tbl, int num_inputs, bool andnot, int16_t *ret) {
+  const gate_type types[] = {AND, OR, XOR, NOT, ANDNOT};
+  const int num_types = andnot ? 5 : 4;
+  const uint8_t lut_inputs[] = {0xf0, 0xcc, 0xaa};
+  const int fmask = (1 << (1 << num_inputs)) - 1;
+  int16_t full[256];
+  int cost[256];
+  for (int i = 0; i < 256; i++) {
+    full[i] = -1;
+  }
+
+  for (int t1 = 0; t1 < num_types; t1++) {
+    const gate_type type1 = types[t1];
+    for (int a1 = 0; a1 < num_inputs; a1++) {
+      for (int b1 = 0; b1 < num_inputs; b1++) {
+        if ((type1 == NOT) != (a1 == b1) || (type1 != ANDNOT && type1 != NOT && b1 < a1)) {
+          continue;
+        }
+        for (int t2 = 0; t2 < num_types; t2++) {
+          const gate_type type2 = types[t2];
+          for (int a2 = 0; a2 <= num_inputs; a2++) {
+            for (int b2 = 0; b2 <= num_inputs; b2++) {
+              if ((type2 == NOT) != (a2 == b2)
+                  || (type2 != ANDNOT && type2 != NOT && b2 < a2)) {
+                continue;
+              }
+              if (a2 != num_inputs && b2 != num_inputs) {
+                continue;
+              }
+              const int all = (1 << num_inputs) - 1;
+              if ((((1 << a1) | (1 << b1) | (1 << a2) | (1 << b2)) & all) != all) {
+                continue;
+              }
+              /* Circuits with two inputs use the second and third LUT inputs. */
+              uint8_t sig[4] = {0};
+              for (int i = 0; i < num_inputs; i++) {
+                sig[i] = lut_inputs[i + 3 - num_inputs];
+              }
+              step4_circuit c;
+              c.type[0] = type1;
+              c.type[1] = type2;
+              c.in1[0] = a1;
+              c.in2[0] = b1;
+              c.in1[1] = a2 == num_inputs ? STEP4_FIRST_GATE : a2;
+              c.in2[1] = b2 == num_inputs ? STEP4_FIRST_GATE : b2;
+              uint8_t out = 0;
+              for (int g = 0; g < 2; g++) {
+                const uint8_t x = sig[c.in1[g]];
+                const uint8_t y = sig[c.in2[g]];
+                switch (c.type[g]) {
+                  case AND:
+                    out = x & y;
+                    break;
+                  case OR:
+                    out = x | y;
+                    break;
+                  case XOR:
+                    out = x ^ y;
+                    break;
+                  case ANDNOT:
+                    out = ~x & y;
+                    break;
+                  default:
+                    out = ~x;
+                }
+                sig[STEP4_FIRST_GATE] = out;
+              }
+              out &= fmask;
+              const int ccost = g_metric == SAT ? get_sat_metric(type1) + get_sat_metric(type2) : 2;
+              if (full[out] != -1 && cost[out] <= ccost) {
+                continue;
+              }
+              assert(tbl->num_circuits < STEP4_MAX_CIRCUITS);
+              tbl->circuits[tbl->num_circuits] = c;
+              full[out] = tbl->num_circuits++;
+              cost[out] = ccost;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (int care = 0; care <= fmask; care++) {
+    for (int func = care;; func = (func - 1) & care) {
+      /* Iterate over all fully specified functions that agree with func in care. */
+      int16_t best = -1;
+      int best_cost = INT_MAX;
+      for (int free = ~care & fmask;; free = (free - 1) & ~care & fmask) {
+        if (full[func | free] != -1 && cost[func | free] < best_cost) {
+          best = full[func | free];
+          best_cost = cost[func | free];
+        }
+        if (free == 0) {
+          break;
+        }
+      }
+      ret[partial_function_index(func, care)] = best;
+      if (func == 0) {
+        break;
+      }
+    }
+  }
+}
+/* Builds the step 4 tables for both gate sets. Must be called after the metric has been set. */
+static void init_step4_tables() {
+  for (int i = 0; i < 256; i++) {
+    g_partial_index[i] = 0;
+    for (int bit = 7, p = 2187; bit >= 0; bit--, p /= 3) {
+      if (i & (1 << bit)) {
+        g_partial_index[i] += p;
+      }
+    }
+  }
+  for (int andnot = 0; andnot < 2; andnot++) {
+    step4_table *tbl = &g_step4_tables[andnot];
+    tbl->num_circuits = 0;
+    build_step4_functions(tbl, 2, andnot, tbl->pair);
+    build_step4_functions(tbl, 3, andnot, tbl->triple);
+  }
+}
+
+/* Adds the gates of the step 4 circuit c with the inputs in1, in2 and in3 to the state st. Returns
+   the ID of the output gate. */
+static gatenum add_step4_circuit(state *st, const step4_circuit *c, gatenum in1, gatenum in2,
+    gatenum in3) {
+  gatenum in[] = {in1, in2, in3, NO_GATE};
+  for (int g = 0; g < 2; g++) {
+    in[STEP4_FIRST_GATE] = add_typed_gate(st, c->type[g], in[c->in1[g]], in[c->in2[g]]);
+  }
+  return in[STEP4_FIRST_GATE];
+}
+
+/* Steps 1-4 of create_circuit. In LUT mode, step 4 is replaced by a search for a single 3-LUT.
+   Returns the ID of the output gate, NO_GATE if the gate limit was exceeded or NOT_FOUND if no
+   circuit was found. */
+static inline __attribute__((always_inline)) gatenum find_small_circuit(state *st,
+    const ttable target, const ttable mask, const gatenum *gate_order, const bool andnot,
+    const bool lut, const bool randomize) {
+
+  gate_index idx;
+  build_gate_index(&idx, st, gate_order, mask);
 
   /* 1. Look through the existing circuit. If there is a gate that produces the desired map, simply
      return the ID of that gate. */
 
-  for (int i = 0; i < st->num_gates; i++) {
-    if (ttable_equals_mask(target, st->gates[gate_order[i]].table, mask)) {
-      return gate_order[i];
-    }
+  gatenum gid = gate_index_lookup(&idx, st, target);
+  if (gid != NO_GATE) {
+    return gid;
   }
 
   /* 2. If there are any gates whose inverse produces the desired map, append a NOT gate, and
      return the ID of the NOT gate. */
 
-  for (int i = 0; i < st->num_gates; i++) {
-    if (ttable_equals_mask(target, ~st->gates[gate_order[i]].table, mask)) {
-      return add_not_gate(st, gate_order[i]);
-    }
+  gid = gate_index_lookup(&idx, st, ~target);
+  if (gid != NO_GATE) {
+    return add_not_gate(st, gid);
   }
 
   /* 3. Look at all pairs of gates in the existing circuit. If they can be combined with a single
-     gate to produce the desired map, add that single gate and return its ID. */
+     gate to produce the desired map, add that single gate and return its ID. Only gates that are
+     subsets of the target can be inputs to an OR gate, only supersets can be inputs to an AND
+     gate, and an ANDNOT gate needs a superset and a gate disjoint from the target. Sorting the
+     gates into those groups first keeps the pair loops short. XOR pairs are found by probing the
+     index for target ^ ti. */
 
   const ttable mtarget = target & mask;
-  for (int i = 0; i < st->num_gates; i++) {
-    const gatenum gi = gate_order[i];
-    const ttable ti = st->gates[gi].table & mask;
-    for (int k = i + 1; k < st->num_gates; k++) {
-      const gatenum gk = gate_order[k];
-      const ttable tk = st->gates[gk].table & mask;
-      if (ttable_equals(mtarget, ti | tk)) {
-        return add_or_gate(st, gi, gk);
+  gate_classes classes;
+  g_kernels.classify_gates(st->tables, gate_order, st->num_gates, &target, &mask, &classes);
+  const gatenum *subsets = classes.subsets;
+  const gatenum *supersets = classes.supersets;
+  const gatenum *disjoint = classes.disjoint;
+  const int num_subsets = classes.num_subsets;
+  const int num_supersets = classes.num_supersets;
+  const int num_disjoint = classes.num_disjoint;
+
+  for (int i = 0; i < num_subsets; i++) {
+    const ttable ti = st->tables[subsets[i]] & mask;
+    for (int k = i + 1; k < num_subsets; k++) {
+      if (ttable_equals(mtarget, ti | (st->tables[subsets[k]] & mask))) {
+        return add_or_gate(st, subsets[i], subsets[k]);
       }
-      if (ttable_equals(mtarget, ti & tk)) {
-        return add_and_gate(st, gi, gk);
+    }
+  }
+
+  for (int i = 0; i < num_supersets; i++) {
+    const ttable ti = st->tables[supersets[i]] & mask;
+    for (int k = i + 1; k < num_supersets; k++) {
+      if (ttable_equals(mtarget, ti & st->tables[supersets[k]])) {
+        return add_and_gate(st, supersets[i], supersets[k]);
       }
-      if (andnot) {
-        if (ttable_equals_mask(target, ~ti & tk, mask)) {
-          return add_andnot_gate(st, gi, gk);
-        }
-        if (ttable_equals_mask(target, ~tk & ti, mask)) {
-          return add_andnot_gate(st, gk, gi);
+    }
+  }
+
+  if (andnot) {
+    for (int i = 0; i < num_disjoint; i++) {
+      const ttable ti = st->tables[disjoint[i]] & mask;
+      for (int k = 0; k < num_supersets; k++) {
+        if (ttable_equals_mask(target, ~ti & st->tables[supersets[k]], mask)) {
+          return add_andnot_gate(st, disjoint[i], supersets[k]);
         }
       }
-      if (ttable_equals(mtarget, ti ^ tk)) {
-        return add_xor_gate(st, gi, gk);
-      }
+    }
+  }
+
+  for (int i = 0; i < st->num_gates; i++) {
+    const gatenum gi = gate_order[i];
+    gid = gate_index_lookup(&idx, st, target ^ st->tables[gi]);
+    if (gid != NO_GATE && gid != gi) {
+      return add_xor_gate(st, gi, gid);
     }
   }
 
@@ -357,16 +694,18 @@ static gatenum create_circuit(state *st, const ttable target, const ttable mask,
        LUT and return the ID. */
     for (int i = 0; i < st->num_gates; i++) {
       const gatenum gi = gate_order[i];
-      const ttable ta = st->gates[gi].table;
+      const ttable ta = st->tables[gi];
       for (int k = i + 1; k < st->num_gates; k++) {
         const gatenum gk = gate_order[k];
-        const ttable tb = st->gates[gk].table;
+        const ttable tb = st->tables[gk];
         for (int m = k + 1; m < st->num_gates; m++) {
-          const gatenum gm = gate_order[m];
-          const ttable tc = st->gates[gm].table;
-          if (!check_3lut_possible(target, mask, ta, tb, tc)) {
-            continue;
+          m = g_kernels.next_3lut_candidate(st->tables, gate_order, m, st->num_gates, gi, gk,
+              &target, &mask);
+          if (m >= st->num_gates) {
+            break;
           }
+          const gatenum gm = gate_order[m];
+          const ttable tc = st->tables[gm];
           uint8_t func;
           if (!get_lut_function(ta, tb, tc, target, mask, randomize, &func)) {
             continue;
@@ -377,454 +716,1284 @@ static gatenum create_circuit(state *st, const ttable target, const ttable mask,
         }
       }
     }
+    return NOT_FOUND;
+  }
 
-    int size;
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
-
-    /* Broadcast work to be done. */
-    mpi_work work = {*st, target, mask, false};
-    MPI_Bcast(&work, sizeof(work), MPI_BYTE, 0, MPI_COMM_WORLD);
+  /* 4. Look at all combinations of two or three gates in the circuit. If they can be combined
+     with two gates to produce the desired map, add the gates, and return the ID of the one that
+     produces the desired map. The partially specified function of the gates is looked up in a
+     table of the cheapest two gate circuits. */
 
-    /* Look through all combinations of five gates in the circuit. For each combination, check if
-       a combination of two of the possible 256 three bit Boolean functions as in
-       LUT(LUT(a,b,c),d,e) produces the desired map. If so, add those LUTs and return the ID of the
-       output LUT. */
-
-    uint16_t res[10];
-
-    memset(res, 0, sizeof(uint16_t) * 10);
-    printf("[   0] Search 5.\n");
-
-    if (work.st.num_gates >= 5 && search_5lut(work.st, work.target, work.mask, res)) {
-      uint8_t func_outer = (uint8_t)res[0];
-      uint8_t func_inner = (uint8_t)res[1];
-      gatenum a = res[2];
-      gatenum b = res[3];
-      gatenum c = res[4];
-      gatenum d = res[5];
-      gatenum e = res[6];
-      ttable ta = st->gates[a].table;
-      ttable tb = st->gates[b].table;
-      ttable tc = st->gates[c].table;
-      ttable td = st->gates[d].table;
-      ttable te = st->gates[e].table;
-      printf("[   0] Found 5LUT: %02x %02x    %3d %3d %3d %3d %3d\n",
-          func_outer, func_inner, a, b, c, d, e);
-
-      assert(check_5lut_possible(target, mask, ta, tb, tc, td, te));
-      ttable t_outer = generate_lut_ttable(func_outer, ta, tb, tc);
-      ttable t_inner = generate_lut_ttable(func_inner, t_outer, td, te);
-      assert(ttable_equals_mask(target, t_inner, mask));
-
-      return add_lut(st, func_inner, t_inner,
-          add_lut(st, func_outer, t_outer, a, b, c), d, e);
-    }
-
-    printf("[   0] Search 7.\n");
-    if (work.st.num_gates >= 7 && search_7lut(work.st, work.target, work.mask, res)) {
-      uint8_t func_outer = (uint8_t)res[0];
-      uint8_t func_middle = (uint8_t)res[1];
-      uint8_t func_inner = (uint8_t)res[2];
-      gatenum a = res[3];
-      gatenum b = res[4];
-      gatenum c = res[5];
-      gatenum d = res[6];
-      gatenum e = res[7];
-      gatenum f = res[8];
-      gatenum g = res[9];
-      ttable ta = st->gates[a].table;
-      ttable tb = st->gates[b].table;
-      ttable tc = st->gates[c].table;
-      ttable td = st->gates[d].table;
-      ttable te = st->gates[e].table;
-      ttable tf = st->gates[f].table;
-      ttable tg = st->gates[g].table;
-      printf("[   0] Found 7LUT: %02x %02x %02x %3d %3d %3d %3d %3d %3d %3d\n",
-          func_outer, func_middle, func_inner, a, b, c, d, e, f, g);
-      assert(check_7lut_possible(target, mask, ta, tb, tc, td, te, tf, tg));
-      ttable t_outer = generate_lut_ttable(func_outer, ta, tb, tc);
-      ttable t_middle = generate_lut_ttable(func_middle, td, te, tf);
-      ttable t_inner = generate_lut_ttable(func_inner, t_outer, t_middle, tg);
-      assert(ttable_equals_mask(target, t_inner, mask));
-      return add_lut(st, func_inner, t_inner,
-          add_lut(st, func_outer, t_outer, a, b, c),
-          add_lut(st, func_middle, t_middle, d, e, f), g);
-    }
-
-    printf("[   0] No LUTs found. Num gates: %d\n", st->num_gates - get_num_inputs(st));
-  } else {
-    /* 4. Look at all combinations of two or three gates in the circuit. If they can be combined
-       with two gates to produce the desired map, add the gates, and return the ID of the one that
-       produces the desired map. */
+  const step4_table *tbl = &g_step4_tables[andnot];
+  const ttable zero = {0};
+  for (int i = 0; i < st->num_gates; i++) {
+    const gatenum gi = gate_order[i];
+    for (int k = i + 1; k < st->num_gates; k++) {
+      const gatenum gk = gate_order[k];
+      uint8_t func, care;
+      if (!get_partial_lut_function(zero, st->tables[gi], st->tables[gk], target, mask, &func,
+            &care)) {
+        continue;
+      }
+      const int16_t c = tbl->pair[partial_function_index(func, care)];
+      if (c != -1) {
+        gid = add_step4_circuit(st, &tbl->circuits[c], gi, gk, NO_GATE);
+        assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+        return gid;
+      }
+    }
+  }
 
-    for (int i = 0; i < st->num_gates; i++) {
-      const gatenum gi = gate_order[i];
-      ttable ti = st->gates[gi].table;
-      for (int k = i + 1; k < st->num_gates; k++) {
-        const gatenum gk = gate_order[k];
-        ttable tk = st->gates[gk].table;
-        if (ttable_equals_mask(target, ~(ti | tk), mask)) {
-          return add_nor_gate(st, gi, gk);
-        }
-        if (ttable_equals_mask(target, ~(ti & tk), mask)) {
-          return add_nand_gate(st, gi, gk);
-        }
-        if (ttable_equals_mask(target, ~ti | tk, mask)) {
-          return add_or_not_gate(st, gi, gk);
-        }
-        if (ttable_equals_mask(target, ~tk | ti, mask)) {
-          return add_or_not_gate(st, gk, gi);
+  for (int i = 0; i < st->num_gates; i++) {
+    const gatenum gi = gate_order[i];
+    for (int k = i + 1; k < st->num_gates; k++) {
+      const gatenum gk = gate_order[k];
+      for (int m = k + 1; m < st->num_gates; m++) {
+        m = g_kernels.next_3lut_candidate(st->tables, gate_order, m, st->num_gates, gi, gk,
+            &target, &mask);
+        if (m >= st->num_gates) {
+          break;
         }
-        if (!andnot) {
-          if (ttable_equals_mask(target, ~ti & tk, mask)) {
-            return add_and_not_gate(st, gi, gk);
-          }
-          if (ttable_equals_mask(target, ~tk & ti, mask)) {
-            return add_and_not_gate(st, gk, gi);
-          }
-        } else if (ttable_equals_mask(target, ~ti & ~tk, mask)) {
-          return add_andnot_gate(st, gi, add_not_gate(st, gk));
+        const gatenum gm = gate_order[m];
+        uint8_t func, care;
+        if (!get_partial_lut_function(st->tables[gi], st->tables[gk], st->tables[gm], target,
+              mask, &func, &care)) {
+          continue;
         }
-        if (ttable_equals_mask(target, ~(ti ^ tk), mask)) {
-          return add_xnor_gate(st, gi, gk);
+        const int16_t c = tbl->triple[partial_function_index(func, care)];
+        if (c != -1) {
+          gid = add_step4_circuit(st, &tbl->circuits[c], gi, gk, gm);
+          assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+          return gid;
         }
       }
     }
+  }
 
-    for (int i = 0; i < st->num_gates; i++) {
-      const gatenum gi = gate_order[i];
-      ttable ti = st->gates[gi].table & mask;
-      for (int k = i + 1; k < st->num_gates; k++) {
-        const gatenum gk = gate_order[k];
-        ttable tk = st->gates[gk].table & mask;
-        ttable iandk = ti & tk;
-        ttable iork = ti | tk;
-        ttable ixork = ti ^ tk;
-        for (int m = k + 1; m < st->num_gates; m++) {
-          const gatenum gm = gate_order[m];
-          ttable tm = st->gates[gm].table & mask;
-          if (!check_3lut_possible(target, mask, ti, tk, tm)) {
-            continue;
-          }
-          if (ttable_equals(mtarget, iandk & tm)) {
-            return add_and_3_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iandk | tm)) {
-            return add_and_or_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iork | tm)) {
-            return add_or_3_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iork & tm)) {
-            return add_or_and_gate(st, gi, gk, gm);
-          }
-          ttable iandm = ti & tm;
-          if (ttable_equals(mtarget, iandm | tk)) {
-            return add_and_or_gate(st, gi, gm, gk);
-          }
-          ttable kandm = tk & tm;
-          if (ttable_equals(mtarget, kandm | ti)) {
-            return add_and_or_gate(st, gk, gm, gi);
-          }
-          ttable iorm = ti | tm;
-          if (ttable_equals(mtarget, iorm & tk)) {
-            return add_or_and_gate(st, gi, gm, gk);
-          }
-          ttable korm = tk | tm;
-          if (ttable_equals(mtarget, korm & ti)) {
-            return add_or_and_gate(st, gk, gm, gi);
-          }
-          if (andnot) {
-            if (ttable_equals(mtarget, ti | (~tk & tm))) {
-              return add_andnot_or_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, ti | (tk & ~tm))) {
-              return add_andnot_or_gate(st, gm, gk, gi);
-            }
-            if (ttable_equals(mtarget, tm | (~ti & tk))) {
-              return add_andnot_or_gate(st, gi, gk, gm);
-            }
-            if (ttable_equals(mtarget, tm | (ti & ~tk))) {
-              return add_andnot_or_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, tk | (~ti & tm))) {
-              return add_andnot_or_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, tk | (ti & ~tm))) {
-              return add_andnot_or_gate(st, gm, gi, gk);
-            }
-            if (ttable_equals(mtarget, ~ti & tk & tm)) {
-              return add_and_andnot_gate(st, gi, gk, gm);
-            }
-            if (ttable_equals(mtarget, ti & ~tk & tm)) {
-              return add_and_andnot_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, ti & tk & ~tm)) {
-              return add_and_andnot_gate(st, gm, gk, gi);
-            }
-            if (ttable_equals(mtarget, ~ti & ~tk & tm)) {
-              return add_andnot_3_a_gate(st, gi, gk, gm);
-            }
-            if (ttable_equals(mtarget, ~ti & tk & ~tm)) {
-              return add_andnot_3_a_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, ti & ~tk & ~tm)) {
-              return add_andnot_3_a_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, ti & ~(~tk & tm))) {
-              return add_andnot_3_b_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, ti & ~(tk & ~tm))) {
-              return add_andnot_3_b_gate(st, gm, gk, gi);
-            }
-            if (ttable_equals(mtarget, tk & ~(~ti & tm))) {
-              return add_andnot_3_b_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, tk & ~(ti & ~tm))) {
-              return add_andnot_3_b_gate(st, gm, gi, gk);
-            }
-            if (ttable_equals(mtarget, tm & ~(~tk & ti))) {
-              return add_andnot_3_b_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, tm & ~(tk & ~ti))) {
-              return add_andnot_3_b_gate(st, gi, gk, gm);
-            }
-            if (ttable_equals(mtarget, ~ti & (tk ^ tm))) {
-              return add_xor_andnot_a_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, ~tk & (ti ^ tm))) {
-              return add_xor_andnot_a_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, ~tm & (tk ^ ti))) {
-              return add_xor_andnot_a_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, ti & ~(tk ^ tm))) {
-              return add_xor_andnot_b_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, tk & ~(ti ^ tm))) {
-              return add_xor_andnot_b_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, tm & ~(tk ^ ti))) {
-              return add_xor_andnot_b_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, ti ^ (~tk & tm))) {
-              return add_andnot_xor_gate(st, gk, gm, gi);
-            }
-            if (ttable_equals(mtarget, ti ^ (tk & ~tm))) {
-              return add_andnot_xor_gate(st, gm, gk, gi);
-            }
-            if (ttable_equals(mtarget, tk ^ (~ti & tm))) {
-              return add_andnot_xor_gate(st, gi, gm, gk);
-            }
-            if (ttable_equals(mtarget, tk ^ (ti & ~tm))) {
-              return add_andnot_xor_gate(st, gm, gi, gk);
-            }
-            if (ttable_equals(mtarget, tm ^ (~tk & ti))) {
-              return add_andnot_xor_gate(st, gk, gi, gm);
-            }
-            if (ttable_equals(mtarget, tm ^ (tk & ~ti))) {
-              return add_andnot_xor_gate(st, gi, gk, gm);
-            }
-          }
-          if (ttable_equals(mtarget, ixork | tm)) {
-            return add_xor_or_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, ixork & tm)) {
-            return add_xor_and_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iandk ^ tm)) {
-            return add_and_xor_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iork ^ tm)) {
-            return add_or_xor_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, ixork ^ tm)) {
-            return add_xor_3_gate(st, gi, gk, gm);
-          }
-          if (ttable_equals(mtarget, iandm ^ tk)) {
-            return add_and_xor_gate(st, gi, gm, gk);
-          }
-          if (ttable_equals(mtarget, kandm ^ ti)) {
-            return add_and_xor_gate(st, gk, gm, gi);
-          }
-          ttable ixorm = ti ^ tm;
-          if (ttable_equals(mtarget, ixorm | tk)) {
-            return add_xor_or_gate(st, gi, gm, gk);
-          }
-          if (ttable_equals(mtarget, ixorm & tk)) {
-            return add_xor_and_gate(st, gi, gm, gk);
-          }
-          ttable kxorm = tk ^ tm;
-          if (ttable_equals(mtarget, kxorm | ti)) {
-            return add_xor_or_gate(st, gk, gm, gi);
-          }
-          if (ttable_equals(mtarget, kxorm & ti)) {
-            return add_xor_and_gate(st, gk, gm, gi);
-          }
-          if (ttable_equals(mtarget, iorm ^ tk)) {
-            return add_or_xor_gate(st, gi, gm, gk);
-          }
-          if (ttable_equals(mtarget, korm ^ ti)) {
-            return add_or_xor_gate(st, gk, gm, gi);
-          }
-        }
-      }
+  return NOT_FOUND;
+}
+
+/* Stores the compacted truth table tbl at position i in an array of words of the given width. */
+static inline void store_compact(void *tables, const int width, const int i, const uint64_t tbl) {
+  switch (width) {
+    case 16:
+      ((uint16_t*)tables)[i] = tbl;
+      break;
+    case 32:
+      ((uint32_t*)tables)[i] = tbl;
+      break;
+    default:
+      ((uint64_t*)tables)[i] = tbl;
+  }
+}
+
+/* Same as get_partial_lut_function, but for compacted truth tables. */
+static inline bool compact_partial_function(const uint64_t in1, const uint64_t in2,
+    const uint64_t in3, const uint64_t target, const uint64_t mask, uint8_t *func,
+    uint8_t *care) {
+  const uint64_t one = target & mask;
+  const uint64_t zero = ~target & mask;
+  const uint64_t ab[4] = {~in1 & ~in2, ~in1 & in2, in1 & ~in2, in1 & in2};
+  *func = 0;
+  *care = 0;
+  for (int i = 0; i < 8; i++) {
+    const uint64_t sel = ab[i >> 1] & ((i & 1) ? in3 : ~in3);
+    if ((sel & one) != 0 && (sel & zero) != 0) {
+      return false;
     }
+    *func |= ((sel & one) != 0) << i;
+    *care |= ((sel & mask) != 0) << i;
   }
+  return true;
+}
 
-  /* 5. Use the specified input bit to select between two Karnaugh maps. Call this function
-     recursively to generate those two maps. */
+/* Same as find_small_circuit, but for masks with at most 64 bits set. The truth tables are first
+   compacted into 64 bit words holding only the bits where the mask is set, which makes each test
+   in the steps a single word operation. Most calls deep in the recursion have masks like these.
+   The pair and triple loops use the scan kernels for the smallest of the widths 16, 32 and 64 bits
+   that fits the compacted truth tables, which lets them test up to 32 tables per instruction. For
+   S-boxes with four or five inputs, all calls use the 16 or 32 bit kernels. */
+static inline __attribute__((always_inline)) gatenum find_small_circuit_compact(state *st,
+    const ttable target, const ttable mask, const gatenum *gate_order, const bool andnot,
+    const bool lut, const bool randomize) {
+  const int num_gates = st->num_gates;
+  const int bits = ttable_popcount(mask);
+  assert(bits <= 64);
+  const uint64_t cmask = bits == 64 ? ~0UL : (1UL << bits) - 1;
+  const int width = bits <= 16 ? 16 : bits <= 32 ? 32 : 64;
+  const scan_kernels *scan = &g_kernels.scan[width / 32];
+  const gatenum zero = 0;
+  uint64_t ctarget;
+  g_kernels.compact_ttables(&target, &zero, 1, &mask, &ctarget);
+
+  /* Compacted truth tables, in the order given by gate_order. */
+  uint64_t tables[MAX_GATES];
+  g_kernels.compact_ttables(st->tables, gate_order, num_gates, &mask, tables);
+
+  compact_index idx;
+  build_compact_index(&idx, tables, num_gates);
+
+  /* 1. */
+  int p = compact_index_lookup(&idx, tables, ctarget);
+  if (p != -1) {
+    return gate_order[p];
+  }
 
-  /* Copy input bits already used to new array to avoid modifying the old one. */
-  int8_t next_inbits[8];
-  uint8_t bitp = 0;
-  while (bitp < 6 && inbits[bitp] != -1) {
-    next_inbits[bitp] = inbits[bitp];
-    bitp += 1;
+  /* 2. */
+  p = compact_index_lookup(&idx, tables, ~ctarget & cmask);
+  if (p != -1) {
+    return add_not_gate(st, gate_order[p]);
   }
-  assert(bitp < 7);
-  next_inbits[bitp] = -1;
-  next_inbits[bitp + 1] = -1;
 
-  state best;
-  gatenum best_out = NO_GATE;
-  best.num_gates = 0;
-  best.sat_metric = 0;
+  /* 3. The gate classes hold positions in tables. The scan kernels work on copies of the tables in
+     each class, stored in the selected width. */
+  gatenum subsets[MAX_GATES];
+  gatenum supersets[MAX_GATES];
+  gatenum disjoint[MAX_GATES];
+  uint64_t subset_tables[MAX_GATES + SCAN_PADDING / sizeof(uint64_t)];
+  uint64_t superset_tables[MAX_GATES + SCAN_PADDING / sizeof(uint64_t)];
+  uint64_t narrow_tables[MAX_GATES + SCAN_PADDING / sizeof(uint64_t)];
+  int num_subsets = 0;
+  int num_supersets = 0;
+  int num_disjoint = 0;
+  for (int i = 0; i < num_gates; i++) {
+    store_compact(narrow_tables, width, i, tables[i]);
+    if ((tables[i] & ~ctarget) == 0) {
+      store_compact(subset_tables, width, num_subsets, tables[i]);
+      subsets[num_subsets++] = i;
+    }
+    if ((ctarget & ~tables[i]) == 0) {
+      store_compact(superset_tables, width, num_supersets, tables[i]);
+      supersets[num_supersets++] = i;
+    }
+    if ((tables[i] & ctarget) == 0) {
+      disjoint[num_disjoint++] = i;
+    }
+  }
 
-  /* Try all input bit orders. */
-  for (int bit = 0; bit < get_num_inputs(st); bit++) {
-    bool skip = false;
-    for (int i = 0; i < bitp; i++) {
-      if (inbits[i] == bit) {
-        skip = true;
-        break;
+  for (int i = 0; i < num_subsets; i++) {
+    int k = scan->find_or(subset_tables, i + 1, num_subsets, tables[subsets[i]], ctarget);
+    if (k < num_subsets) {
+      return add_or_gate(st, gate_order[subsets[i]], gate_order[subsets[k]]);
+    }
+  }
+
+  for (int i = 0; i < num_supersets; i++) {
+    int k = scan->find_and(superset_tables, i + 1, num_supersets, tables[supersets[i]], ctarget);
+    if (k < num_supersets) {
+      return add_and_gate(st, gate_order[supersets[i]], gate_order[supersets[k]]);
+    }
+  }
+
+  if (andnot) {
+    for (int i = 0; i < num_disjoint; i++) {
+      int k = scan->find_andnot(superset_tables, 0, num_supersets, tables[disjoint[i]], ctarget);
+      if (k < num_supersets) {
+        return add_andnot_gate(st, gate_order[disjoint[i]], gate_order[supersets[k]]);
       }
     }
-    if (skip == true) {
-      continue;
+  }
+
+  for (int i = 0; i < num_gates; i++) {
+    p = compact_index_lookup(&idx, tables, ctarget ^ tables[i]);
+    if (p != -1 && p != i) {
+      return add_xor_gate(st, gate_order[i], gate_order[p]);
     }
-    next_inbits[bitp] = bit;
+  }
 
-    const ttable fsel = st->gates[bit].table; /* Selection bit. */
-    state nst;
-    gatenum nst_out;
-    if (lut) {
-      nst = *st;
-      gatenum fb = create_circuit(&nst, target, mask & ~fsel, next_inbits, andnot, true, randomize);
-      if (fb == NO_GATE) {
-        continue;
+  if (lut) {
+    for (int i = 0; i < num_gates; i++) {
+      for (int k = i + 1; k < num_gates; k++) {
+        for (int m = k + 1; m < num_gates; m++) {
+          m = scan->find_3lut(narrow_tables, m, num_gates, tables[i], tables[k], ctarget, cmask);
+          if (m >= num_gates) {
+            break;
+          }
+          const ttable ta = st->tables[gate_order[i]];
+          const ttable tb = st->tables[gate_order[k]];
+          const ttable tc = st->tables[gate_order[m]];
+          uint8_t func;
+          if (!get_lut_function(ta, tb, tc, target, mask, randomize, &func)) {
+            continue;
+          }
+          ttable nt = generate_lut_ttable(func, ta, tb, tc);
+          assert(ttable_equals_mask(target, nt, mask));
+          return add_lut(st, func, nt, gate_order[i], gate_order[k], gate_order[m]);
+        }
+      }
+    }
+    return NOT_FOUND;
+  }
+
+  /* 4. */
+
+  const step4_table *tbl = &g_step4_tables[andnot];
+  for (int i = 0; i < num_gates; i++) {
+    for (int k = i + 1; k < num_gates; k++) {
+      k = scan->find_pair(narrow_tables, k, num_gates, tables[i], ctarget, cmask);
+      if (k >= num_gates) {
+        break;
       }
-      assert(ttable_equals_mask(target, nst.gates[fb].table, mask & ~fsel));
-      gatenum fc = create_circuit(&nst, target, mask & fsel, next_inbits, andnot, true, randomize);
-      if (fc == NO_GATE) {
+      uint8_t func, care;
+      if (!compact_partial_function(0, tables[i], tables[k], ctarget, cmask, &func, &care)) {
         continue;
       }
-      assert(ttable_equals_mask(target, nst.gates[fc].table, mask & fsel));
-
-      if (fb == fc) {
-        nst_out = fb;
-        assert(ttable_equals_mask(target, nst.gates[nst_out].table, mask));
-      } else if (fb == bit) {
-        nst_out = add_and_gate(&nst, fb, fc);
-        if (nst_out == NO_GATE) {
-          continue;
-        }
-        assert(ttable_equals_mask(target, nst.gates[nst_out].table, mask));
-      } else if (fc == bit) {
-        nst_out = add_or_gate(&nst, fb, fc);
-        if (nst_out == NO_GATE) {
-          continue;
+      const int16_t c = tbl->pair[partial_function_index(func, care)];
+      if (c != -1) {
+        gatenum gid = add_step4_circuit(st, &tbl->circuits[c], gate_order[i], gate_order[k],
+            NO_GATE);
+        assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+        return gid;
+      }
+    }
+  }
+
+  for (int i = 0; i < num_gates; i++) {
+    for (int k = i + 1; k < num_gates; k++) {
+      for (int m = k + 1; m < num_gates; m++) {
+        m = scan->find_3lut(narrow_tables, m, num_gates, tables[i], tables[k], ctarget, cmask);
+        if (m >= num_gates) {
+          break;
         }
-        assert(ttable_equals_mask(target, nst.gates[nst_out].table, mask));
-      } else {
-        ttable mux_table = generate_lut_ttable(0xac, nst.gates[bit].table, nst.gates[fb].table,
-            nst.gates[fc].table);
-        nst_out = add_lut(&nst, 0xac, mux_table, bit, fb, fc);
-        if (nst_out == NO_GATE) {
-          continue;
+        uint8_t func, care;
+        compact_partial_function(tables[i], tables[k], tables[m], ctarget, cmask, &func, &care);
+        const int16_t c = tbl->triple[partial_function_index(func, care)];
+        if (c != -1) {
+          gatenum gid = add_step4_circuit(st, &tbl->circuits[c], gate_order[i], gate_order[k],
+              gate_order[m]);
+          assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+          return gid;
         }
-        assert(ttable_equals_mask(target, nst.gates[nst_out].table, mask));
       }
-      assert(ttable_equals_mask(target, nst.gates[nst_out].table, mask));
+    }
+  }
+
+  return NOT_FOUND;
+}
+
+/* Largest number of unspecified positions in the function of four gates for which the subcircuit
+   database is searched. */
+#define SUBCIRCUIT_MAX_FREE 6
+
+/* Defines a function that searches for the cheapest subcircuit for all combinations of four of the
+   num truth tables in tables of type TYPE, using the metric cost_metric. NONZERO(x) tests if x has
+   any bit set. The positions in tables of the four inputs are returned in ret. */
+#define DEFINE_SUBCIRCUIT_SEARCH(NAME, TYPE, NONZERO) \
+static inline const subcircuit *NAME(const TYPE *tables, const int num, const TYPE target, \
+    const TYPE mask, const metric cost_metric, int *ret) { \
+  const TYPE one = target & mask; \
+  const TYPE zero = ~target & mask; \
+  const subcircuit *best = NULL; \
+  for (int i = 0; i < num; i++) { \
+    for (int k = i + 1; k < num; k++) { \
+      const TYPE ab[4] = {~tables[i] & ~tables[k] & mask, ~tables[i] & tables[k] & mask, \
+          tables[i] & ~tables[k] & mask, tables[i] & tables[k] & mask}; \
+      for (int m = k + 1; m < num; m++) { \
+        TYPE abc[8]; \
+        for (int j = 0; j < 8; j++) { \
+          abc[j] = ab[j >> 1] & ((j & 1) ? tables[m] : ~tables[m]); \
+        } \
+        for (int l = m + 1; l < num; l++) { \
+          uint16_t func = 0; \
+          uint16_t care = 0; \
+          bool possible = true; \
+          for (int j = 0; j < 16 && possible; j++) { \
+            const TYPE sel = abc[j >> 1] & ((j & 1) ? tables[l] : ~tables[l]); \
+            const bool has_one = NONZERO(sel & one); \
+            const bool has_zero = NONZERO(sel & zero); \
+            possible = !(has_one && has_zero); \
+            func |= has_one << j; \
+            care |= (has_one || has_zero) << j; \
+          } \
+          if (!possible) { \
+            continue; \
+          } \
+          const subcircuit *c = get_subcircuit(g_subcircuits, func, care, SUBCIRCUIT_MAX_FREE); \
+          if (c != NULL && (best == NULL || c->cost < best->cost)) { \
+            best = c; \
+            ret[0] = i; \
+            ret[1] = k; \
+            ret[2] = m; \
+            ret[3] = l; \
+            if (cost_metric == GATES && c->num_gates <= 3) { \
+              return best; \
+            } \
+          } \
+        } \
+      } \
+    } \
+  } \
+  return best; \
+}
+
+#define TTABLE_NONZERO(x) (!ttable_zero(x))
+#define WORD_NONZERO(x) ((x) != 0)
+DEFINE_SUBCIRCUIT_SEARCH(search_subcircuit, ttable, TTABLE_NONZERO)
+DEFINE_SUBCIRCUIT_SEARCH(search_subcircuit_compact, uint64_t, WORD_NONZERO)
+
+/* Adds the gates of the subcircuit c with the four inputs in to the state st. Returns the ID of the
+   output gate. */
+static gatenum add_subcircuit(state *st, const subcircuit *c, const gatenum *in) {
+  gatenum sig[4 + SUBCIRCUIT_MAX_GATES];
+  memcpy(sig, in, 4 * sizeof(gatenum));
+  for (int g = 0; g < c->num_gates; g++) {
+    sig[4 + g] = add_typed_gate(st, c->type[g], sig[c->in1[g]], sig[c->in2[g]]);
+  }
+  return sig[3 + c->num_gates];
+}
+
+/* Looks through all combinations of four gates in the circuit. If the desired map is a function
+   of the four gates in the positions where the mask is set, and the subcircuit database has a
+   circuit for it, the cheapest such circuit is added. Returns the ID of the output gate, NO_GATE if
+   the gate limit was exceeded or NOT_FOUND if no circuit was found. */
+static inline __attribute__((always_inline)) gatenum find_subcircuit(state *st,
+    const ttable target, const ttable mask, const gatenum *gate_order, const metric cost_metric) {
+  const int num_gates = st->num_gates;
+  const subcircuit *c;
+  int pos[4] = {0};
+  if (ttable_popcount(mask) <= 64) {
+    const gatenum zero = 0;
+    uint64_t tables[MAX_GATES];
+    uint64_t ctarget;
+    g_kernels.compact_ttables(st->tables, gate_order, num_gates, &mask, tables);
+    g_kernels.compact_ttables(&target, &zero, 1, &mask, &ctarget);
+    const int bits = ttable_popcount(mask);
+    const uint64_t cmask = bits == 64 ? ~0UL : (1UL << bits) - 1;
+    c = search_subcircuit_compact(tables, num_gates, ctarget, cmask, cost_metric, pos);
+  } else {
+    ttable tables[MAX_GATES];
+    for (int i = 0; i < num_gates; i++) {
+      tables[i] = st->tables[gate_order[i]];
+    }
+    c = search_subcircuit(tables, num_gates, target, mask, cost_metric, pos);
+  }
+  if (c == NULL) {
+    return NOT_FOUND;
+  }
+  const gatenum in[4] = {gate_order[pos[0]], gate_order[pos[1]], gate_order[pos[2]],
+      gate_order[pos[3]]};
+  gatenum gid = add_subcircuit(st, c, in);
+  assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+  return gid;
+}
+
+/* Sorts the gates in gate_order by the correlation of their truth tables with the target in the
+   positions where mask is set, with the most correlated or anti-correlated gates first. Gates with
+   the same correlation keep their order, so that a shuffled gate_order breaks ties randomly. Gates
+   that agree with the target, or its inverse, in most positions are the most likely to be part of
+   a small circuit for it, so the searches in steps 1-4 find better circuits earlier. */
+static void order_gates_by_score(const state *st, const ttable target, const ttable mask,
+    gatenum *gate_order) {
+  const int bits = ttable_popcount(mask);
+  const int num_gates = st->num_gates;
+  uint16_t score[MAX_GATES];
+  int start[TTABLE_BITS + 2];
+  memset(start, 0, sizeof(int) * (bits + 2));
+  for (int i = 0; i < num_gates; i++) {
+    const int diff = ttable_popcount((st->tables[gate_order[i]] ^ target) & mask);
+    score[i] = bits - abs(bits - 2 * diff);
+    start[score[i] + 1] += 1;
+  }
+  /* Counting sort on the score, where a lower score means a stronger correlation. */
+  for (int i = 1; i <= bits; i++) {
+    start[i] += start[i - 1];
+  }
+  gatenum sorted[MAX_GATES];
+  for (int i = 0; i < num_gates; i++) {
+    sorted[start[score[i]]++] = gate_order[i];
+  }
+  memcpy(gate_order, sorted, sizeof(gatenum) * num_gates);
+}
+
+/* Steps 1-4 of create_circuit and the search in the subcircuit database, which build the desired
+   map from the existing gates without recursion. They are kept out of create_circuit so that the
+   gate order and the search buffers are not part of its stack frame. Returns the ID of the output
+   gate, NO_GATE if the gate limit was exceeded or NOT_FOUND if no circuit was found. Only called
+   with constant andnot, lut and cost_metric, from the specialized search functions below. */
+static inline __attribute__((always_inline)) gatenum find_direct_circuit_impl(state *st,
+    const ttable target, const ttable mask, const bool andnot, const bool lut,
+    const metric cost_metric, const bool randomize) {
+  gatenum gate_order[MAX_GATES];
+  for (int i = 0; i < st->num_gates; i++) {
+    gate_order[i] = st->num_gates - 1 - i;
+  }
+
+  if (randomize) {
+    /* Fisher-Yates shuffle. */
+    for (uint32_t i = st->num_gates - 1; i > 0; i--) {
+      uint64_t j = xorshift1024() % (i + 1);
+      gatenum t = gate_order[i];
+      gate_order[i] = gate_order[j];
+      gate_order[j] = t;
+    }
+  }
+  if (g_score_order) {
+    order_gates_by_score(st, target, mask, gate_order);
+  }
+
+  /* Steps 1-4. Masks with few bits set are handled on compacted truth tables. */
+  gatenum gid;
+  if (ttable_popcount(mask) <= 64) {
+    gid = find_small_circuit_compact(st, target, mask, gate_order, andnot, lut, randomize);
+  } else {
+    gid = find_small_circuit(st, target, mask, gate_order, andnot, lut, randomize);
+  }
+  if (gid != NOT_FOUND) {
+    return gid;
+  }
+
+  /* Look for a combination of four gates that can be combined with a circuit from the subcircuit
+     database. This often finds circuits of three to five gates that step 5 would need more gates
+     for. */
+  if (!lut && g_subcircuits != NULL) {
+    gid = find_subcircuit(st, target, mask, gate_order, cost_metric);
+    if (gid != NOT_FOUND) {
+      return gid;
+    }
+  }
+
+  return NOT_FOUND;
+}
+
+/* The LUT mode replacement for step 5. Searches for combinations of five or seven gates that can be
+   connected with two or three LUTs to produce the desired map. The search is distributed over all
+   MPI ranks. Returns the ID of the output gate, NO_GATE if the gate limit was exceeded or NOT_FOUND
+   if no circuit was found. */
+static __attribute__((noinline)) gatenum find_lut_circuit(state *st, const ttable target,
+    const ttable mask) {
+  /* Broadcast work to be done. Only the truth tables that the workers do not have are sent. */
+  mpi_work work;
+  work.target = target;
+  work.mask = mask;
+  work.num_kept = 0;
+  while (work.num_kept < g_num_lut_worker_tables && work.num_kept < st->num_gates
+      && ttable_equals(g_lut_worker_tables[work.num_kept], st->tables[work.num_kept])) {
+    work.num_kept += 1;
+  }
+  work.num_new = st->num_gates - work.num_kept;
+  work.quit = false;
+  MPI_Bcast(&work, sizeof(work), MPI_BYTE, 0, MPI_COMM_WORLD);
+  if (work.num_new > 0) {
+    MPI_Bcast(st->tables + work.num_kept, sizeof(ttable) * work.num_new, MPI_BYTE, 0,
+        MPI_COMM_WORLD);
+    memcpy(g_lut_worker_tables + work.num_kept, st->tables + work.num_kept,
+        sizeof(ttable) * work.num_new);
+  }
+  g_num_lut_worker_tables = st->num_gates;
+
+  /* Look through all combinations of five gates in the circuit. For each combination, check if
+     a combination of two of the possible 256 three bit Boolean functions as in
+     LUT(LUT(a,b,c),d,e) produces the desired map. If so, add those LUTs and return the ID of the
+     output LUT. */
+
+  uint16_t res[10];
+
+  memset(res, 0, sizeof(uint16_t) * 10);
+  printf("[   0] Search 5.\n");
+
+  if (st->num_gates >= 5 && search_5lut(st, target, mask, res)) {
+    uint8_t func_outer = (uint8_t)res[0];
+    uint8_t func_inner = (uint8_t)res[1];
+    gatenum a = res[2];
+    gatenum b = res[3];
+    gatenum c = res[4];
+    gatenum d = res[5];
+    gatenum e = res[6];
+    ttable ta = st->tables[a];
+    ttable tb = st->tables[b];
+    ttable tc = st->tables[c];
+    ttable td = st->tables[d];
+    ttable te = st->tables[e];
+    printf("[   0] Found 5LUT: %02x %02x    %3d %3d %3d %3d %3d\n",
+        func_outer, func_inner, a, b, c, d, e);
+
+    assert(check_5lut_possible(target, mask, ta, tb, tc, td, te));
+    ttable t_outer = generate_lut_ttable(func_outer, ta, tb, tc);
+    ttable t_inner = generate_lut_ttable(func_inner, t_outer, td, te);
+    assert(ttable_equals_mask(target, t_inner, mask));
+
+    return add_lut(st, func_inner, t_inner,
+        add_lut(st, func_outer, t_outer, a, b, c), d, e);
+  }
+
+  printf("[   0] Search 7.\n");
+  if (st->num_gates >= 7 && search_7lut(st, target, mask, res)) {
+    uint8_t func_outer = (uint8_t)res[0];
+    uint8_t func_middle = (uint8_t)res[1];
+    uint8_t func_inner = (uint8_t)res[2];
+    gatenum a = res[3];
+    gatenum b = res[4];
+    gatenum c = res[5];
+    gatenum d = res[6];
+    gatenum e = res[7];
+    gatenum f = res[8];
+    gatenum g = res[9];
+    ttable ta = st->tables[a];
+    ttable tb = st->tables[b];
+    ttable tc = st->tables[c];
+    ttable td = st->tables[d];
+    ttable te = st->tables[e];
+    ttable tf = st->tables[f];
+    ttable tg = st->tables[g];
+    printf("[   0] Found 7LUT: %02x %02x %02x %3d %3d %3d %3d %3d %3d %3d\n",
+        func_outer, func_middle, func_inner, a, b, c, d, e, f, g);
+    assert(check_7lut_possible(target, mask, ta, tb, tc, td, te, tf, tg));
+    ttable t_outer = generate_lut_ttable(func_outer, ta, tb, tc);
+    ttable t_middle = generate_lut_ttable(func_middle, td, te, tf);
+    ttable t_inner = generate_lut_ttable(func_inner, t_outer, t_middle, tg);
+    assert(ttable_equals_mask(target, t_inner, mask));
+    return add_lut(st, func_inner, t_inner,
+        add_lut(st, func_outer, t_outer, a, b, c),
+        add_lut(st, func_middle, t_middle, d, e, f), g);
+  }
+
+  printf("[   0] No LUTs found. Num gates: %d\n", st->num_gates - get_num_inputs(st));
+  return NOT_FOUND;
+}
+
+/* Stack of the gates of the best circuits found so far in the step 5 frames of create_circuit. Each
+   frame keeps its best circuit on top of the stack while it builds the next branch, so that the
+   frames it calls push theirs above it. Each thread has its own stack. */
+#define SUFFIX_STACK_SIZE ((MAX_INPUTS + 1) * MAX_GATES)
+static __thread ttable g_suffix_tables[SUFFIX_STACK_SIZE];
+static __thread gate g_suffix_gates[SUFFIX_STACK_SIZE];
+static __thread int g_suffix_top = 0;
+
+/* The best circuit found in a step 5 frame: the gates added after the first start gates of the
+   state. */
+typedef struct {
+  gatenum start;
+  int start_sat_metric; /* SAT metric of the first start gates. */
+  int base;           /* Position of the gates on the suffix stack. */
+  int len;            /* Number of gates. */
+  gatenum out;        /* Output gate, or NO_GATE if no circuit has been found. */
+  int sat_metric;     /* SAT metric of the state with the circuit. */
+} best_suffix;
+
+/* Keeps the gates added to st after the first best->start gates as the best circuit, if out is
+   not NO_GATE and the circuit is better than the best one so far. */
+static inline void keep_if_better(best_suffix *best, const state *st, gatenum out,
+    const metric cost_metric) {
+  if (out == NO_GATE) {
+    return;
+  }
+  const int len = st->num_gates - best->start;
+  if (best->out != NO_GATE && (cost_metric == GATES ? len >= best->len
+      : st->sat_metric >= best->sat_metric)) {
+    return;
+  }
+  assert(best->base + len <= SUFFIX_STACK_SIZE);
+  memcpy(g_suffix_tables + best->base, st->tables + best->start, sizeof(ttable) * len);
+  memcpy(g_suffix_gates + best->base, st->gates + best->start, sizeof(gate) * len);
+  best->len = len;
+  best->out = out;
+  best->sat_metric = st->sat_metric;
+  g_suffix_top = best->base + len;
+}
+
+/* The combinations of gate set and metric that the search is specialized for, as
+   X(NAME, ANDNOT, LUT, METRIC). LUT graphs are only built with the gate metric. */
+#define SEARCH_MODES(X) \
+  X(gates, false, false, GATES) \
+  X(andnot_gates, true, false, GATES) \
+  X(sat, false, false, SAT) \
+  X(andnot_sat, true, false, SAT) \
+  X(lut, false, true, GATES) \
+  X(andnot_lut, true, true, GATES)
+
+#define DECLARE_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+static __attribute__((noinline)) gatenum find_direct_circuit_##NAME(state *st, \
+    const ttable target, const ttable mask, const bool randomize); \
+static gatenum create_circuit_##NAME(state *st, const ttable target, const ttable mask, \
+    const int8_t *inbits, const int discrepancies, const bool randomize); \
+static gatenum build_mux_##NAME(state *st, const ttable target, const ttable mask, const int bit, \
+    const int8_t *next_inbits, const int discrepancies, const bool or_mux, \
+    const gatenum bound_gates, const int bound_sat_metric, const bool randomize);
+SEARCH_MODES(DECLARE_SEARCH_MODE)
+
+/* Calls the find_direct_circuit function specialized for andnot, lut and cost_metric. The
+   arguments are constants in all callers, so the selection is resolved at compile time. */
+static inline __attribute__((always_inline)) gatenum find_direct_circuit(state *st,
+    const ttable target, const ttable mask, const bool andnot, const bool lut,
+    const metric cost_metric, const bool randomize) {
+#define CALL_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+  if (andnot == ANDNOT && lut == LUT && cost_metric == METRIC) { \
+    return find_direct_circuit_##NAME(st, target, mask, randomize); \
+  }
+  SEARCH_MODES(CALL_SEARCH_MODE)
+#undef CALL_SEARCH_MODE
+  assert(0);
+  return NO_GATE;
+}
+
+/* Calls the create_circuit function specialized for andnot, lut and cost_metric. The arguments are
+   constants in all callers, so the selection is resolved at compile time. */
+static inline __attribute__((always_inline)) gatenum create_circuit(state *st,
+    const ttable target, const ttable mask, const int8_t *inbits, const int discrepancies,
+    const bool andnot, const bool lut, const metric cost_metric, const bool randomize) {
+#define CALL_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+  if (andnot == ANDNOT && lut == LUT && cost_metric == METRIC) { \
+    return create_circuit_##NAME(st, target, mask, inbits, discrepancies, randomize); \
+  }
+  SEARCH_MODES(CALL_SEARCH_MODE)
+#undef CALL_SEARCH_MODE
+  assert(0);
+  return NO_GATE;
+}
+
+/* Lowers the limits bound_gates and bound_sat_metric of a step 5 frame so that only circuits
+   that are better than the best circuit so far can be built. Any circuit built by the frame has at
+   least min_gates gates, each with a SAT metric of at least min_gate_sat_metric. Returns false if
+   no better circuit is possible, in which case the frame can stop. */
+static inline bool lower_bounds(const best_suffix *best, const int min_gates,
+    const int min_gate_sat_metric, const metric cost_metric, gatenum *bound_gates,
+    int *bound_sat_metric) {
+  if (best->out == NO_GATE) {
+    return true;
+  }
+  if (cost_metric == GATES) {
+    if (best->len <= min_gates) {
+      return false;
+    }
+    /* add_gate checks the limit before adding a gate, so the last gate of a circuit with at most
+       best->len - 1 gates is added when there are at most start + best->len - 2 gates. */
+    if (best->start + best->len - 2 < *bound_gates) {
+      *bound_gates = best->start + best->len - 2;
+    }
+  } else {
+    if (best->sat_metric - best->start_sat_metric <= min_gates * min_gate_sat_metric) {
+      return false;
+    }
+    /* Likewise, the last gate of a circuit with a SAT metric below best->sat_metric is added when
+       the SAT metric is at most best->sat_metric - min_gate_sat_metric - 1. */
+    if (best->sat_metric - min_gate_sat_metric - 1 < *bound_sat_metric) {
+      *bound_sat_metric = best->sat_metric - min_gate_sat_metric - 1;
+    }
+  }
+  return true;
+}
+
+/* Returns the truth table t with the positions where input bit is 0 and 1 exchanged. */
+static inline ttable flip_input(const ttable t, const int bit) {
+  static const uint64_t halves[6] = {0x5555555555555555UL, 0x3333333333333333UL,
+      0x0f0f0f0f0f0f0f0fUL, 0x00ff00ff00ff00ffUL, 0x0000ffff0000ffffUL, 0x00000000ffffffffUL};
+  ttable ret;
+  for (int w = 0; w < TTABLE_WORDS; w++) {
+    if (bit < 6) {
+      const int shift = 1 << bit;
+      ret[w] = ((t[w] & halves[bit]) << shift) | ((t[w] >> shift) & halves[bit]);
     } else {
-      state nst_and = *st; /* New state using AND multiplexer. */
-      gatenum fb = create_circuit(&nst_and, target & ~fsel, mask & ~fsel, next_inbits, andnot,
-          false, randomize);
-      gatenum mux_out_and = NO_GATE;
-      if (fb != NO_GATE) {
-        gatenum fc = create_circuit(&nst_and, nst_and.gates[fb].table ^ target, mask & fsel,
-            next_inbits, andnot, false, randomize);
-        gatenum andg = add_and_gate(&nst_and, fc, bit);
-        mux_out_and = add_xor_gate(&nst_and, fb, andg);
-        assert(mux_out_and == NO_GATE ||
-            ttable_equals_mask(target, nst_and.gates[mux_out_and].table, mask));
-      }
+      ret[w] = t[w ^ (1 << (bit - 6))];
+    }
+  }
+  return ret;
+}
 
-      state nst_or = *st; /* New state using OR multiplexer. */
-      if (mux_out_and != NO_GATE) {
-        nst_or.max_gates = nst_and.num_gates;
-        nst_or.max_sat_metric = nst_and.sat_metric;
-      }
-      gatenum fd = create_circuit(&nst_or, ~target & fsel, mask & fsel, next_inbits, andnot, false,
-          randomize);
-      gatenum mux_out_or = NO_GATE;
-      if (fd != NO_GATE) {
-        gatenum fe = create_circuit(&nst_or, nst_or.gates[fd].table ^ target, mask & ~fsel,
-            next_inbits, andnot, false, randomize);
-        gatenum org = add_or_gate(&nst_or, fe, bit);
-        mux_out_or = add_xor_gate(&nst_or, fd, org);
-        assert(mux_out_or == NO_GATE ||
-            ttable_equals_mask(target, nst_or.gates[mux_out_or].table, mask));
-        nst_or.max_gates = st->max_gates;
-        nst_or.max_sat_metric = st->max_sat_metric;
+/* Returns the truth table t with input bits i and j exchanged. */
+static inline ttable swap_inputs(const state *st, const ttable t, const int i, const int j) {
+  const ttable same = ~(st->tables[i] ^ st->tables[j]);
+  return (t & same) | (flip_input(flip_input(t, i), j) & ~same);
+}
+
+/* Returns true if exchanging input bits i and j leaves the target unchanged in the positions where
+   mask is set, and maps the gates of st to gates of st. Using j as selection bit in step 5 then
+   gives the mirror image of the circuits that using i gives. */
+static bool mirror_inputs(const state *st, const ttable target, const ttable mask, const int i,
+    const int j) {
+  if (!ttable_equals(swap_inputs(st, mask, i, j), mask)
+      || !ttable_zero((swap_inputs(st, target, i, j) ^ target) & mask)) {
+    return false;
+  }
+  for (int g = 0; g < st->num_gates; g++) {
+    if (find_gate(st, swap_inputs(st, st->tables[g], i, j)) == NO_GATE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Orders the input bits that are not in inbits by how promising they are as selection bits in
+   step 5, and puts them in bits. Returns the number of bits. Bits that the target does not depend
+   on in the positions where mask is set are left out, since a multiplexer on them only adds gates.
+   So are bits that give the mirror image of the circuits of an earlier bit. If neither a beam
+   width nor a discrepancy limit is set, the remaining bits are returned in numerical order.
+   Otherwise, the bits are ranked by how close the existing gates, or their inverses, come to the
+   target in the two halves of the mask that the bit selects between. Ties are broken randomly if
+   randomize is set. With a beam width, only the first g_beam_width bits are returned. */
+static __attribute__((noinline)) int order_selection_bits(const state *st, const ttable target,
+    const ttable mask, const int8_t *inbits, const bool randomize, int8_t *bits) {
+  const int num_inputs = get_num_inputs(st);
+  int num_bits = 0;
+  for (int bit = 0; bit < num_inputs; bit++) {
+    bool used = false;
+    for (int i = 0; i < MAX_INPUTS && inbits[i] != -1; i++) {
+      if (inbits[i] == bit) {
+        used = true;
+        break;
       }
-      if (mux_out_and == NO_GATE && mux_out_or == NO_GATE) {
-        continue;
+    }
+    if (used) {
+      continue;
+    }
+    const ttable fmask = flip_input(mask, bit);
+    if (ttable_zero(mask & fmask & (target ^ flip_input(target, bit)))) {
+      continue;
+    }
+    bool mirror = false;
+    for (int i = 0; i < num_bits && !mirror; i++) {
+      mirror = mirror_inputs(st, target, mask, bits[i], bit);
+    }
+    if (!mirror) {
+      bits[num_bits++] = bit;
+    }
+  }
+  if (g_beam_width >= MAX_INPUTS && g_discrepancies >= MAX_INPUTS) {
+    return num_bits;
+  }
+
+  /* The score of a bit is the sum over the two halves of the mask of the least number of positions
+     in which an existing gate, or its inverse, differs from the target. */
+  int score[MAX_INPUTS];
+  uint64_t tiebreak[MAX_INPUTS];
+  for (int i = 0; i < num_bits; i++) {
+    const ttable fsel = st->tables[bits[i]];
+    const ttable halves[2] = {mask & ~fsel, mask & fsel};
+    score[i] = 0;
+    for (int h = 0; h < 2; h++) {
+      const int size = ttable_popcount(halves[h]);
+      int best = size;
+      for (int g = 0; g < st->num_gates && best > 0; g++) {
+        const int diff = ttable_popcount((st->tables[g] ^ target) & halves[h]);
+        best = diff < best ? diff : best;
+        best = size - diff < best ? size - diff : best;
       }
+      score[i] += best;
+    }
+    tiebreak[i] = randomize ? xorshift1024() : 0;
+  }
+
+  /* Insertion sort, which keeps the numerical order of ties if randomize is not set. */
+  for (int i = 1; i < num_bits; i++) {
+    const int8_t b = bits[i];
+    const int sc = score[i];
+    const uint64_t tb = tiebreak[i];
+    int k = i;
+    while (k > 0 && (score[k - 1] > sc || (score[k - 1] == sc && tiebreak[k - 1] > tb))) {
+      bits[k] = bits[k - 1];
+      score[k] = score[k - 1];
+      tiebreak[k] = tiebreak[k - 1];
+      k -= 1;
+    }
+    bits[k] = b;
+    score[k] = sc;
+    tiebreak[k] = tb;
+  }
+  return num_bits < g_beam_width ? num_bits : g_beam_width;
+}
+
+/* Builds the AND multiplexer of step 5, or the OR multiplexer if or_mux is set, in place in st
+   with bit as selection bit. bound_gates and bound_sat_metric are the limits for the gates of the
+   multiplexer. The two branches are built with limits one gate lower, since the output XOR gate is
+   always new. Not used in LUT mode. Returns the ID of the output gate, or NO_GATE if no circuit was
+   found. */
+static inline __attribute__((always_inline)) gatenum build_mux_impl(state *st,
+    const ttable target, const ttable mask, const int bit, const int8_t *next_inbits,
+    const int discrepancies, const bool or_mux, const gatenum bound_gates,
+    const int bound_sat_metric, const bool andnot, const metric cost_metric,
+    const bool randomize) {
+  const ttable fsel = st->tables[bit]; /* Selection bit. */
+  const ttable first = or_mux ? fsel : ~fsel; /* The half of the mask that is built first. */
+  st->max_gates = bound_gates - 1;
+  st->max_sat_metric = bound_sat_metric - get_sat_metric(NOT);
+  gatenum fb = create_circuit(st, or_mux ? ~target & fsel : target & ~fsel, mask & first,
+      next_inbits, discrepancies, andnot, false, cost_metric, randomize);
+  gatenum mux_out = NO_GATE;
+  if (fb != NO_GATE) {
+    gatenum fc = create_circuit(st, st->tables[fb] ^ target, mask & ~first, next_inbits,
+        discrepancies, andnot, false, cost_metric, randomize);
+    st->max_gates = bound_gates;
+    st->max_sat_metric = bound_sat_metric;
+    gatenum selg = or_mux ? add_or_gate(st, fc, bit) : add_and_gate(st, fc, bit);
+    mux_out = add_xor_gate(st, fb, selg);
+    assert(mux_out == NO_GATE || ttable_equals_mask(target, st->tables[mux_out], mask));
+  }
+  st->max_gates = bound_gates;
+  st->max_sat_metric = bound_sat_metric;
+  return mux_out;
+}
+
+typedef gatenum (*build_mux_fn)(state *st, const ttable target, const ttable mask, const int bit,
+    const int8_t *next_inbits, const int discrepancies, const bool or_mux,
+    const gatenum bound_gates, const int bound_sat_metric, const bool randomize);
+
+/* Returns the build_mux function specialized for andnot, lut and cost_metric. The arguments are
+   constants in all callers, so the selection is resolved at compile time. */
+static inline __attribute__((always_inline)) build_mux_fn get_build_mux(const bool andnot,
+    const bool lut, const metric cost_metric) {
+#define SELECT_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+  if (andnot == ANDNOT && lut == LUT && cost_metric == METRIC) { \
+    return build_mux_##NAME; \
+  }
+  SEARCH_MODES(SELECT_SEARCH_MODE)
+#undef SELECT_SEARCH_MODE
+  assert(0);
+  return NULL;
+}
+
+/* Limits for the gates of the circuits built by the threads of a parallel step 5. They are lowered
+   by each thread that finds a better circuit, and read by all step 5 frames, so that all threads
+   cut their branches as soon as they can not beat the best circuit of any thread. Unlike the
+   incumbent limits, they only allow strictly better circuits. Outside of a parallel step 5, they
+   do not limit anything. */
+static gatenum g_shared_max_gates = MAX_GATES;
+static int g_shared_max_sat_metric = INT_MAX;
+
+/* Lowers bound_gates and bound_sat_metric to the shared limits of a parallel step 5 and the
+   incumbent limits, if those are lower. */
+static inline void apply_shared_bounds(gatenum *bound_gates, int *bound_sat_metric) {
+  poll_incumbent();
+  gatenum shared_gates = __atomic_load_n(&g_shared_max_gates, __ATOMIC_RELAXED);
+  int shared_sat_metric = __atomic_load_n(&g_shared_max_sat_metric, __ATOMIC_RELAXED);
+  if (get_incumbent_gates() < shared_gates) {
+    shared_gates = get_incumbent_gates();
+  }
+  if (get_incumbent_sat_metric() < shared_sat_metric) {
+    shared_sat_metric = get_incumbent_sat_metric();
+  }
+  if (shared_gates < *bound_gates) {
+    *bound_gates = shared_gates;
+  }
+  if (shared_sat_metric < *bound_sat_metric) {
+    *bound_sat_metric = shared_sat_metric;
+  }
+}
+
+/* Size of the transposition table of each thread. */
+static size_t g_thread_table_size = 0;
 
+/* The work of a parallel step 5. Task i is the AND multiplexer, for even i, or the OR multiplexer,
+   for odd i, with selection bit sel_bits[i / 2]. */
+typedef struct {
+  const state *st;        /* The state that the circuits are built from. */
+  ttable target;
+  ttable mask;
+  const int8_t *sel_bits;
+  int discrepancies;
+  bool randomize;
+  build_mux_fn build_mux;
+  int num_tasks;
+  int next_task;          /* The next task to be taken. Updated atomically. */
+  pthread_mutex_t lock;   /* Protects best and best_out. */
+  state best;             /* The state with the best circuit found. */
+  gatenum best_out;       /* Output gate of the best circuit, or NO_GATE if none has been found. */
+} step5_work;
+
+/* Takes tasks from work until there are none left, and keeps the best circuit. */
+static void run_step5_tasks(step5_work *work) {
+  state st;
+  while (true) {
+    const int task = __atomic_fetch_add(&work->next_task, 1, __ATOMIC_RELAXED);
+    if (task >= work->num_tasks) {
+      break;
+    }
+    const int rank = task / 2;
+    int8_t next_inbits[MAX_INPUTS];
+    memset(next_inbits, -1, sizeof(next_inbits));
+    next_inbits[0] = work->sel_bits[rank];
+    copy_state(&st, work->st);
+    gatenum bound_gates = st.max_gates;
+    int bound_sat_metric = st.max_sat_metric;
+    apply_shared_bounds(&bound_gates, &bound_sat_metric);
+    gatenum out = work->build_mux(&st, work->target, work->mask, work->sel_bits[rank],
+        next_inbits, work->discrepancies - rank, task & 1, bound_gates, bound_sat_metric,
+        work->randomize);
+    if (out == NO_GATE) {
+      continue;
+    }
+    pthread_mutex_lock(&work->lock);
+    if (work->best_out == NO_GATE || (g_metric == GATES ? st.num_gates < work->best.num_gates
+        : st.sat_metric < work->best.sat_metric)) {
+      copy_state(&work->best, &st);
+      work->best_out = out;
+      /* As in lower_bounds. The circuit is a complete circuit for the output, so it also
+         lowers the incumbent limits, as in generate_graph. */
       if (g_metric == GATES) {
-        if (mux_out_or == NO_GATE
-            || (mux_out_and != NO_GATE && nst_and.num_gates < nst_or.num_gates)) {
-          nst = nst_and;
-          nst_out = mux_out_and;
-        } else {
-          nst = nst_or;
-          nst_out = mux_out_or;
-        }
+        __atomic_store_n(&g_shared_max_gates, st.num_gates - 2, __ATOMIC_RELAXED);
+        lower_incumbent(st.num_gates, INT_MAX);
       } else {
-        if (mux_out_or == NO_GATE
-            || (mux_out_and != NO_GATE && nst_and.sat_metric < nst_or.sat_metric)) {
-          nst = nst_and;
-          nst_out = mux_out_and;
-        } else {
-          nst = nst_or;
-          nst_out = mux_out_or;
+        __atomic_store_n(&g_shared_max_sat_metric, st.sat_metric - get_sat_metric(NOT) - 1,
+            __ATOMIC_RELAXED);
+        lower_incumbent(MAX_GATES, st.sat_metric);
+      }
+    }
+    pthread_mutex_unlock(&work->lock);
+  }
+}
+
+/* The helper threads of a parallel step 5. They are started by the first parallel step 5 and kept
+   until stop_step5_threads, so that each keeps its transposition table from one step 5 to the
+   next. The calling thread posts its work in g_step5_work and waits until no helper is busy. */
+static pthread_t g_step5_threads[MAX_THREADS];
+static int g_num_step5_threads = 0;
+static pthread_mutex_t g_step5_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_step5_cond = PTHREAD_COND_INITIALIZER; /* Signalled on any change below. */
+static step5_work *g_step5_work = NULL; /* The current work. Guarded by g_step5_lock. */
+static uint64_t g_step5_round = 0;      /* Incremented when work is posted. Guarded as above. */
+static int g_step5_busy = 0;            /* Helpers working on the current work. Guarded as above. */
+static bool g_step5_quit = false;       /* Set to stop the helpers. Guarded as above. */
+
+/* Incremented when the transposition table of the calling thread is cleared between outputs, so
+   that the helpers clear theirs before their next work. Guarded by g_step5_lock. */
+static uint32_t g_table_clears = 0;
+
+/* Start function of the helper threads of a parallel step 5. */
+static void *step5_thread(void *arg) {
+  /* Without a table, the thread only runs slower. */
+  init_transposition_table(g_thread_table_size);
+  uint64_t round = 0;
+  uint32_t table_clears = 0;
+  pthread_mutex_lock(&g_step5_lock);
+  while (true) {
+    while (!g_step5_quit && g_step5_round == round) {
+      pthread_cond_wait(&g_step5_cond, &g_step5_lock);
+    }
+    if (g_step5_quit) {
+      break;
+    }
+    round = g_step5_round;
+    step5_work *work = g_step5_work;
+    const bool clear = g_table_clears != table_clears;
+    table_clears = g_table_clears;
+    pthread_mutex_unlock(&g_step5_lock);
+    if (clear) {
+      clear_transposition_table();
+    }
+    run_step5_tasks(work);
+    pthread_mutex_lock(&g_step5_lock);
+    g_step5_busy -= 1;
+    if (g_step5_busy == 0) {
+      pthread_cond_broadcast(&g_step5_cond);
+    }
+  }
+  pthread_mutex_unlock(&g_step5_lock);
+  free_transposition_table();
+  return NULL;
+}
+
+/* Clears the transposition table of the calling thread and, before their next work, those of the
+   helper threads of a parallel step 5. */
+static void clear_transposition_tables() {
+  clear_transposition_table();
+  pthread_mutex_lock(&g_step5_lock);
+  g_table_clears += 1;
+  pthread_mutex_unlock(&g_step5_lock);
+}
+
+/* Stops the helper threads of a parallel step 5 and frees their transposition tables. */
+static void stop_step5_threads() {
+  pthread_mutex_lock(&g_step5_lock);
+  g_step5_quit = true;
+  pthread_cond_broadcast(&g_step5_cond);
+  pthread_mutex_unlock(&g_step5_lock);
+  for (int i = 0; i < g_num_step5_threads; i++) {
+    pthread_join(g_step5_threads[i], NULL);
+  }
+  g_num_step5_threads = 0;
+}
+
+/* Step 5 for the top level of create_circuit, outside LUT mode, with the multiplexers for the
+   first num_tasks / 2 selection bits in sel_bits built by g_num_threads threads. Each thread
+   builds its multiplexers on its own copy of st. The best circuit is added to st. Returns the ID
+   of its output gate, or NO_GATE if no circuit was found. */
+static __attribute__((noinline)) gatenum build_mux_parallel(state *st, const ttable target,
+    const ttable mask, const int8_t *sel_bits, const int num_tasks, const int discrepancies,
+    const gatenum bound_gates, const int bound_sat_metric, const bool randomize,
+    build_mux_fn build_mux) {
+  /* On the stack, since malloc does not align the truth tables in it. */
+  step5_work work;
+  work.st = st;
+  work.target = target;
+  work.mask = mask;
+  work.sel_bits = sel_bits;
+  work.discrepancies = discrepancies;
+  work.randomize = randomize;
+  work.build_mux = build_mux;
+  work.num_tasks = num_tasks;
+  work.next_task = 0;
+  pthread_mutex_init(&work.lock, NULL);
+  work.best_out = NO_GATE;
+  g_shared_max_gates = bound_gates;
+  g_shared_max_sat_metric = bound_sat_metric;
+
+  if (g_num_step5_threads == 0) {
+    while (g_num_step5_threads < g_num_threads - 1 && pthread_create(
+        &g_step5_threads[g_num_step5_threads], NULL, step5_thread, NULL) == 0) {
+      g_num_step5_threads += 1;
+    }
+  }
+  pthread_mutex_lock(&g_step5_lock);
+  g_step5_work = &work;
+  g_step5_round += 1;
+  g_step5_busy = g_num_step5_threads;
+  pthread_cond_broadcast(&g_step5_cond);
+  pthread_mutex_unlock(&g_step5_lock);
+  run_step5_tasks(&work);
+  pthread_mutex_lock(&g_step5_lock);
+  while (g_step5_busy > 0) {
+    pthread_cond_wait(&g_step5_cond, &g_step5_lock);
+  }
+  pthread_mutex_unlock(&g_step5_lock);
+  g_shared_max_gates = MAX_GATES;
+  g_shared_max_sat_metric = INT_MAX;
+
+  gatenum out = work.best_out;
+  if (out != NO_GATE) {
+    append_gates(st, work.best.tables + st->num_gates, work.best.gates + st->num_gates,
+        work.best.num_gates - st->num_gates);
+    assert(ttable_equals_mask(target, st->tables[out], mask));
+  }
+  pthread_mutex_destroy(&work.lock);
+  return out;
+}
+
+/* Recursively builds the gate network. The numbered comments are references to Matthew Kwan's
+   paper. Like find_direct_circuit_impl, this is instantiated once for every search mode, so that
+   the checks of andnot, lut and cost_metric are resolved at compile time. */
+static inline __attribute__((always_inline)) gatenum build_circuit_impl(state *st,
+    const ttable target, const ttable mask, const int8_t *inbits, const int discrepancies,
+    const bool andnot, const bool lut, const metric cost_metric, const bool randomize) {
+  if (incumbent_expired()) {
+    return NO_GATE;
+  }
+
+  gatenum gid = find_direct_circuit(st, target, mask, andnot, lut, cost_metric, randomize);
+  if (gid != NOT_FOUND) {
+    return gid;
+  }
+
+  if (lut) {
+    gid = find_lut_circuit(st, target, mask);
+    if (gid != NOT_FOUND) {
+      return gid;
+    }
+  }
+
+  /* 5. Use the specified input bit to select between two Karnaugh maps. Call this function
+     recursively to generate those two maps. The branches are built in place in st, which is
+     rolled back to its original gates before the next branch. Only the gates of the best branch
+     are saved, and they are added back to st at the end. */
+
+  /* Copy input bits already used to new array to avoid modifying the old one. */
+  int8_t next_inbits[MAX_INPUTS];
+  uint8_t bitp = 0;
+  while (bitp < MAX_INPUTS - 2 && inbits[bitp] != -1) {
+    next_inbits[bitp] = inbits[bitp];
+    bitp += 1;
+  }
+  assert(bitp < MAX_INPUTS - 1);
+  next_inbits[bitp] = -1;
+  next_inbits[bitp + 1] = -1;
+
+  /* Steps 1-4 try all circuits of up to two gates, or a single LUT in LUT mode, so a circuit
+     built here has at least min_gates new gates. Each gate adds at least the SAT metric of a NOT
+     gate. */
+  const int min_gates = lut ? 2 : 3;
+  const int min_gate_sat_metric = get_sat_metric(NOT);
+  const gatenum max_gates = st->max_gates;
+  const int max_sat_metric = st->max_sat_metric;
+  if (st->num_gates + min_gates - 1 > get_max_gates(st) || (cost_metric == SAT
+      && st->sat_metric + (min_gates - 1) * min_gate_sat_metric > get_max_sat_metric(st))) {
+    return NO_GATE;
+  }
+
+  /* The limits for the gates of the multiplexer. They are lowered every time a better circuit is
+     found, so that the remaining branches are cut as soon as they can not beat it. */
+  gatenum bound_gates = max_gates;
+  int bound_sat_metric = max_sat_metric;
+  best_suffix best = {st->num_gates, st->sat_metric, g_suffix_top, 0, NO_GATE, 0};
+
+  /* Try the input bits that have not been used, in the order given by order_selection_bits. A
+     limited discrepancy search only tries the first discrepancies + 1 of them, and the later ones
+     use up more of the discrepancies left for the branches. */
+  int8_t sel_bits[MAX_INPUTS];
+  const int num_sel_bits = order_selection_bits(st, target, mask, inbits, randomize, sel_bits);
+  if (!lut && g_num_threads > 1 && bitp == 0) {
+    const int num_tasks = 2 * (num_sel_bits < discrepancies + 1 ? num_sel_bits : discrepancies + 1);
+    return build_mux_parallel(st, target, mask, sel_bits, num_tasks, discrepancies, bound_gates,
+        bound_sat_metric, randomize, get_build_mux(andnot, lut, cost_metric));
+  }
+  for (int rank = 0; rank < num_sel_bits && rank <= discrepancies; rank++) {
+    const int bit = sel_bits[rank];
+    const int next_discrepancies = discrepancies - rank;
+    apply_shared_bounds(&bound_gates, &bound_sat_metric);
+    if (!lower_bounds(&best, min_gates, min_gate_sat_metric, cost_metric, &bound_gates,
+          &bound_sat_metric)) {
+      break;
+    }
+    next_inbits[bitp] = bit;
+
+    if (lut) {
+      const ttable fsel = st->tables[bit]; /* Selection bit. */
+      st->max_gates = bound_gates;
+      gatenum mux_out = NO_GATE;
+      gatenum fb = create_circuit(st, target, mask & ~fsel, next_inbits, next_discrepancies, andnot,
+          true, cost_metric, randomize);
+      if (fb != NO_GATE) {
+        assert(ttable_equals_mask(target, st->tables[fb], mask & ~fsel));
+        gatenum fc = create_circuit(st, target, mask & fsel, next_inbits, next_discrepancies,
+            andnot, true, cost_metric, randomize);
+        if (fc != NO_GATE) {
+          assert(ttable_equals_mask(target, st->tables[fc], mask & fsel));
+          if (fb == fc) {
+            mux_out = fb;
+          } else if (fb == bit) {
+            mux_out = add_and_gate(st, fb, fc);
+          } else if (fc == bit) {
+            mux_out = add_or_gate(st, fb, fc);
+          } else {
+            ttable mux_table = generate_lut_ttable(0xac, st->tables[bit], st->tables[fb],
+                st->tables[fc]);
+            mux_out = add_lut(st, 0xac, mux_table, bit, fb, fc);
+          }
+          assert(mux_out == NO_GATE || ttable_equals_mask(target, st->tables[mux_out], mask));
         }
       }
-    }
-
-    assert(best.num_gates == 0 || ttable_equals_mask(target, best.gates[best_out].table, mask));
-    if (g_metric == GATES) {
-      if (best.num_gates == 0 || nst.num_gates < best.num_gates) {
-        best = nst;
-        best_out = nst_out;
-      }
+      keep_if_better(&best, st, mux_out, cost_metric);
+      rollback_state(st, best.start);
     } else {
-      if (best.sat_metric == 0 || nst.sat_metric < best.sat_metric) {
-        best = nst;
-        best_out = nst_out;
+      gatenum mux_out_and = build_mux_impl(st, target, mask, bit, next_inbits, next_discrepancies,
+          false, bound_gates, bound_sat_metric, andnot, cost_metric, randomize);
+      keep_if_better(&best, st, mux_out_and, cost_metric);
+      rollback_state(st, best.start);
+
+      /* The OR multiplexer is only built if it can be better than the best circuit so far,
+         including the AND multiplexer. */
+      if (!lower_bounds(&best, min_gates, min_gate_sat_metric, cost_metric, &bound_gates,
+            &bound_sat_metric)) {
+        break;
       }
+      gatenum mux_out_or = build_mux_impl(st, target, mask, bit, next_inbits, next_discrepancies,
+          true, bound_gates, bound_sat_metric, andnot, cost_metric, randomize);
+      keep_if_better(&best, st, mux_out_or, cost_metric);
+      rollback_state(st, best.start);
     }
-    assert(best.num_gates == 0 || ttable_equals_mask(target, best.gates[best_out].table, mask));
   }
+  st->max_gates = max_gates;
+  st->max_sat_metric = max_sat_metric;
+
+  g_suffix_top = best.base;
+  if (best.out == NO_GATE) {
+    return NO_GATE;
+  }
+  append_gates(st, g_suffix_tables + best.base, g_suffix_gates + best.base, best.len);
+  assert(ttable_equals_mask(target, st->tables[best.out], mask));
+  return best.out;
+}
 
-  if (best.num_gates == 0) {
+/* Adds the gates of the circuit in the transposition table entry e to st. Returns the ID of the
+   output gate, or NO_GATE if e has no circuit or the gate limit was exceeded. */
+static gatenum add_transposition_circuit(state *st, const transposition_entry *e) {
+  if (!e->found) {
     return NO_GATE;
   }
+  for (int i = 0; i < e->len; i++) {
+    const gate *g = &e->gates[i];
+    gatenum gid;
+    if (g->type == LUT) {
+      ttable table = generate_lut_ttable(g->function, st->tables[g->in1], st->tables[g->in2],
+          st->tables[g->in3]);
+      gid = add_lut(st, g->function, table, g->in1, g->in2, g->in3);
+    } else {
+      gid = add_typed_gate(st, g->type, g->in1, g->in2);
+    }
+    if (gid == NO_GATE) {
+      return NO_GATE;
+    }
+    assert(gid == st->num_gates - 1);
+  }
+  return e->out;
+}
+
+/* Builds the gate network, or looks up the result in the transposition table if the same
+   subproblem has been solved before. */
+static inline __attribute__((always_inline)) gatenum create_circuit_impl(state *st,
+    const ttable target, const ttable mask, const int8_t *inbits, const int discrepancies,
+    const bool andnot, const bool lut, const metric cost_metric, const bool randomize) {
+  if (!transposition_table_enabled()) {
+    return build_circuit_impl(st, target, mask, inbits, discrepancies, andnot, lut, cost_metric,
+        randomize);
+  }
+  uint32_t used_bits = 0;
+  for (int i = 0; i < MAX_INPUTS && inbits[i] != -1; i++) {
+    used_bits |= 1 << inbits[i];
+  }
+  const transposition_key key = get_transposition_key(st, target, mask, used_bits,
+      discrepancies);
+  const transposition_entry *e = lookup_transposition(&key, get_max_gates(st) - st->num_gates,
+      get_max_sat_metric(st) - st->sat_metric);
+  if (e != NULL) {
+    gatenum gid = add_transposition_circuit(st, e);
+    assert(gid == NO_GATE || ttable_equals_mask(target, st->tables[gid], mask));
+    return gid;
+  }
+  const gatenum start = st->num_gates;
+  gatenum gid = build_circuit_impl(st, target, mask, inbits, discrepancies, andnot, lut,
+      cost_metric, randomize);
+  if (gid == NO_GATE) {
+    /* The incumbent limits may have been lowered during the search. In a parallel step 5, the
+       branches were also cut by the shared limits, so the failure only holds within them. */
+    gatenum max_gates = get_max_gates(st);
+    int max_sat_metric = get_max_sat_metric(st);
+    const gatenum shared_gates = __atomic_load_n(&g_shared_max_gates, __ATOMIC_RELAXED);
+    const int shared_sat_metric = __atomic_load_n(&g_shared_max_sat_metric, __ATOMIC_RELAXED);
+    if (shared_gates < max_gates) {
+      max_gates = shared_gates;
+    }
+    if (shared_sat_metric < max_sat_metric) {
+      max_sat_metric = shared_sat_metric;
+    }
+    store_transposition_failure(&key, max_gates - st->num_gates,
+        max_sat_metric - st->sat_metric);
+  } else {
+    store_transposition_circuit(&key, st, start, gid);
+  }
+  return gid;
+}
 
-  assert(ttable_equals_mask(target, best.gates[best_out].table, mask));
-  *st = best;
-  return best_out;
+#define DEFINE_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+static __attribute__((noinline)) gatenum find_direct_circuit_##NAME(state *st, \
+    const ttable target, const ttable mask, const bool randomize) { \
+  return find_direct_circuit_impl(st, target, mask, ANDNOT, LUT, METRIC, randomize); \
+} \
+static gatenum create_circuit_##NAME(state *st, const ttable target, const ttable mask, \
+    const int8_t *inbits, const int discrepancies, const bool randomize) { \
+  return create_circuit_impl(st, target, mask, inbits, discrepancies, ANDNOT, LUT, METRIC, \
+      randomize); \
+} \
+static gatenum build_mux_##NAME(state *st, const ttable target, const ttable mask, const int bit, \
+    const int8_t *next_inbits, const int discrepancies, const bool or_mux, \
+    const gatenum bound_gates, const int bound_sat_metric, const bool randomize) { \
+  return build_mux_impl(st, target, mask, bit, next_inbits, discrepancies, or_mux, bound_gates, \
+      bound_sat_metric, ANDNOT, METRIC, randomize); \
+}
+SEARCH_MODES(DEFINE_SEARCH_MODE)
+
+/* Builds a circuit for target in the positions where mask is set, with the search specialized for
+   the gate set and metric selected in main. */
+typedef gatenum (*create_circuit_fn)(state *st, const ttable target, const ttable mask,
+    const int8_t *inbits, const int discrepancies, const bool randomize);
+static create_circuit_fn g_create_circuit = NULL;
+
+/* Returns the create_circuit function specialized for andnot, lut and cost_metric. */
+static create_circuit_fn select_create_circuit(const bool andnot, const bool lut,
+    const metric cost_metric) {
+#define SELECT_SEARCH_MODE(NAME, ANDNOT, LUT, METRIC) \
+  if (andnot == ANDNOT && lut == LUT && cost_metric == METRIC) { \
+    return create_circuit_##NAME; \
+  }
+  SEARCH_MODES(SELECT_SEARCH_MODE)
+#undef SELECT_SEARCH_MODE
+  return NULL;
 }
 
 /* All MPI ranks except rank 0 will call this function and wait for work units. */
@@ -833,6 +2002,9 @@ static void mpi_worker() {
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
+  /* Only the truth tables and the number of gates are kept up to date. */
+  state st;
+  st.num_gates = 0;
   uint16_t res[10];
   while (1) {
     mpi_work work;
@@ -840,12 +2012,20 @@ static void mpi_worker() {
     if (work.quit) {
       return;
     }
+    assert(work.num_kept <= st.num_gates);
+    st.num_gates = work.num_kept + work.num_new;
+    if (work.num_new > 0) {
+      MPI_Bcast(st.tables + work.num_kept, sizeof(ttable) * work.num_new, MPI_BYTE, 0,
+          MPI_COMM_WORLD);
+    }
+    /* Workers do not build circuits. This only takes the incumbent messages off the queue. */
+    poll_incumbent();
 
-    if (work.st.num_gates >= 5 && search_5lut(work.st, work.target, work.mask, res)) {
+    if (st.num_gates >= 5 && search_5lut(&st, work.target, work.mask, res)) {
       continue;
     }
-    if (work.st.num_gates >= 7) {
-      search_7lut(work.st, work.target, work.mask, res);
+    if (st.num_gates >= 7) {
+      search_7lut(&st, work.target, work.mask, res);
     }
   }
 }
@@ -853,57 +2033,160 @@ static void mpi_worker() {
 /* If sbox is true, a target truth table for the given bit of the sbox is generated.
    If sbox is false, the truth table of the given input bit is generated. */
 static ttable generate_target(uint8_t bit, bool sbox) {
-  assert(bit < 8);
-  uint64_t vec[] = {0, 0, 0, 0};
-  uint64_t *var = &vec[0];
-  for (uint16_t i = 0; i < 256; i++) {
-    if (i == 64) {
-      var = &vec[1];
-    } else if (i == 128) {
-      var = &vec[2];
-    } else if (i == 192) {
-      var = &vec[3];
-    }
-    *var >>= 1;
-    *var |= (uint64_t)(((sbox ? g_sbox_enc[i] : i) >> bit) & 1) << 63;
+  assert(bit < (sbox ? MAX_OUTPUTS : MAX_INPUTS));
+  ttable ret = {0};
+  for (int i = 0; i < TTABLE_BITS; i++) {
+    ret[i / 64] |= (uint64_t)(((sbox ? g_sbox_enc[i] : i) >> bit) & 1) << (i % 64);
   }
-  return _mm256_loadu_si256((ttable*)vec);
+  return ret;
 }
 
+/* Generates a mask with the bits for the first 2^num_inputs S-box inputs set. */
 static ttable generate_mask(int num_inputs) {
-  uint64_t mask_vec[] = {0xFFFFFFFFFFFFFFFFUL, 0xFFFFFFFFFFFFFFFFUL,
-                         0xFFFFFFFFFFFFFFFFUL, 0xFFFFFFFFFFFFFFFFUL};
-  if (num_inputs < 8) {
-    mask_vec[2] = mask_vec[3] = 0;
+  assert(num_inputs <= MAX_INPUTS);
+  ttable ret = {0};
+  for (int i = 0; i < (1 << num_inputs); i++) {
+    ret[i / 64] |= 1UL << (i % 64);
+  }
+  return ret;
+}
+
+/* Lowers the incumbent limits to the size of st, which has a circuit for an output. */
+static void lower_incumbent_to(const state *st) {
+  if (g_metric == GATES) {
+    lower_incumbent(st->num_gates, INT_MAX);
+  } else {
+    lower_incumbent(MAX_GATES, st->sat_metric);
+  }
+}
+
+/* Returns true if the result a, a number of gates and a SAT metric, is better than b by
+   cost_metric. */
+static inline bool better_result(const int *a, const int *b, const metric cost_metric) {
+  return cost_metric == GATES ? a[0] < b[0] || (a[0] == b[0] && a[1] < b[1])
+      : a[1] < b[1] || (a[1] == b[1] && a[0] < b[0]);
+}
+
+/* Keeps the size of st, which has a circuit for all outputs, if it is the best so far. */
+static void record_result(const state *st) {
+  const int result[2] = {st->num_gates - get_num_inputs(st), st->sat_metric};
+  const int best[2] = {g_best_gates, g_best_sat_metric};
+  if (better_result(result, best, g_metric)) {
+    g_best_gates = result[0];
+    g_best_sat_metric = result[1];
+    copy_state(&g_best_state, st);
   }
-  if (num_inputs < 7) {
-    mask_vec[1] = 0;
+}
+
+/* Adds a circuit for output, with truth table target, to st. Returns false if no circuit was
+   found. */
+static bool build_output(state *st, const ttable target, const int output,
+    const bool randomize) {
+  int8_t bits[MAX_INPUTS];
+  memset(bits, -1, sizeof(bits));
+  const ttable mask = generate_mask(get_num_inputs(st));
+  if (randomize) {
+    clear_transposition_tables();
+  }
+  st->outputs[output] = g_create_circuit(st, target, mask, bits, g_discrepancies, randomize);
+  if (st->outputs[output] == NO_GATE) {
+    return false;
+  }
+  assert(ttable_equals_mask(target, st->tables[st->outputs[output]], mask));
+  return true;
+}
+
+/* Circuit worker ranks call this function instead of mpi_worker, and build the circuits they are
+   sent until they are told to quit. */
+static void circuit_worker() {
+  while (1) {
+    circuit_work work;
+    MPI_Recv(&work, sizeof(work), MPI_BYTE, 0, CIRCUIT_WORK_TAG, MPI_COMM_WORLD,
+        MPI_STATUS_IGNORE);
+    if (work.quit) {
+      return;
+    }
+    join_incumbent_search(work.search);
+    if (build_output(&work.st, work.target, work.output, work.randomize)) {
+      /* Sent to the other workers directly, without waiting for rank 0. */
+      lower_incumbent_to(&work.st);
+      poll_incumbent();
+    }
+    MPI_Send(&work.st, sizeof(state), MPI_BYTE, 0, CIRCUIT_RESULT_TAG, MPI_COMM_WORLD);
   }
-  if (num_inputs < 6) {
-    mask_vec[0] = (1L << (1 << num_inputs)) - 1;
+}
+
+/* Sends the work of adding a circuit for output to st to an idle circuit worker rank. search is
+   the incumbent search number. */
+static void send_circuit_work(const state *st, const int output, const int search,
+    const bool randomize) {
+  assert(g_num_busy_workers < g_num_workers);
+  int worker = 1;
+  while (g_worker_outputs[worker] != -1) {
+    worker += 1;
   }
-  return _mm256_loadu_si256((ttable*)mask_vec);
+  circuit_work work;
+  copy_state(&work.st, st);
+  work.target = g_target[output];
+  work.output = output;
+  work.search = search;
+  work.randomize = randomize;
+  work.quit = false;
+  MPI_Send(&work, sizeof(work), MPI_BYTE, worker, CIRCUIT_WORK_TAG, MPI_COMM_WORLD);
+  g_worker_outputs[worker] = output;
+  g_num_busy_workers += 1;
+}
+
+/* Waits for a circuit worker rank to finish its work and copies the resulting state to st.
+   Returns the output that the worker built a circuit for. */
+static int receive_circuit(state *st) {
+  assert(g_num_busy_workers > 0);
+  MPI_Status status;
+  MPI_Recv(st, sizeof(state), MPI_BYTE, MPI_ANY_SOURCE, CIRCUIT_RESULT_TAG, MPI_COMM_WORLD,
+      &status);
+  const int output = g_worker_outputs[status.MPI_SOURCE];
+  g_worker_outputs[status.MPI_SOURCE] = -1;
+  g_num_busy_workers -= 1;
+  return output;
 }
 
-void generate_graph_one_output(const bool andnot, const bool lut, const bool randomize,
-    const int iterations, const int output, state st) {
+void generate_graph_one_output(const bool randomize, const int iterations, const int output,
+    state st) {
   assert(iterations > 0);
   assert(output >= 0 && output <= get_num_outputs() - 1);
   printf("Generating graphs for output %d...\n", output);
-  for (int iter = 0; iter < iterations; iter++) {
-    state nst = st;
-
-    int8_t bits[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
-    const ttable mask = generate_mask(get_num_inputs(&st));
-    nst.outputs[output] = create_circuit(&nst, g_target[output], mask, bits, andnot, lut,
-        randomize);
+  const int search = reset_incumbent();
+  int started = 0;
+  int done = 0;
+  /* After the deadline, no more iterations are started. */
+  while (done < iterations && (done < started || !incumbent_expired())) {
+    state nst;
+    if (g_num_workers > 0) {
+      /* The iterations are independent, so as many as possible are kept running. Their results
+         are handled in the order they finish. */
+      if (started < iterations && !incumbent_expired()
+          && g_num_busy_workers < g_num_workers) {
+        send_circuit_work(&st, output, search, randomize);
+        started += 1;
+        continue;
+      }
+      receive_circuit(&nst);
+    } else {
+      copy_state(&nst, &st);
+      build_output(&nst, g_target[output], output, randomize);
+      started += 1;
+    }
+    done += 1;
     if (nst.outputs[output] == NO_GATE) {
-      printf("(%d/%d): Not found.\n", iter + 1, iterations);
+      printf("(%d/%d): Not found.\n", done, iterations);
       continue;
     }
-    printf("(%d/%d): %d gates. SAT metric: %d\n", iter + 1, iterations,
+    printf("(%d/%d): %d gates. SAT metric: %d\n", done, iterations,
         nst.num_gates - get_num_inputs(&nst), nst.sat_metric);
-    save_state(nst);
+    if (g_save_states) {
+      save_state(nst);
+    }
+    record_result(&nst);
     if (g_metric == GATES) {
       if (nst.num_gates < st.max_gates) {
         st.max_gates = nst.num_gates;
@@ -913,12 +2196,14 @@ void generate_graph_one_output(const bool andnot, const bool lut, const bool ran
         st.max_sat_metric = nst.sat_metric;
       }
     }
+    lower_incumbent_to(&nst);
+    poll_incumbent();
   }
 }
 
 static inline int count_state_outputs(state st) {
   int num_outputs = 0;
-  for (int i = 0; i < 8; i++) {
+  for (int i = 0; i < MAX_OUTPUTS; i++) {
     if (st.outputs[i] != NO_GATE) {
       num_outputs += 1;
     }
@@ -926,109 +2211,478 @@ static inline int count_state_outputs(state st) {
   return num_outputs;
 }
 
-/* Called by main to generate a graph. */
-void generate_graph(const bool andnot, const bool lut, const bool randomize, const int iterations,
-    const state st) {
+/* The best states found in a step of generate_graph. */
+typedef struct {
+  gatenum max_gates;
+  int max_sat_metric;
+  state out_states[20];
+  int num_out_states;
+} graph_step;
+
+/* Adds st, with a circuit for output, to the best states of step, if it is at least as good as
+   them. */
+static void add_step_state(graph_step *step, const state *st, const int output) {
+  if (st->outputs[output] == NO_GATE) {
+    printf("No solution for output %d.\n", output);
+    return;
+  }
+  if (g_save_states) {
+    save_state(*st);
+  }
+  lower_incumbent_to(st);
+  poll_incumbent();
+  if (count_state_outputs(*st) == get_num_outputs()) {
+    record_result(st);
+  }
+
+  if (g_metric == GATES) {
+    if (step->max_gates > st->num_gates) {
+      step->max_gates = st->num_gates;
+      step->num_out_states = 0;
+    }
+    if (st->num_gates <= step->max_gates) {
+      if (step->num_out_states < 20) {
+        copy_state(&step->out_states[step->num_out_states++], st);
+      } else {
+        printf("Output state buffer full! Throwing away valid state.\n");
+      }
+    }
+  } else {
+    if (step->max_sat_metric > st->sat_metric) {
+      step->max_sat_metric = st->sat_metric;
+      step->num_out_states = 0;
+    }
+    if (st->sat_metric <= step->max_sat_metric) {
+      if (step->num_out_states < 20) {
+        copy_state(&step->out_states[step->num_out_states++], st);
+      } else {
+        printf("Output state buffer full! Throwing away valid state.\n");
+      }
+    }
+  }
+}
+
+/* Called by main to generate a graph. The max_gates and max_sat_metric fields of st limit the
+   states of every step. */
+void generate_graph(const bool randomize, const int iterations, const state st) {
   int num_start_states = 1;
   state start_states[20];
-  start_states[0] = st;
+  copy_state(&start_states[0], &st);
 
   /* Build the gate network one output at a time. After every added output, select the gate network
      or network with the least amount of gates and add another. */
   int num_outputs;
-  while ((num_outputs = count_state_outputs(start_states[0])) < get_num_outputs()) {
-    gatenum max_gates = MAX_GATES;
-    int max_sat_metric = INT_MAX;
-    state out_states[20];
-    memset(out_states, 0, sizeof(state) * 20);
-    int num_out_states = 0;
-
-    for (int iter = 0; iter < iterations; iter++) {
+  while ((num_outputs = count_state_outputs(start_states[0])) < get_num_outputs()
+      && !incumbent_expired()) {
+    graph_step step;
+    step.max_gates = st.max_gates;
+    step.max_sat_metric = st.max_sat_metric;
+    step.num_out_states = 0;
+    memset(step.out_states, 0, sizeof(step.out_states));
+    const int search = reset_incumbent();
+
+    /* After the deadline, no more circuits are started, and the step is the last one. */
+    for (int iter = 0; iter < iterations && !incumbent_expired(); iter++) {
       printf("Generating circuits with %d output%s. (%d/%d)\n", num_outputs + 1,
           num_outputs == 0 ? "" : "s", iter + 1, iterations);
-      for (uint8_t current_state = 0; current_state < num_start_states; current_state++) {
-        start_states[current_state].max_gates = max_gates;
-        start_states[current_state].max_sat_metric = max_sat_metric;
+      for (uint8_t current_state = 0; current_state < num_start_states && !incumbent_expired();
+          current_state++) {
+        start_states[current_state].max_gates = step.max_gates;
+        start_states[current_state].max_sat_metric = step.max_sat_metric;
 
         /* Add all outputs not already present to see which resulting network is the smallest. */
-        for (uint8_t output = 0; output < get_num_outputs(); output++) {
+        for (uint8_t output = 0; output < get_num_outputs() && !incumbent_expired(); output++) {
           if (start_states[current_state].outputs[output] != NO_GATE) {
             printf("Skipping output %d.\n", output);
             continue;
           }
           printf("Generating circuit for output %d...\n", output);
-          int8_t bits[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
-          state st = start_states[current_state];
+          state st;
+          copy_state(&st, &start_states[current_state]);
           if (g_metric == GATES) {
-            st.max_gates = max_gates;
+            st.max_gates = step.max_gates;
           } else {
-            st.max_sat_metric = max_sat_metric;
-          }
-
-          const ttable mask = generate_mask(get_num_inputs(&st));
-          st.outputs[output] = create_circuit(&st, g_target[output], mask, bits, andnot, lut,
-              randomize);
-          if (st.outputs[output] == NO_GATE) {
-            printf("No solution for output %d.\n", output);
-            continue;
+            st.max_sat_metric = step.max_sat_metric;
           }
-          assert(ttable_equals_mask(g_target[output], st.gates[st.outputs[output]].table, mask));
-          save_state(st);
 
-          if (g_metric == GATES) {
-            if (max_gates > st.num_gates) {
-              max_gates = st.num_gates;
-              num_out_states = 0;
-            }
-            if (st.num_gates <= max_gates) {
-              if (num_out_states < 20) {
-                out_states[num_out_states++] = st;
-              } else {
-                printf("Output state buffer full! Throwing away valid state.\n");
-              }
+          if (g_num_workers > 0) {
+            /* The circuits are independent, so the workers are kept busy. Each result is handled
+               when a worker is needed for the next circuit, or at the end of the step. */
+            if (g_num_busy_workers == g_num_workers) {
+              state rst;
+              const int routput = receive_circuit(&rst);
+              add_step_state(&step, &rst, routput);
             }
+            send_circuit_work(&st, output, search, randomize);
           } else {
-            if (max_sat_metric > st.sat_metric) {
-              max_sat_metric = st.sat_metric;
-              num_out_states = 0;
-            }
-            if (st.sat_metric <= max_sat_metric) {
-              if (num_out_states < 20) {
-                out_states[num_out_states++] = st;
-              } else {
-                printf("Output state buffer full! Throwing away valid state.\n");
-              }
-            }
+            build_output(&st, g_target[output], output, randomize);
+            add_step_state(&step, &st, output);
           }
         }
       }
     }
+    while (g_num_busy_workers > 0) {
+      state rst;
+      const int routput = receive_circuit(&rst);
+      add_step_state(&step, &rst, routput);
+    }
+    if (step.num_out_states == 0) {
+      printf("No states found.\n");
+      break;
+    }
     if (g_metric == GATES) {
-      printf("Found %d state%s with %d gates.\n", num_out_states,
-          num_out_states == 1 ? "" : "s", max_gates - get_num_inputs(&out_states[0]));
+      printf("Found %d state%s with %d gates.\n", step.num_out_states,
+          step.num_out_states == 1 ? "" : "s",
+          step.max_gates - get_num_inputs(&step.out_states[0]));
     } else {
-      printf("Found %d state%s with SAT metric %d.\n", num_out_states,
-          num_out_states == 1 ? "" : "s", max_sat_metric);
+      printf("Found %d state%s with SAT metric %d.\n", step.num_out_states,
+          step.num_out_states == 1 ? "" : "s", step.max_sat_metric);
     }
-    for (int i  = 0; i < num_out_states; i++) {
-      start_states[i] = out_states[i];
+    for (int i  = 0; i < step.num_out_states; i++) {
+      copy_state(&start_states[i], &step.out_states[i]);
     }
-    num_start_states = num_out_states;
+    num_start_states = step.num_out_states;
   }
 }
 
 /* Causes the MPI workers to quit. */
 static void stop_workers() {
+  /* In portfolio mode, there are no workers. In variant search, the workers only wait for work
+     after the setup that rank 0 can fail in, and search_variants stops them. */
+  if (g_portfolio || g_variants) {
+    return;
+  }
+  if (g_num_workers > 0) {
+    circuit_work work;
+    work.quit = true;
+    for (int i = 1; i <= g_num_workers; i++) {
+      MPI_Send(&work, sizeof(work), MPI_BYTE, i, CIRCUIT_WORK_TAG, MPI_COMM_WORLD);
+    }
+    return;
+  }
   mpi_work work;
   work.quit = true;
   MPI_Bcast(&work, sizeof(work), MPI_BYTE, 0, MPI_COMM_WORLD);
 }
 
+/* Handles an error before the search has started. Rank 0 stops the workers. A circuit worker can
+   not tell rank 0 that it is not coming, so it aborts all ranks. Returns the exit status. */
+static int setup_failed(int rank) {
+  if (rank != 0) {
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  stop_workers();
+  return 1;
+}
+
+/* Gathers the best circuits of all ranks in portfolio mode and prints them on rank 0, with the
+   best circuits for each gate set. */
+static void print_portfolio_results(int rank, int size) {
+  int result[2] = {g_best_gates, g_best_sat_metric};
+  int *results = NULL;
+  if (rank == 0) {
+    results = malloc(sizeof(int) * 2 * size);
+    if (results == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+  }
+  MPI_Gather(result, 2, MPI_INT, results, 2, MPI_INT, 0, MPI_COMM_WORLD);
+  if (rank != 0) {
+    return;
+  }
+  printf("Portfolio results:\n");
+  for (int i = 0; i < size; i++) {
+    const search_config *c = &g_portfolio_configs[i % NUM_PORTFOLIO_CONFIGS];
+    printf("Rank %d (%sANDNOT, %s metric, %s order, width %d, discrepancies %d): ", i,
+        c->andnot ? "" : "no ", c->cost_metric == GATES ? "gate" : "SAT",
+        c->score_order ? "correlation" : "random", c->beam_width, c->discrepancies);
+    if (results[2 * i] == INT_MAX) {
+      printf("no circuit.\n");
+    } else {
+      printf("%d gates, SAT metric %d.\n", results[2 * i], results[2 * i + 1]);
+    }
+  }
+  for (int andnot = 0; andnot <= 1; andnot++) {
+    for (metric m = GATES; m <= SAT; m++) {
+      int best = -1;
+      for (int i = 0; i < size; i++) {
+        if (g_portfolio_configs[i % NUM_PORTFOLIO_CONFIGS].andnot == andnot
+            && results[2 * i] != INT_MAX
+            && (best == -1 || better_result(&results[2 * i], &results[2 * best], m))) {
+          best = i;
+        }
+      }
+      if (best != -1) {
+        printf("Best %s ANDNOT gates by %s: rank %d, %d gates, SAT metric %d.\n",
+            andnot ? "with" : "without", m == GATES ? "gates" : "SAT metric", best,
+            results[2 * best], results[2 * best + 1]);
+      }
+    }
+  }
+  free(results);
+}
+
+/* Sets the target S-box to sbox(x ^ input_xor) ^ output_xor for inputs below 2^num_inputs, and
+   generates the truth tables of its outputs. */
+static void set_target_sbox(const uint16_t *sbox, const int num_inputs, const int input_xor,
+    const int output_xor) {
+  for (int i = 0; i < TTABLE_BITS; i++) {
+    g_sbox_enc[i] = sbox[i ^ input_xor] ^ (i < (1 << num_inputs) ? output_xor : 0);
+  }
+  for (uint8_t i = 0; i < MAX_OUTPUTS; i++) {
+    g_target[i] = generate_target(i, true);
+  }
+}
+
+/* The search that is run for each variant in variant search. */
+typedef struct {
+  const uint16_t *sbox;
+  int num_inputs;
+  int num_outputs;
+  const state *st;    /* The initial state. */
+  int oneoutput;      /* As in main. */
+  int iterations;
+  bool randomize;
+} variant_search;
+
+/* Runs vs for the variant in work, and returns the number of gates and the SAT metric of the best
+   circuit found in result. Its state is then in g_best_state. Screening searches do one iteration
+   with a narrow beam. */
+static void run_variant(const variant_search *vs, const variant_work *work, int *result) {
+  set_target_sbox(vs->sbox, vs->num_inputs, work->input_xor, work->output_xor);
+  /* Circuits for other variants do not bound the search. */
+  set_incumbent_group(1 + (work->input_xor << MAX_OUTPUTS) + work->output_xor);
+  const int beam_width = g_beam_width;
+  const int iterations = work->screen ? 1 : vs->iterations;
+  if (work->screen) {
+    g_beam_width = beam_width < SCREEN_BEAM_WIDTH ? beam_width : SCREEN_BEAM_WIDTH;
+  } else {
+    printf("Variant with input XOR 0x%02x and output XOR 0x%02x:\n", work->input_xor,
+        work->output_xor);
+  }
+  state st;
+  copy_state(&st, vs->st);
+  st.max_gates = work->max_gates;
+  st.max_sat_metric = work->max_sat_metric;
+  g_best_gates = INT_MAX;
+  g_best_sat_metric = INT_MAX;
+  if (vs->oneoutput != -1) {
+    generate_graph_one_output(vs->randomize, iterations, vs->oneoutput, st);
+  } else {
+    generate_graph(vs->randomize, iterations, st);
+  }
+  g_beam_width = beam_width;
+  result[0] = g_best_gates;
+  result[1] = g_best_sat_metric;
+}
+
+/* Variant worker ranks call this function, and run the variants they are sent until they are
+   told to quit. */
+static void variant_worker(const variant_search *vs) {
+  while (1) {
+    variant_work work;
+    MPI_Recv(&work, sizeof(work), MPI_BYTE, 0, VARIANT_WORK_TAG, MPI_COMM_WORLD,
+        MPI_STATUS_IGNORE);
+    if (work.quit) {
+      return;
+    }
+    int result[2];
+    run_variant(vs, &work, result);
+    MPI_Send(result, 2, MPI_INT, 0, VARIANT_RESULT_TAG, MPI_COMM_WORLD);
+    /* Rank 0 saves the state of the best variant of the full pass. */
+    if (!work.screen && result[0] != INT_MAX) {
+      MPI_Send(&g_best_state, sizeof(state), MPI_BYTE, 0, VARIANT_RESULT_TAG, MPI_COMM_WORLD);
+    }
+  }
+}
+
+/* Runs the variants in works on the variant worker ranks, or on this rank if there are none, and
+   stores their results in results. If bound is set, each variant is limited to circuits at least
+   as good as the best one found so far in the pass. Variants that have not been started by the
+   deadline get no result. Returns the index of the best variant, or -1 if no circuit was found.
+   Unless the works are screening searches, the state of the best variant is returned in
+   best_state. */
+static int run_variant_pass(const variant_search *vs, variant_work *works, int (*results)[2],
+    const int num_works, const bool bound, state *best_state) {
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  int running[size]; /* Variant that each worker is running, or -1. */
+  for (int i = 0; i < size; i++) {
+    running[i] = -1;
+  }
+  for (int i = 0; i < num_works; i++) {
+    results[i][0] = results[i][1] = INT_MAX;
+  }
+  int best = -1;
+  int started = 0;
+  int done = 0;
+  int worker = 1;
+  while (done < started || (started < num_works && !incumbent_expired())) {
+    poll_incumbent();
+    if (started < num_works && !incumbent_expired() && (size == 1 || worker < size)) {
+      variant_work *work = &works[started];
+      work->max_gates = MAX_GATES;
+      work->max_sat_metric = INT_MAX;
+      if (bound && best != -1) {
+        if (g_metric == GATES) {
+          work->max_gates = results[best][0] + vs->num_inputs;
+        } else {
+          work->max_sat_metric = results[best][1];
+        }
+      }
+      if (size == 1) {
+        run_variant(vs, work, results[started]);
+        if (results[started][0] != INT_MAX && (best == -1
+            || better_result(results[started], results[best], g_metric))) {
+          best = started;
+          if (!work->screen) {
+            copy_state(best_state, &g_best_state);
+          }
+        }
+        started += 1;
+        done += 1;
+        continue;
+      }
+      MPI_Send(work, sizeof(variant_work), MPI_BYTE, worker, VARIANT_WORK_TAG, MPI_COMM_WORLD);
+      running[worker] = started;
+      started += 1;
+      while (worker < size && running[worker] != -1) {
+        worker += 1;
+      }
+      continue;
+    }
+    int result[2];
+    MPI_Status status;
+    MPI_Recv(result, 2, MPI_INT, MPI_ANY_SOURCE, VARIANT_RESULT_TAG, MPI_COMM_WORLD, &status);
+    const int variant = running[status.MPI_SOURCE];
+    running[status.MPI_SOURCE] = -1;
+    if (status.MPI_SOURCE < worker) {
+      worker = status.MPI_SOURCE;
+    }
+    results[variant][0] = result[0];
+    results[variant][1] = result[1];
+    const bool better = result[0] != INT_MAX
+        && (best == -1 || better_result(result, results[best], g_metric));
+    if (better) {
+      best = variant;
+    }
+    if (!works[variant].screen && result[0] != INT_MAX) {
+      state st;
+      MPI_Recv(&st, sizeof(state), MPI_BYTE, status.MPI_SOURCE, VARIANT_RESULT_TAG,
+          MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+      if (better) {
+        copy_state(best_state, &st);
+      }
+    }
+    done += 1;
+  }
+  return best;
+}
+
+/* Orders variant indices by the results of a screening pass, best first. */
+static int (*g_screen_results)[2] = NULL;
+static int compare_screen_results(const void *a, const void *b) {
+  const int va = *(const int*)a;
+  const int vb = *(const int*)b;
+  if (better_result(g_screen_results[va], g_screen_results[vb], g_metric)) {
+    return -1;
+  }
+  if (better_result(g_screen_results[vb], g_screen_results[va], g_metric)) {
+    return 1;
+  }
+  return va - vb;
+}
+
+/* Searches the variants of the target S-box with all input XOR constants, and all output XOR
+   constants if output_xors is set. All variants are screened with a quick search first, and the
+   best eighth of them are then searched with vs. Prints the best circuit and the transformation
+   that gives the target S-box from it, and stops the variant workers. */
+static void search_variants(const variant_search *vs, const bool output_xors) {
+  /* For a single output, only its own output bit matters. */
+  const int num_output_bits = vs->oneoutput == -1 ? vs->num_outputs : 1;
+  const int output_shift = vs->oneoutput == -1 ? 0 : vs->oneoutput;
+  const int num_output_xors = output_xors ? 1 << num_output_bits : 1;
+  const int num_variants = (1 << vs->num_inputs) * num_output_xors;
+  variant_work *works = malloc(sizeof(variant_work) * num_variants);
+  variant_work *full_works = malloc(sizeof(variant_work) * num_variants);
+  int (*results)[2] = malloc(sizeof(int) * 2 * num_variants);
+  int (*full_results)[2] = malloc(sizeof(int) * 2 * num_variants);
+  int *order = malloc(sizeof(int) * num_variants);
+  if (works == NULL || full_works == NULL || results == NULL || full_results == NULL
+      || order == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    MPI_Abort(MPI_COMM_WORLD, 1);
+  }
+  for (int i = 0; i < num_variants; i++) {
+    works[i].input_xor = i / num_output_xors;
+    works[i].output_xor = (i % num_output_xors) << output_shift;
+    works[i].screen = true;
+    works[i].quit = false;
+    order[i] = i;
+  }
+
+  printf("Screening %d variants...\n", num_variants);
+  run_variant_pass(vs, works, results, num_variants, false, NULL);
+  g_screen_results = results;
+  qsort(order, num_variants, sizeof(int), compare_screen_results);
+  g_screen_results = NULL;
+
+  const int num_full = (num_variants + 7) / 8;
+  printf("Searching the best %d variant%s...\n", num_full, num_full == 1 ? "" : "s");
+  for (int i = 0; i < num_full; i++) {
+    full_works[i] = works[order[i]];
+    full_works[i].screen = false;
+  }
+  state best_state;
+  const int best = run_variant_pass(vs, full_works, full_results, num_full, true, &best_state);
+
+  if (best == -1) {
+    printf("No circuit found for any variant.\n");
+  } else {
+    const variant_work *w = &full_works[best];
+    printf("Best variant: input XOR 0x%02x, output XOR 0x%02x, %d gates, SAT metric %d.\n",
+        w->input_xor, w->output_xor, full_results[best][0], full_results[best][1]);
+    save_state(best_state);
+    char name[STATE_FILE_NAME_SIZE];
+    get_state_file_name(&best_state, name);
+    printf("The target S-box is S(x) = C(x ^ 0x%02x) ^ 0x%02x, where C is the circuit in %s.\n",
+        w->input_xor, w->output_xor, name);
+  }
+
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  variant_work quit;
+  quit.quit = true;
+  for (int i = 1; i < size; i++) {
+    MPI_Send(&quit, sizeof(quit), MPI_BYTE, i, VARIANT_WORK_TAG, MPI_COMM_WORLD);
+  }
+  free(works);
+  free(full_works);
+  free(results);
+  free(full_results);
+  free(order);
+}
+
 int main(int argc, char **argv) {
-  MPI_Init(&argc, &argv);
+  /* Only the main thread makes MPI calls. */
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   int rank, size;
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
+  if (!init_incumbent()) {
+    fprintf(stderr, "Out of memory.\n");
+    MPI_Finalize();
+    return 1;
+  }
+
+  init_kernels();
+  if (!test_kernels()) {
+    fprintf(stderr, "Error: Kernel self test failed.\n");
+    MPI_Finalize();
+    return 1;
+  }
 
   bool output_dot = false;
   bool output_c = false;
@@ -1038,18 +2692,27 @@ int main(int argc, char **argv) {
   char fname[1000];
   char gfname[1000];
   char sboxfname[1000];
+  char dbfname[1000];
   int oneoutput = -1;
   int permute = 0;
   int iterations = 1;
+  int table_mb = 64;
   int c;
-  char *opts = "b:c:d:g:hi:lno:p:s";
+  bool portfolio = false;
+  double deadline = 0;
+  int variants = 0;
+  char *opts = "ab:c:d:g:hi:j:lm:no:p:rst:u:v:w:z:";
 
   strcpy(fname, "");
   strcpy(gfname, "");
   strcpy(sboxfname, "");
+  strcpy(dbfname, "");
 
   while ((c = getopt(argc, argv, opts)) != -1) {
     switch (c) {
+      case 'a':
+        portfolio = true;
+        break;
       case 'b':
         if (strlen(optarg) >= 1000) {
           fprintf(stderr, "Error: File name too long.\n");
@@ -1098,17 +2761,29 @@ int main(int argc, char **argv) {
           return 0;
         }
         printf(
+            "-a        Portfolio mode. Each rank searches with its own gate set, metric and\n"
+            "          search order. (Overrides -n, -r, -s, -w and -z.)\n"
             "-b file   Target S-box definition.\n"
             "-c file   Output C function.\n"
             "-d file   Output DOT digraph.\n"
             "-g file   Load graph from file as initial state. (For use with -o.)\n"
             "-h        Display this help.\n"
             "-i n      Do n iterations per step.\n"
+            "-j n      Use n threads for the top level step 5 branches or the LUT searches.\n"
             "-l        Generate LUT graph.\n"
+            "-m n      Use n MB of memory for the transposition table. (Default 64, 0 disables.)\n"
             "-n        Use ANDNOT gates.\n"
             "-o n      Generate one-output graph for output n.\n"
             "-p value  Permute sbox by XORing input with value.\n"
-            "-s        Use SAT metric.\n");
+            "-r        Order gates by correlation with the target instead of randomly.\n"
+            "-s        Use SAT metric.\n"
+            "-t s      Stop after s seconds and keep the circuits found so far.\n"
+            "-u file   Load subcircuit database generated with gen_subcircuits.\n"
+            "-v n      Search the variants of the S-box with all input XOR constants (n = 1),\n"
+            "          or all input and output XOR constants (n = 2).\n"
+            "-w n      Only try the n most promising selection bits in each step 5 branch.\n"
+            "-z n      Limited discrepancy search with at most n discrepancies from the most\n"
+            "          promising selection bit order.\n");
         MPI_Finalize();
         return 0;
       case 'i':
@@ -1117,15 +2792,31 @@ int main(int argc, char **argv) {
           fprintf(stderr, "Bad iterations value: %s\n", optarg);
         }
         break;
+      case 'j':
+        g_num_threads = atoi(optarg);
+        if (g_num_threads < 1 || g_num_threads > MAX_THREADS) {
+          fprintf(stderr, "Bad number of threads: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        break;
       case 'l':
         lut_graph = true;
         break;
+      case 'm':
+        table_mb = atoi(optarg);
+        if (table_mb < 0) {
+          fprintf(stderr, "Bad transposition table size: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        break;
       case 'n':
         andnot = true;
         break;
       case 'o':
         oneoutput = atoi(optarg);
-        if (oneoutput < 0 || oneoutput > 7) {
+        if (oneoutput < 0 || oneoutput >= MAX_OUTPUTS) {
           fprintf(stderr, "Bad output value: %s\n", optarg);
           MPI_Finalize();
           return 1;
@@ -1133,21 +2824,82 @@ int main(int argc, char **argv) {
         break;
       case 'p':
         permute = atoi(optarg);
-        if (permute < 0 || permute > 255) {
+        if (permute < 0 || permute >= TTABLE_BITS) {
           fprintf(stderr, "Bad permutation value: %s\n", optarg);
           MPI_Finalize();
           return 1;
         }
         break;
+      case 'r':
+        g_score_order = true;
+        break;
       case 's':
         g_metric = SAT;
         break;
+      case 't':
+        deadline = atof(optarg);
+        if (deadline <= 0) {
+          fprintf(stderr, "Bad deadline: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        break;
+      case 'u':
+        if (strlen(optarg) >= 1000) {
+          fprintf(stderr, "Error: File name too long.\n");
+          MPI_Finalize();
+          return 1;
+        }
+        strcpy(dbfname, optarg);
+        break;
+      case 'v':
+        variants = atoi(optarg);
+        if (variants < 1 || variants > 2) {
+          fprintf(stderr, "Bad variant search value: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        break;
+      case 'w':
+        g_beam_width = atoi(optarg);
+        if (g_beam_width < 1) {
+          fprintf(stderr, "Bad beam width: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        break;
+      case 'z':
+        g_discrepancies = atoi(optarg);
+        if (g_discrepancies < 0) {
+          fprintf(stderr, "Bad discrepancy limit: %s\n", optarg);
+          MPI_Finalize();
+          return 1;
+        }
+        if (g_discrepancies > MAX_INPUTS) {
+          g_discrepancies = MAX_INPUTS;
+        }
+        break;
       default:
         MPI_Finalize();
         return 1;
     }
   }
 
+  if (portfolio) {
+    const search_config *config = &g_portfolio_configs[rank % NUM_PORTFOLIO_CONFIGS];
+    andnot = config->andnot;
+    g_metric = config->cost_metric;
+    g_score_order = config->score_order;
+    g_beam_width = config->beam_width;
+    g_discrepancies = config->discrepancies;
+    g_portfolio = true;
+    /* Circuits with other gate sets or metrics do not bound the search. */
+    set_incumbent_group(andnot * 2 + g_metric);
+  }
+  if (deadline > 0) {
+    set_incumbent_deadline(deadline);
+  }
+
   if (output_c && output_dot) {
     fprintf(stderr, "Cannot combine c and d options.\n");
     MPI_Finalize();
@@ -1160,6 +2912,30 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (variants != 0 && (lut_graph || portfolio || permute != 0 || strlen(gfname) != 0)) {
+    fprintf(stderr, "Variant search can not be combined with -a, -g, -l or -p.\n");
+    MPI_Finalize();
+    return 1;
+  }
+  g_variants = variants != 0;
+  g_save_states = !g_variants;
+
+  if (lut_graph && portfolio) {
+    fprintf(stderr, "Portfolio mode can not be combined with LUT graph generation.\n");
+    MPI_Finalize();
+    return 1;
+  }
+
+  if (lut_graph && strlen(dbfname) != 0) {
+    fprintf(stderr, "Subcircuit database can not be combined with LUT graph generation.\n");
+    MPI_Finalize();
+    return 1;
+  }
+
+  init_step4_tables();
+  g_create_circuit = select_create_circuit(andnot, lut_graph, g_metric);
+  assert(g_create_circuit != NULL);
+
   if (output_c || output_dot) {
     state st;
     if (!load_state(fname, &st)) {
@@ -1179,8 +2955,59 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  if (rank != 0) {
+  /* In portfolio mode, every rank runs the whole search on its own. In variant search, every rank
+     sets up the search, and the other ranks then run the variants they get from rank 0. */
+  const bool circuit_workers = !lut_graph && !portfolio && variants == 0 && size > 1;
+  if (rank != 0 && !circuit_workers && !portfolio && variants == 0) {
     mpi_worker();
+    print_lut_search_stats();
+    free_lut_searches();
+    free_incumbent();
+    MPI_Finalize();
+    return 0;
+  }
+  if (rank == 0 && circuit_workers) {
+    g_worker_outputs = malloc(sizeof(int) * size);
+    if (g_worker_outputs == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (int i = 0; i < size; i++) {
+      g_worker_outputs[i] = -1;
+    }
+    g_num_workers = size - 1;
+  }
+
+  /* The circuit workers need a transposition table and the subcircuit database as well. The
+     memory is shared equally between the tables of the threads. */
+  g_thread_table_size = ((size_t)table_mb << 20) / g_num_threads;
+  if (!init_transposition_table(g_thread_table_size)) {
+    fprintf(stderr, "Error when allocating the transposition table.\n");
+    return setup_failed(rank);
+  }
+
+  if (strlen(dbfname) != 0) {
+    g_subcircuits = malloc(sizeof(subcircuit_db));
+    if (g_subcircuits == NULL || !load_subcircuits(dbfname, g_subcircuits)) {
+      fprintf(stderr, "Error when loading subcircuit database.\n");
+      return setup_failed(rank);
+    }
+    if (g_subcircuits->andnot != andnot || g_subcircuits->cost_metric != g_metric) {
+      if (!portfolio) {
+        fprintf(stderr, "Error: the subcircuit database was generated for another gate set or "
+            "metric.\n");
+        return setup_failed(rank);
+      }
+      /* The configuration of this rank searches without it. */
+      free(g_subcircuits);
+      g_subcircuits = NULL;
+    }
+  }
+
+  if (rank != 0 && circuit_workers) {
+    circuit_worker();
+    stop_step5_threads();
+    free_incumbent();
     MPI_Finalize();
     return 0;
   }
@@ -1191,8 +3018,8 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  uint8_t target_sbox[256];
-  memset(target_sbox, 0, sizeof(uint8_t) * 256);
+  uint16_t target_sbox[TTABLE_BITS];
+  memset(target_sbox, 0, sizeof(uint16_t) * TTABLE_BITS);
   int sbox_inp = 0;
   int ret;
   uint32_t input;
@@ -1203,7 +3030,8 @@ int main(int argc, char **argv) {
     stop_workers();
     return 1;
   }
-  while ((ret = fscanf(sboxfp, " %x", &input)) > 0 && ret != EOF && sbox_inp < 256 && input < 256) {
+  while ((ret = fscanf(sboxfp, " %x", &input)) > 0 && ret != EOF && sbox_inp < TTABLE_BITS
+      && input < (1 << MAX_OUTPUTS)) {
     target_sbox[sbox_inp++] = input;
     num_outputs |= input;
   }
@@ -1216,18 +3044,7 @@ int main(int argc, char **argv) {
   uint32_t num_inputs = 31 - __builtin_clz(sbox_inp);
   num_outputs = 32 - __builtin_clz(num_outputs);
 
-  if (permute == 0) {
-    memcpy(g_sbox_enc, target_sbox, 256 * sizeof(uint8_t));
-  } else {
-    for (int i = 0; i < 256; i++) {
-      g_sbox_enc[i] = target_sbox[i ^ (uint8_t)permute];
-    }
-  }
-
-  /* Generate truth tables for all output bits of the target sbox. */
-  for (uint8_t i = 0; i < 8; i++) {
-    g_target[i] = generate_target(i, true);
-  }
+  set_target_sbox(target_sbox, num_inputs, permute, 0);
 
   state st;
   if (strlen(gfname) == 0) {
@@ -1237,15 +3054,16 @@ int main(int argc, char **argv) {
     st.num_gates = num_inputs;
     for (int i = 0; i < num_inputs; i++) {
       st.gates[i].type = IN;
-      st.gates[i].table = generate_target(i, false);
+      st.tables[i] = generate_target(i, false);
       st.gates[i].in1 = NO_GATE;
       st.gates[i].in2 = NO_GATE;
       st.gates[i].in3 = NO_GATE;
       st.gates[i].function = 0;
     }
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < MAX_OUTPUTS; i++) {
       st.outputs[i] = NO_GATE;
     }
+    rebuild_gate_hash(&st);
   } else if (!load_state(gfname, &st)) {
     MPI_Finalize();
     return 1;
@@ -1253,13 +3071,35 @@ int main(int argc, char **argv) {
     printf("Loaded %s.\n", gfname);
   }
 
-  if (oneoutput != -1) {
-    generate_graph_one_output(andnot, lut_graph, randomize, iterations, oneoutput, st);
+  if (variants != 0) {
+    const variant_search vs = {target_sbox, num_inputs, num_outputs, &st, oneoutput, iterations,
+        randomize};
+    if (rank == 0) {
+      search_variants(&vs, variants == 2);
+    } else {
+      variant_worker(&vs);
+    }
+  } else if (oneoutput != -1) {
+    generate_graph_one_output(randomize, iterations, oneoutput, st);
   } else {
-    generate_graph(andnot, lut_graph, randomize, iterations, st);
+    generate_graph(randomize, iterations, st);
+  }
+  if (incumbent_expired()) {
+    printf("Stopped at the deadline.\n");
+  }
+  stop_step5_threads();
+  /* With circuit workers, rank 0 does not search. */
+  if (transposition_table_enabled() && g_num_workers == 0) {
+    print_transposition_stats();
+  }
+  print_lut_search_stats();
+  if (portfolio) {
+    print_portfolio_results(rank, size);
   }
 
   stop_workers();
+  free_lut_searches();
+  free_incumbent();
   MPI_Finalize();
 
   return 0;
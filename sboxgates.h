@@ -20,12 +20,13 @@
 
 #include "state.h"
 
+/* Number of threads of each rank. Outside LUT mode, they build the top level step 5 branches. In
+   LUT mode, they take part in the LUT searches. */
+extern int g_num_threads;
+
 /* Performs a masked test for equality. Only bits set to 1 in the mask will be tested. */
 bool ttable_equals_mask(const ttable in1, const ttable in2, const ttable mask);
 
-/* Returns the number of input gates in the state. */
-int get_num_inputs(const state *st);
-
 /* Generates pseudorandom 64 bit strings. Used for randomizing the search process. */
 uint64_t xorshift1024();
 
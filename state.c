@@ -21,12 +21,12 @@
 #define MSGPACK_FORMAT_VERSION 2
 #include <assert.h>
 #include <limits.h>
+#include <stddef.h>
 #include <msgpack.h>
 #include <msgpack/fbuffer.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
-#include "sboxgates.h"
 #include "state.h"
 
 static inline uint32_t speck_round(uint16_t pt1, uint16_t pt2, uint16_t k1) {
@@ -38,40 +38,47 @@ static inline uint32_t speck_round(uint16_t pt1, uint16_t pt2, uint16_t k1) {
   return (((uint32_t)pt1) << 16) | pt2;
 }
 
+/* Feeds len bytes of data into the fingerprint fp1, fp2. */
+static void fingerprint_update(uint16_t *fp1, uint16_t *fp2, const void *data, size_t len) {
+  const uint16_t *ptr = (const uint16_t*)data;
+  for (int p = 0; p < len / 2; p++) {
+    uint32_t ct = speck_round(*fp1, *fp2, ptr[p]);
+    *fp1 = ct >> 16;
+    *fp2 = ct & 0xffff;
+  }
+  if (len & 1) {
+    uint32_t ct = speck_round(*fp1, *fp2, ((const uint8_t*)data)[len - 1]);
+    *fp1 = ct >> 16;
+    *fp2 = ct & 0xffff;
+  }
+}
+
 /* Generates a simple fingerprint based on the Speck round function. It is meant to be used for
    creating unique-ish names for the state save file and is not intended to be cryptographically
    secure by any means. */
-static uint32_t state_fingerprint(const state st) {
-  assert(st.num_gates <= MAX_GATES);
+static uint32_t state_fingerprint(const state *st) {
+  assert(st->num_gates <= MAX_GATES);
   state fpstate;
   memset(&fpstate, 0, sizeof(state));
-  fpstate.max_gates = st.max_gates;
-  fpstate.num_gates = st.num_gates;
-  for (int i = 0; i < 8; i++) {
-    fpstate.outputs[i] = st.outputs[i];
+  fpstate.max_gates = st->max_gates;
+  fpstate.num_gates = st->num_gates;
+  for (int i = 0; i < MAX_OUTPUTS; i++) {
+    fpstate.outputs[i] = st->outputs[i];
   }
-  for (int i = 0; i < st.num_gates; i++) {
-    fpstate.gates[i].table = st.gates[i].table;
-    fpstate.gates[i].type = st.gates[i].type;
-    fpstate.gates[i].in1 = st.gates[i].in1;
-    fpstate.gates[i].in2 = st.gates[i].in2;
-    fpstate.gates[i].in3 = st.gates[i].in3;
-    fpstate.gates[i].function = st.gates[i].function;
+  for (int i = 0; i < st->num_gates; i++) {
+    fpstate.tables[i] = st->tables[i];
+    fpstate.gates[i].type = st->gates[i].type;
+    fpstate.gates[i].in1 = st->gates[i].in1;
+    fpstate.gates[i].in2 = st->gates[i].in2;
+    fpstate.gates[i].in3 = st->gates[i].in3;
+    fpstate.gates[i].function = st->gates[i].function;
   }
   uint16_t fp1 = 0;
   uint16_t fp2 = 0;
-  uint16_t *ptr = (uint16_t*)&fpstate;
-  size_t len = sizeof(state) - sizeof(gate) * (MAX_GATES - fpstate.num_gates);
-  for (int p = 0; p < len / 2; p++) {
-    uint32_t ct = speck_round(fp1, fp2, ptr[p]);
-    fp1 = ct >> 16;
-    fp2 = ct & 0xffff;
-  }
-  if (len & 1) {
-    uint32_t ct = speck_round(fp1, fp2, ((uint8_t*)&fpstate)[len - 1]);
-    fp1 = ct >> 16;
-    fp2 = ct & 0xffff;
-  }
+  fingerprint_update(&fp1, &fp2, &fpstate.max_sat_metric,
+      sizeof(state) - offsetof(state, max_sat_metric));
+  fingerprint_update(&fp1, &fp2, fpstate.tables, sizeof(ttable) * fpstate.num_gates);
+  fingerprint_update(&fp1, &fp2, fpstate.gates, sizeof(gate) * fpstate.num_gates);
   for (int r = 0; r < 22; r++) {
     uint32_t ct = speck_round(fp1, fp2, 0);
     fp1 = ct >> 16;
@@ -80,25 +87,49 @@ static uint32_t state_fingerprint(const state st) {
   return (((uint32_t)fp1) << 16) | fp2;
 }
 
-void save_state(state st) {
+void copy_state(state *dst, const state *src) {
+  assert(src->num_gates <= MAX_GATES);
+  memcpy(dst->tables, src->tables, sizeof(ttable) * src->num_gates);
+  memcpy(dst->gates, src->gates, sizeof(gate) * src->num_gates);
+  dst->max_sat_metric = src->max_sat_metric;
+  dst->sat_metric = src->sat_metric;
+  dst->max_gates = src->max_gates;
+  dst->num_gates = src->num_gates;
+  memcpy(dst->outputs, src->outputs, sizeof(gatenum) * MAX_OUTPUTS);
+  memcpy(dst->gate_hash, src->gate_hash, sizeof(gatenum) * GATE_HASH_SIZE);
+}
+
+/* Returns the number of bytes used for each truth table in the state file for an S-box with the
+   given number of inputs. Truth tables are never shorter than 256 bits, to keep the format the same
+   for all S-boxes with up to 8 inputs. */
+static int file_ttable_size(int num_inputs) {
+  return num_inputs <= 8 ? 32 : (1 << num_inputs) / 8;
+}
+
+void get_state_file_name(const state *st, char *name) {
   /* Generate a string with the output gates present in the state, in the order they were added. */
-  char out[9];
+  char out[MAX_OUTPUTS + 1];
   int num_outputs = 0;
-  memset(out, 0, 9);
-  for (int i = 0; i < st.num_gates; i++) {
-    for (uint8_t k = 0; k < 8; k++) {
-      if (st.outputs[k] == i) {
-        num_outputs += 1;
-        char str[2] = {'0' + k, '\0'};
+  memset(out, 0, MAX_OUTPUTS + 1);
+  for (int i = 0; i < st->num_gates; i++) {
+    for (uint8_t k = 0; k < MAX_OUTPUTS; k++) {
+      if (st->outputs[k] == i) {
+        char str[2] = {"0123456789abcdef"[k], '\0'};
         strcat(out, str);
+        num_outputs += 1;
         break;
       }
     }
   }
 
-  char name[40];
-  assert(snprintf(name, 40, "%d-%03d-%04d-%s-%08x.state", num_outputs,
-    st.num_gates - get_num_inputs(&st), st.sat_metric, out, state_fingerprint(st)) < 40);
+  assert(snprintf(name, STATE_FILE_NAME_SIZE, "%d-%03d-%04d-%s-%08x.state", num_outputs,
+    st->num_gates - get_num_inputs(st), st->sat_metric, out, state_fingerprint(st))
+      < STATE_FILE_NAME_SIZE);
+}
+
+void save_state(state st) {
+  char name[STATE_FILE_NAME_SIZE];
+  get_state_file_name(&st, name);
 
   FILE *fp = fopen(name, "w");
   if (fp == NULL) {
@@ -108,15 +139,17 @@ void save_state(state st) {
   msgpack_packer pk;
   msgpack_packer_init(&pk, fp, msgpack_fbuffer_write);
   msgpack_pack_int(&pk, MSGPACK_FORMAT_VERSION);
-  msgpack_pack_int(&pk, 8); /* Number of inputs. */
-  msgpack_pack_array(&pk, 8); /* Number of outputs. */
-  for (int i = 0; i < 8; i++) {
+  const int num_inputs = get_num_inputs(&st);
+  const int table_size = file_ttable_size(num_inputs);
+  msgpack_pack_int(&pk, num_inputs);
+  msgpack_pack_array(&pk, MAX_OUTPUTS); /* Number of outputs. */
+  for (int i = 0; i < MAX_OUTPUTS; i++) {
     msgpack_pack_int(&pk, st.outputs[i]);
   }
   msgpack_pack_array(&pk, st.num_gates * 6);
   for (int i = 0; i < st.num_gates; i++) {
-    msgpack_pack_bin(&pk, 32);
-    msgpack_pack_bin_body(&pk, &st.gates[i].table, 32);
+    msgpack_pack_bin(&pk, table_size);
+    msgpack_pack_bin_body(&pk, &st.tables[i], table_size);
     msgpack_pack_int(&pk, st.gates[i].type);
     msgpack_pack_int(&pk, st.gates[i].in1);
     msgpack_pack_int(&pk, st.gates[i].in2);
@@ -144,6 +177,89 @@ static int unpack_int(msgpack_unpacker *unp, int *ret) {
   return true;
 }
 
+/* Returns the number of input gates in the state. */
+int get_num_inputs(const state *st) {
+  int inputs = 0;
+  for (int i = 0; st->gates[i].type == IN && i < st->num_gates; i++) {
+    inputs += 1;
+  }
+  return inputs;
+}
+
+/* Returns the slot in the gate hash table where the search for a truth table starts. */
+static inline uint32_t gate_hash_slot(const ttable tbl) {
+  uint64_t hash = 0;
+  for (int i = 0; i < sizeof(ttable) / sizeof(uint64_t); i++) {
+    hash = (hash ^ tbl[i]) * 0x9e3779b97f4a7c15ULL;
+  }
+  return (hash >> 32) & (GATE_HASH_SIZE - 1);
+}
+
+/* Returns the ID of a gate in the state with the truth table table, or NO_GATE if there is none. */
+gatenum find_gate(const state *st, const ttable table) {
+  uint32_t p = gate_hash_slot(table);
+  while (st->gate_hash[p] != NO_GATE) {
+    if (memcmp(&st->tables[st->gate_hash[p]], &table, sizeof(ttable)) == 0) {
+      return st->gate_hash[p];
+    }
+    p = (p + 1) & (GATE_HASH_SIZE - 1);
+  }
+  return NO_GATE;
+}
+
+/* Adds gate gid to the gate hash table of the state. */
+void hash_gate(state *st, gatenum gid) {
+  assert(gid < st->num_gates);
+  uint32_t p = gate_hash_slot(st->tables[gid]);
+  while (st->gate_hash[p] != NO_GATE) {
+    if (memcmp(&st->tables[st->gate_hash[p]], &st->tables[gid], sizeof(ttable)) == 0) {
+      return;
+    }
+    p = (p + 1) & (GATE_HASH_SIZE - 1);
+  }
+  st->gate_hash[p] = gid;
+}
+
+/* Rebuilds the gate hash table of the state from its gates. */
+void rebuild_gate_hash(state *st) {
+  memset(st->gate_hash, 0xff, sizeof(gatenum) * GATE_HASH_SIZE);
+  for (int i = 0; i < st->num_gates; i++) {
+    hash_gate(st, i);
+  }
+}
+
+/* Removes the gates with IDs num_gates and up from the state. The gates are removed from the hash
+   table in the reverse order of insertion, which leaves it as it was before they were added. */
+void rollback_state(state *st, gatenum num_gates) {
+  assert(num_gates <= st->num_gates);
+  while (st->num_gates > num_gates) {
+    const gatenum gid = st->num_gates - 1;
+    uint32_t p = gate_hash_slot(st->tables[gid]);
+    while (st->gate_hash[p] != NO_GATE && st->gate_hash[p] != gid) {
+      p = (p + 1) & (GATE_HASH_SIZE - 1);
+    }
+    st->gate_hash[p] = NO_GATE;
+    if (st->gates[gid].type != LUT) {
+      st->sat_metric -= get_sat_metric(st->gates[gid].type);
+    }
+    st->num_gates -= 1;
+  }
+}
+
+/* Adds num gates with the truth tables tables and the wiring gates to the end of the state. */
+void append_gates(state *st, const ttable *tables, const gate *gates, int num) {
+  assert(st->num_gates + num <= MAX_GATES);
+  for (int i = 0; i < num; i++) {
+    st->tables[st->num_gates] = tables[i];
+    st->gates[st->num_gates] = gates[i];
+    if (gates[i].type != LUT) {
+      st->sat_metric += get_sat_metric(gates[i].type);
+    }
+    st->num_gates += 1;
+    hash_gate(st, st->num_gates - 1);
+  }
+}
+
 /* Returns the SAT metric of the specified gate type. Calling this with the LUT
  * gate type will cause an assertion to fail. */
 int get_sat_metric(gate_type type) {
@@ -203,7 +319,8 @@ bool load_state(const char *name, state *return_state) {
   if (!unpack_int(&unp, &format_version)
       || !unpack_int(&unp, &num_inputs)
       || format_version != MSGPACK_FORMAT_VERSION
-      || num_inputs != 8) {
+      || num_inputs < 1
+      || num_inputs > MAX_INPUTS) {
     msgpack_unpacker_destroy(&unp);
     return false;
   }
@@ -217,21 +334,23 @@ bool load_state(const char *name, state *return_state) {
     msgpack_unpacker_destroy(&unp);
     return false;
   }
+  /* Files written by builds with a larger MAX_OUTPUTS can be loaded as long as the outputs that do
+     not fit are unused. */
   int num_outputs = und.data.via.array.size;
-  if (num_outputs != 8) {
-    msgpack_unpacked_destroy(&und);
-    msgpack_unpacker_destroy(&unp);
-    return false;
+  gatenum outputs[MAX_OUTPUTS];
+  for (int i = 0; i < MAX_OUTPUTS; i++) {
+    outputs[i] = NO_GATE;
   }
-
-  gatenum outputs[8];
-  for (int i = 0; i < 8; i++) {
-    if (und.data.via.array.ptr[i].type != MSGPACK_OBJECT_POSITIVE_INTEGER) {
+  for (int i = 0; i < num_outputs; i++) {
+    if (und.data.via.array.ptr[i].type != MSGPACK_OBJECT_POSITIVE_INTEGER
+        || (i >= MAX_OUTPUTS && und.data.via.array.ptr[i].via.i64 != NO_GATE)) {
       msgpack_unpacked_destroy(&und);
       msgpack_unpacker_destroy(&unp);
       return false;
     }
-    outputs[i] = und.data.via.array.ptr[i].via.i64;
+    if (i < MAX_OUTPUTS) {
+      outputs[i] = und.data.via.array.ptr[i].via.i64;
+    }
   }
   msgpack_unpacked_destroy(&und);
   msgpack_unpacked_init(&und);
@@ -249,7 +368,7 @@ bool load_state(const char *name, state *return_state) {
     msgpack_unpacker_destroy(&unp);
     return false;
   }
-  for (int i = 0; i < 8; i++) {
+  for (int i = 0; i < MAX_OUTPUTS; i++) {
     if (outputs[i] >= arraysize / 6 && outputs[i] != NO_GATE) {
       msgpack_unpacked_destroy(&und);
       msgpack_unpacker_destroy(&unp);
@@ -262,11 +381,11 @@ bool load_state(const char *name, state *return_state) {
   st.sat_metric = 0;
   st.max_gates = MAX_GATES;
   st.num_gates = arraysize / 6;
-  memcpy(st.outputs, outputs, 8 * sizeof(gatenum));
+  memcpy(st.outputs, outputs, MAX_OUTPUTS * sizeof(gatenum));
 
   for (int i = 0; i < st.num_gates; i++) {
     if (und.data.via.array.ptr[i * 6].type != MSGPACK_OBJECT_BIN
-        || und.data.via.array.ptr[i * 6].via.bin.size != 32
+        || und.data.via.array.ptr[i * 6].via.bin.size != file_ttable_size(num_inputs)
         || und.data.via.array.ptr[i * 6 + 1].type != MSGPACK_OBJECT_POSITIVE_INTEGER
         || und.data.via.array.ptr[i * 6 + 2].type != MSGPACK_OBJECT_POSITIVE_INTEGER
         || und.data.via.array.ptr[i * 6 + 3].type != MSGPACK_OBJECT_POSITIVE_INTEGER
@@ -276,7 +395,8 @@ bool load_state(const char *name, state *return_state) {
       msgpack_unpacker_destroy(&unp);
       return false;
     }
-    memcpy(&st.gates[i].table, und.data.via.array.ptr[i * 6].via.bin.ptr, 32);
+    memset(&st.tables[i], 0, sizeof(ttable));
+    memcpy(&st.tables[i], und.data.via.array.ptr[i * 6].via.bin.ptr, file_ttable_size(num_inputs));
     st.gates[i].type = und.data.via.array.ptr[i * 6 + 1].via.i64;
     st.gates[i].in1 = und.data.via.array.ptr[i * 6 + 2].via.i64;
     st.gates[i].in2 = und.data.via.array.ptr[i * 6 + 3].via.i64;
@@ -284,7 +404,7 @@ bool load_state(const char *name, state *return_state) {
     st.gates[i].function = und.data.via.array.ptr[i * 6 + 5].via.i64;
     if (st.gates[i].type > LUT
         || st.gates[i].type < IN
-        || (st.gates[i].type == IN && i >= 8)
+        || (st.gates[i].type == IN && i >= num_inputs)
         || (st.gates[i].type == IN && st.gates[i].in1 != NO_GATE)
         || (st.gates[i].type != IN && st.gates[i].in1 == NO_GATE)
         || ((st.gates[i].type == IN || st.gates[i].type == NOT) && st.gates[i].in2 != NO_GATE)
@@ -301,6 +421,8 @@ bool load_state(const char *name, state *return_state) {
     }
   }
 
+  rebuild_gate_hash(&st);
+
   /* Calculate SAT metric. */
   for (int i = 0; i < st.num_gates; i++) {
     if (st.gates[i].type == LUT) {
@@ -22,20 +22,40 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <x86intrin.h>
 
 #define MAX_GATES 500
+
+/* The largest supported number of S-box inputs and outputs. These can be changed at build time,
+   for instance with -DMAX_INPUTS=9 for 9 bit S-boxes. Builds with the defaults are the fastest for
+   S-boxes with up to 8 inputs. */
+#ifndef MAX_INPUTS
+#define MAX_INPUTS 8
+#endif
+#ifndef MAX_OUTPUTS
+#define MAX_OUTPUTS 8
+#endif
+#if MAX_INPUTS < 8 || MAX_INPUTS > 10
+#error "MAX_INPUTS must be between 8 and 10."
+#endif
+#if MAX_OUTPUTS < 1 || MAX_OUTPUTS > 16
+#error "MAX_OUTPUTS must be between 1 and 16."
+#endif
+#define TTABLE_BITS (1 << MAX_INPUTS) /* Number of bits in a truth table. */
 #define NO_GATE ((gatenum)-1)
+#define GATE_HASH_SIZE 1024 /* Gate hash table size. Power of two, at least 2 * MAX_GATES. */
 #define PRIgatenum PRIu16 /* Used in printf format strings. */
 
 typedef enum {IN, NOT, AND, OR, XOR, ANDNOT, LUT} gate_type;
 typedef enum {GATES, SAT} metric;
 
-typedef __m256i ttable; /* 256 bit truth table. */
+/* Truth table with TTABLE_BITS bits. A generic vector type is used so that the code outside of
+   kernels.c can be compiled without assuming any particular instruction set. */
+typedef uint64_t ttable __attribute__((vector_size(TTABLE_BITS / 8)));
 typedef uint16_t gatenum;
 
+/* Wiring of a gate. The truth tables are kept in a separate array in the state, so that the
+   search loops, which only read the truth tables, can stream through them. */
 typedef struct {
-  ttable table;
   gate_type type;
   gatenum in1; /* Input 1 to the gate. NO_GATE for the inputs. */
   gatenum in2; /* Input 2 to the gate. NO_GATE for NOT gates and the inputs. */
@@ -44,14 +64,22 @@ typedef struct {
 } gate;
 
 typedef struct {
+  ttable tables[MAX_GATES]; /* Truth tables of the gates. */
+  gate gates[MAX_GATES];
+  /* Open addressing hash table of the gates, keyed by truth table. Empty slots are NO_GATE. Gates
+     with the same truth table as an earlier gate are not in the table. */
+  gatenum gate_hash[GATE_HASH_SIZE];
   int max_sat_metric;
   int sat_metric;
   gatenum max_gates;
   gatenum num_gates;  /* Current number of gates. */
-  gatenum outputs[8]; /* Gate number of the respective output gates, or NO_GATE. */
-  gate gates[MAX_GATES];
+  gatenum outputs[MAX_OUTPUTS]; /* Gate number of the respective output gates, or NO_GATE. */
 } state;
 
+/* Copies the state src to dst. Only the num_gates gates in use are copied, which is much cheaper
+   than a struct assignment for states that are far from MAX_GATES gates. */
+void copy_state(state *dst, const state *src);
+
 /* Saves the state st to a file named O-GGG-MMMM-NNNNNNNN-FFFFFFFF.state, where
    O        is the number of output Boolean functions in the circuit;
    GGG      is the number of gates in the circuit;
@@ -61,6 +89,30 @@ typedef struct {
    */
 void save_state(state st);
 
+#define STATE_FILE_NAME_SIZE 60
+
+/* Writes the name of the file that save_state saves st to into name, which must have room for
+   STATE_FILE_NAME_SIZE characters. */
+void get_state_file_name(const state *st, char *name);
+
+/* Returns the number of input gates in the state. */
+int get_num_inputs(const state *st);
+
+/* Returns the ID of a gate in the state with the truth table table, or NO_GATE if there is none. */
+gatenum find_gate(const state *st, const ttable table);
+
+/* Adds gate gid to the gate hash table of the state. */
+void hash_gate(state *st, gatenum gid);
+
+/* Rebuilds the gate hash table of the state from its gates. */
+void rebuild_gate_hash(state *st);
+
+/* Removes the gates with IDs num_gates and up from the state. */
+void rollback_state(state *st, gatenum num_gates);
+
+/* Adds num gates with the truth tables tables and the wiring gates to the end of the state. */
+void append_gates(state *st, const ttable *tables, const gate *gates, int num);
+
 /* Returns the SAT metric of the specified gate type. Calling this with the LUT
  * gate type will cause an assertion to fail. */
 int get_sat_metric(gate_type type);
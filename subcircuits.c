@@ -0,0 +1,127 @@
+/* subcircuits.c
+
+   Functions for loading, saving and looking up circuits in the database of minimum circuits for
+   four input functions. The database is generated with gen_subcircuits.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "subcircuits.h"
+
+/* Size of the file header: magic string, version, andnot flag, metric and maximum number of
+   gates. */
+#define HEADER_SIZE (sizeof(SUBCIRCUIT_FILE_MAGIC) + 4)
+
+/* Loads a database from the file name into db. Returns true on success. */
+bool load_subcircuits(const char *name, subcircuit_db *db) {
+  assert(name != NULL);
+  assert(db != NULL);
+  FILE *fp = fopen(name, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "Error opening file: %s\n", name);
+    return false;
+  }
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, HEADER_SIZE, 1, fp) != 1
+      || memcmp(header, SUBCIRCUIT_FILE_MAGIC, sizeof(SUBCIRCUIT_FILE_MAGIC)) != 0) {
+    fprintf(stderr, "Error: %s is not a subcircuit database.\n", name);
+    fclose(fp);
+    return false;
+  }
+  const uint8_t *fields = header + sizeof(SUBCIRCUIT_FILE_MAGIC);
+  if (fields[0] != SUBCIRCUIT_FILE_VERSION || fields[1] > 1 || fields[2] > SAT
+      || fields[3] != SUBCIRCUIT_MAX_GATES) {
+    fprintf(stderr, "Error: unsupported subcircuit database version.\n");
+    fclose(fp);
+    return false;
+  }
+  db->andnot = fields[1];
+  db->cost_metric = fields[2];
+  if (fread(db->circuits, sizeof(subcircuit), SUBCIRCUIT_FUNCS, fp) != SUBCIRCUIT_FUNCS) {
+    fprintf(stderr, "Error reading subcircuit database.\n");
+    fclose(fp);
+    return false;
+  }
+  fclose(fp);
+
+  /* Check that the circuits only reference earlier gates and gate types in the gate set. */
+  for (int f = 0; f < SUBCIRCUIT_FUNCS; f++) {
+    const subcircuit *c = &db->circuits[f];
+    bool ok = c->num_gates <= SUBCIRCUIT_MAX_GATES;
+    for (int g = 0; ok && g < c->num_gates; g++) {
+      ok = c->type[g] >= NOT && c->type[g] <= (db->andnot ? ANDNOT : XOR) && c->in1[g] < 4 + g
+          && c->in2[g] < 4 + g;
+    }
+    if (!ok) {
+      fprintf(stderr, "Error: bad circuit in subcircuit database.\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Saves the database db to the file name. Returns true on success. */
+bool save_subcircuits(const char *name, const subcircuit_db *db) {
+  assert(name != NULL);
+  assert(db != NULL);
+  FILE *fp = fopen(name, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "Error opening file: %s\n", name);
+    return false;
+  }
+  uint8_t header[HEADER_SIZE];
+  memcpy(header, SUBCIRCUIT_FILE_MAGIC, sizeof(SUBCIRCUIT_FILE_MAGIC));
+  uint8_t *fields = header + sizeof(SUBCIRCUIT_FILE_MAGIC);
+  fields[0] = SUBCIRCUIT_FILE_VERSION;
+  fields[1] = db->andnot;
+  fields[2] = db->cost_metric;
+  fields[3] = SUBCIRCUIT_MAX_GATES;
+  bool ret = fwrite(header, HEADER_SIZE, 1, fp) == 1
+      && fwrite(db->circuits, sizeof(subcircuit), SUBCIRCUIT_FUNCS, fp) == SUBCIRCUIT_FUNCS;
+  if (fclose(fp) != 0) {
+    ret = false;
+  }
+  if (!ret) {
+    fprintf(stderr, "Error writing subcircuit database.\n");
+  }
+  return ret;
+}
+
+/* Returns the cheapest circuit in db for a partially specified function, or NULL if there is none.
+   Only the bits set in care are specified. Functions with more than max_free unspecified bits are
+   not looked up. */
+const subcircuit *get_subcircuit(const subcircuit_db *db, uint16_t func, uint16_t care,
+    int max_free) {
+  const uint16_t free = ~care;
+  if (__builtin_popcount(free) > max_free) {
+    return NULL;
+  }
+  func &= care;
+  const subcircuit *best = NULL;
+  /* Iterate over all fully specified functions that agree with func in care. */
+  for (uint16_t sub = free;; sub = (sub - 1) & free) {
+    const subcircuit *c = &db->circuits[func | sub];
+    if (c->num_gates != 0 && (best == NULL || c->cost < best->cost)) {
+      best = c;
+    }
+    if (sub == 0) {
+      break;
+    }
+  }
+  return best;
+}
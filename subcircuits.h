@@ -0,0 +1,64 @@
+/* subcircuits.h
+
+   Header file for the database of minimum circuits for four input functions.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __SUBCIRCUITS_H__
+#define __SUBCIRCUITS_H__
+
+#include "state.h"
+
+#define SUBCIRCUIT_MAX_GATES 5       /* Largest circuits in the database. */
+#define SUBCIRCUIT_FUNCS 65536       /* Number of four input functions. */
+#define SUBCIRCUIT_FILE_VERSION 1
+#define SUBCIRCUIT_FILE_MAGIC "SBGSUBC"
+
+/* A minimum circuit for a four input function. Inputs 0-3 of the gates are the inputs of the
+   circuit, with input 0 corresponding to the most significant bit of the function index, and input
+   4 + i is the output of gate i. The last gate is the output of the circuit. Both inputs of NOT
+   gates are equal. */
+typedef struct {
+  uint8_t num_gates; /* 0 if there is no circuit for the function in the database. */
+  uint8_t cost;      /* Number of gates or SAT metric. */
+  uint8_t type[SUBCIRCUIT_MAX_GATES];
+  uint8_t in1[SUBCIRCUIT_MAX_GATES];
+  uint8_t in2[SUBCIRCUIT_MAX_GATES];
+} subcircuit;
+
+/* A database with one entry for each four input function, for one gate set and metric. */
+typedef struct {
+  bool andnot;
+  metric cost_metric;
+  subcircuit circuits[SUBCIRCUIT_FUNCS];
+} subcircuit_db;
+
+/* Truth tables of the four inputs. */
+static const uint16_t SUBCIRCUIT_INPUTS[4] = {0xff00, 0xf0f0, 0xcccc, 0xaaaa};
+
+/* Loads a database from the file name into db. Returns true on success. */
+bool load_subcircuits(const char *name, subcircuit_db *db);
+
+/* Saves the database db to the file name. Returns true on success. */
+bool save_subcircuits(const char *name, const subcircuit_db *db);
+
+/* Returns the cheapest circuit in db for a partially specified function, or NULL if there is none.
+   Only the bits set in care are specified. Functions with more than max_free unspecified bits are
+   not looked up. */
+const subcircuit *get_subcircuit(const subcircuit_db *db, uint16_t func, uint16_t care,
+    int max_free);
+
+#endif /* __SUBCIRCUITS_H__ */
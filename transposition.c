@@ -0,0 +1,170 @@
+/* transposition.c
+
+   A transposition table of create_circuit subproblems. The same subproblems come up again in the
+   step 5 branches for different input bit orders, and in later iterations and outputs. The table
+   is direct mapped, and a new entry always replaces the old entry in its slot. Each thread has its
+   own table, so that no locking is needed.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kernels.h"
+#include "transposition.h"
+
+static __thread transposition_entry *g_entries = NULL;
+static __thread uint64_t g_num_entries = 0; /* Power of two. */
+static __thread uint32_t g_generation = 1;
+
+static __thread uint64_t g_lookups = 0;
+static __thread uint64_t g_circuit_hits = 0;
+static __thread uint64_t g_failure_hits = 0;
+static __thread uint64_t g_stores = 0;
+
+/* Statistics of the tables of threads that have freed their tables. */
+static uint64_t g_freed_lookups = 0;
+static uint64_t g_freed_circuit_hits = 0;
+static uint64_t g_freed_failure_hits = 0;
+static uint64_t g_freed_stores = 0;
+
+bool init_transposition_table(size_t size) {
+  assert(g_entries == NULL);
+  g_num_entries = 1;
+  while (g_num_entries * 2 * sizeof(transposition_entry) <= size) {
+    g_num_entries *= 2;
+  }
+  if (g_num_entries * sizeof(transposition_entry) > size) {
+    g_num_entries = 0;
+    return true;
+  }
+  g_entries = calloc(g_num_entries, sizeof(transposition_entry));
+  return g_entries != NULL;
+}
+
+void free_transposition_table() {
+  free(g_entries);
+  g_entries = NULL;
+  g_num_entries = 0;
+  __atomic_fetch_add(&g_freed_lookups, g_lookups, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_freed_circuit_hits, g_circuit_hits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_freed_failure_hits, g_failure_hits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_freed_stores, g_stores, __ATOMIC_RELAXED);
+  g_lookups = 0;
+  g_circuit_hits = 0;
+  g_failure_hits = 0;
+  g_stores = 0;
+}
+
+bool transposition_table_enabled() {
+  return g_entries != NULL;
+}
+
+void clear_transposition_table() {
+  g_generation += 1;
+}
+
+/* Feeds the word w into the two halves of the key. */
+static inline void key_update(transposition_key *key, uint64_t w) {
+  key->h1 = (key->h1 ^ w) * 0x9e3779b97f4a7c15UL;
+  key->h1 ^= key->h1 >> 32;
+  key->h2 = (key->h2 + w) * 0xff51afd7ed558ccdUL;
+  key->h2 ^= key->h2 >> 29;
+}
+
+transposition_key get_transposition_key(const state *st, const ttable target, const ttable mask,
+    uint32_t used_bits, int discrepancies) {
+  assert(discrepancies >= 0 && discrepancies <= 0xffff);
+  transposition_key key = {0x243f6a8885a308d3UL, 0x13198a2e03707344UL};
+  key_update(&key, ((uint64_t)st->num_gates << 48) | ((uint64_t)discrepancies << 32) | used_bits);
+  const ttable mtarget = target & mask;
+  for (int i = 0; i < TTABLE_WORDS; i++) {
+    key_update(&key, mtarget[i]);
+    key_update(&key, mask[i]);
+  }
+  for (int g = 0; g < st->num_gates; g++) {
+    for (int i = 0; i < TTABLE_WORDS; i++) {
+      key_update(&key, st->tables[g][i]);
+    }
+  }
+  return key;
+}
+
+/* Returns the slot of key. */
+static inline transposition_entry *get_slot(const transposition_key *key) {
+  return &g_entries[key->h1 & (g_num_entries - 1)];
+}
+
+const transposition_entry *lookup_transposition(const transposition_key *key, int gate_budget,
+    int sat_budget) {
+  g_lookups += 1;
+  const transposition_entry *e = get_slot(key);
+  if (e->generation != g_generation || e->key.h1 != key->h1 || e->key.h2 != key->h2) {
+    return NULL;
+  }
+  if (e->found) {
+    g_circuit_hits += 1;
+    return e;
+  }
+  if (gate_budget <= e->gate_budget && sat_budget <= e->sat_budget) {
+    g_failure_hits += 1;
+    return e;
+  }
+  return NULL;
+}
+
+void store_transposition_circuit(const transposition_key *key, const state *st, gatenum start,
+    gatenum out) {
+  assert(start <= st->num_gates);
+  const int len = st->num_gates - start;
+  if (len > TRANSPOSITION_MAX_GATES) {
+    return;
+  }
+  transposition_entry *e = get_slot(key);
+  e->key = *key;
+  e->generation = g_generation;
+  e->found = true;
+  e->len = len;
+  e->out = out;
+  memcpy(e->gates, st->gates + start, sizeof(gate) * len);
+  g_stores += 1;
+}
+
+void store_transposition_failure(const transposition_key *key, int gate_budget, int sat_budget) {
+  transposition_entry *e = get_slot(key);
+  e->key = *key;
+  e->generation = g_generation;
+  e->found = false;
+  e->len = 0;
+  e->out = NO_GATE;
+  e->gate_budget = gate_budget;
+  e->sat_budget = sat_budget;
+  g_stores += 1;
+}
+
+void print_transposition_stats() {
+  const uint64_t lookups = g_lookups + __atomic_load_n(&g_freed_lookups, __ATOMIC_RELAXED);
+  const uint64_t failure_hits = g_failure_hits
+      + __atomic_load_n(&g_freed_failure_hits, __ATOMIC_RELAXED);
+  const uint64_t hits = g_circuit_hits + failure_hits
+      + __atomic_load_n(&g_freed_circuit_hits, __ATOMIC_RELAXED);
+  const uint64_t stores = g_stores + __atomic_load_n(&g_freed_stores, __ATOMIC_RELAXED);
+  printf("Transposition table: %" PRIu64 " lookups, %" PRIu64 " hits (%.1f%%), %" PRIu64
+      " of them without a circuit, %" PRIu64 " stores.\n", lookups, hits,
+      lookups == 0 ? 0.0 : 100.0 * hits / lookups, failure_hits, stores);
+}
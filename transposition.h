@@ -0,0 +1,87 @@
+/* transposition.h
+
+   Header file for the transposition table of create_circuit subproblems.
+
+   Copyright (c) 2019 Marcus Dansarie
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef __TRANSPOSITION_H__
+#define __TRANSPOSITION_H__
+
+#include <stddef.h>
+#include "state.h"
+
+#define TRANSPOSITION_MAX_GATES 16 /* Largest circuits stored in the table. */
+
+/* Hash of a subproblem: the gates of the state, the masked target, the mask, the input bits that
+   have already been used for selection and the number of discrepancies left. */
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+} transposition_key;
+
+/* The result of a subproblem. If found is set, the circuit is the gates added to the state, and
+   out is the output gate, which may be one of the gates already in the state. Otherwise, no circuit
+   was found with at most gate_budget more gates and sat_budget more SAT metric. */
+typedef struct {
+  transposition_key key;
+  uint32_t generation; /* The entry is empty unless this is the current generation. */
+  bool found;
+  uint8_t len;
+  gatenum out;
+  int gate_budget;
+  int sat_budget;
+  gate gates[TRANSPOSITION_MAX_GATES];
+} transposition_entry;
+
+/* Allocates a transposition table of at most size bytes for the calling thread. Returns false if
+   the allocation failed. */
+bool init_transposition_table(size_t size);
+
+/* Frees the transposition table of the calling thread. Its statistics are kept for
+   print_transposition_stats. */
+void free_transposition_table();
+
+/* Returns true if a transposition table has been allocated for the calling thread. */
+bool transposition_table_enabled();
+
+/* Empties the transposition table of the calling thread. */
+void clear_transposition_table();
+
+/* Returns the key of the subproblem of building target in the positions where mask is set from the
+   gates in st. Bit i of used_bits is set if input i has been used for selection. discrepancies is
+   the number of discrepancies left in a limited discrepancy search. */
+transposition_key get_transposition_key(const state *st, const ttable target, const ttable mask,
+    uint32_t used_bits, int discrepancies);
+
+/* Returns the entry for key, if there is a circuit for it or it is known that there is no circuit
+   within gate_budget more gates and sat_budget more SAT metric. Otherwise NULL is returned. */
+const transposition_entry *lookup_transposition(const transposition_key *key, int gate_budget,
+    int sat_budget);
+
+/* Stores the circuit made up of the gates after the first start gates in st, with output gate out,
+   as the result for key. Circuits with more than TRANSPOSITION_MAX_GATES gates are not stored. */
+void store_transposition_circuit(const transposition_key *key, const state *st, gatenum start,
+    gatenum out);
+
+/* Stores that no circuit was found for key within gate_budget more gates and sat_budget more SAT
+   metric. */
+void store_transposition_failure(const transposition_key *key, int gate_budget, int sat_budget);
+
+/* Prints the lookup statistics of the transposition tables of the calling thread and of all
+   threads that have freed their tables. */
+void print_transposition_stats();
+
+#endif /* __TRANSPOSITION_H__ */